@@ -3,18 +3,31 @@
 # Navigate to the script's directory to ensure relative paths work
 cd "$(dirname "$0")"
 
-echo "Building BitNet-WASM..."
+# Build variant: "st" (default, single-threaded bitnet.js) or "mt" (pthreads,
+# SharedArrayBuffer heap, bitnet-mt.js). The mt build needs a cross-origin
+# isolated page in browsers, or Node with worker_threads.
+BUILD_VARIANT="${1:-st}"
+if [ "$BUILD_VARIANT" != "st" ] && [ "$BUILD_VARIANT" != "mt" ]; then
+    echo "Usage: $0 [st|mt]"
+    exit 1
+fi
+
+# Workers spawned at startup for the mt build; ggml can use this many threads
+# plus the calling one
+PTHREAD_POOL_SIZE="${BITNET_PTHREAD_POOL_SIZE:-8}"
+
+echo "Building BitNet-WASM ($BUILD_VARIANT)..."
 
 # Activate Emscripten SDK environment
 echo "Activating Emscripten SDK..."
 source emsdk/emsdk_env.sh
 
 # Define source files and include directories with BitNet + WASM safety
-BITNET_SOURCES="src/bitnet_wasm.cpp src/build-info.cpp 3rdparty/BitNet/src/ggml-bitnet-lut.cpp 3rdparty/BitNet/src/ggml-bitnet-mad.cpp 3rdparty/BitNet/3rdparty/llama.cpp/ggml/src/ggml.c 3rdparty/BitNet/3rdparty/llama.cpp/ggml/src/ggml-quants.c 3rdparty/BitNet/3rdparty/llama.cpp/ggml/src/ggml-backend.cpp 3rdparty/BitNet/3rdparty/llama.cpp/ggml/src/ggml-alloc.c 3rdparty/BitNet/3rdparty/llama.cpp/src/llama.cpp 3rdparty/BitNet/3rdparty/llama.cpp/src/llama-vocab.cpp 3rdparty/BitNet/3rdparty/llama.cpp/src/llama-sampling.cpp 3rdparty/BitNet/3rdparty/llama.cpp/src/llama-grammar.cpp 3rdparty/BitNet/3rdparty/llama.cpp/src/unicode.cpp 3rdparty/BitNet/3rdparty/llama.cpp/src/unicode-data.cpp 3rdparty/BitNet/3rdparty/llama.cpp/common/common.cpp 3rdparty/BitNet/3rdparty/llama.cpp/common/sampling.cpp 3rdparty/BitNet/3rdparty/llama.cpp/common/arg.cpp 3rdparty/BitNet/3rdparty/llama.cpp/common/log.cpp"
-INCLUDE_DIRS="-Iinclude -I3rdparty/BitNet/include -I3rdparty/BitNet/3rdparty/llama.cpp/ggml/include -I3rdparty/BitNet/3rdparty/llama.cpp/include -I3rdparty/BitNet/3rdparty/llama.cpp/ggml/src -I3rdparty/BitNet/3rdparty/llama.cpp/common"
+BITNET_SOURCES="src/bitnet_wasm.cpp src/bitnet_gguf.cpp src/bitnet_log.cpp src/bitnet_profile.cpp src/bitnet_vocab.cpp src/bitnet_sampler.cpp src/bitnet_draft.cpp src/bitnet_memplan.cpp src/bitnet_embed.cpp src/bitnet_grammar.cpp src/bitnet_pager.cpp src/bitnet_cache.cpp src/build-info.cpp src/ggml-bitnet-mad-wasm.cpp src/ggml-bitnet-mad-upstream.cpp 3rdparty/BitNet/src/ggml-bitnet-lut.cpp 3rdparty/BitNet/3rdparty/llama.cpp/ggml/src/ggml.c 3rdparty/BitNet/3rdparty/llama.cpp/ggml/src/ggml-quants.c 3rdparty/BitNet/3rdparty/llama.cpp/ggml/src/ggml-backend.cpp 3rdparty/BitNet/3rdparty/llama.cpp/ggml/src/ggml-alloc.c 3rdparty/BitNet/3rdparty/llama.cpp/src/llama.cpp 3rdparty/BitNet/3rdparty/llama.cpp/src/llama-vocab.cpp 3rdparty/BitNet/3rdparty/llama.cpp/src/llama-sampling.cpp 3rdparty/BitNet/3rdparty/llama.cpp/src/llama-grammar.cpp 3rdparty/BitNet/3rdparty/llama.cpp/src/unicode.cpp 3rdparty/BitNet/3rdparty/llama.cpp/src/unicode-data.cpp 3rdparty/BitNet/3rdparty/llama.cpp/common/common.cpp 3rdparty/BitNet/3rdparty/llama.cpp/common/sampling.cpp 3rdparty/BitNet/3rdparty/llama.cpp/common/arg.cpp 3rdparty/BitNet/3rdparty/llama.cpp/common/log.cpp 3rdparty/BitNet/3rdparty/llama.cpp/common/json-schema-to-grammar.cpp"
+INCLUDE_DIRS="-Iinclude -I3rdparty/BitNet/include -I3rdparty/BitNet/3rdparty/llama.cpp/ggml/include -I3rdparty/BitNet/3rdparty/llama.cpp/include -I3rdparty/BitNet/3rdparty/llama.cpp/src -I3rdparty/BitNet/3rdparty/llama.cpp/ggml/src -I3rdparty/BitNet/3rdparty/llama.cpp/common"
 
 # Define compilation flags for BitNet with WASM memory safety
-COMPILATION_DEFINES="-DGGML_USE_BITNET=1 -DNDEBUG=1 -DGGML_BITNET_ARM_TL1=1 -DGGML_NO_ACCELERATE=1 -DGGML_NO_OPENMP=1 -DGGML_WASM_SINGLE_THREAD=1 -DGGML_BITNET_WASM_SAFE=1"
+COMPILATION_DEFINES="-DGGML_USE_BITNET=1 -DNDEBUG=1 -DGGML_BITNET_ARM_TL1=1 -DGGML_NO_ACCELERATE=1 -DGGML_NO_OPENMP=1 -DGGML_BITNET_WASM_SAFE=1"
 
 # Add warning suppressions for deprecated C++17 features in upstream code
 WARNING_FLAGS="-Wno-deprecated-declarations -Wno-incompatible-pointer-types -Wno-incompatible-pointer-types-discards-qualifiers"
@@ -22,9 +35,30 @@ WARNING_FLAGS="-Wno-deprecated-declarations -Wno-incompatible-pointer-types -Wno
 # Output WASM file name
 OUTPUT_FILE="bitnet.wasm"
 OUTPUT_JS_FILE="bitnet.js" # Emscripten generates a JS loader
+OUTPUT_ESM_FILE="bitnet.mjs" # ... and an ES module loader for the worker runtime
+
+# Threading flags for the selected variant
+if [ "$BUILD_VARIANT" = "mt" ]; then
+    OUTPUT_FILE="bitnet-mt.wasm"
+    OUTPUT_JS_FILE="bitnet-mt.js"
+    OUTPUT_ESM_FILE="bitnet-mt.mjs"
+    THREAD_FLAGS="-pthread -s USE_PTHREADS=1 -s SHARED_MEMORY=1 -s PTHREAD_POOL_SIZE=$PTHREAD_POOL_SIZE -s ENVIRONMENT=web,worker,node"
+    COMPILATION_DEFINES="$COMPILATION_DEFINES -DBITNET_PTHREAD_POOL_SIZE=$PTHREAD_POOL_SIZE"
+else
+    THREAD_FLAGS="-s USE_PTHREADS=0 -s PTHREAD_POOL_SIZE=0"
+    COMPILATION_DEFINES="$COMPILATION_DEFINES -DGGML_WASM_SINGLE_THREAD=1"
+fi
 
-# Emscripten compiler flags - Conservative settings for BitNet debugging
-EMCC_FLAGS="-O1 -s BUILD_AS_WORKER=0 -s WASM=1 -s MODULARIZE=1 -s EXPORT_ES6=0 -s EXPORTED_RUNTIME_METHODS=['ccall','cwrap','HEAPU8','HEAPU32','HEAPF32','HEAP8','HEAP32','lengthBytesUTF8','stringToUTF8','UTF8ToString'] -s EXPORTED_FUNCTIONS=['_malloc','_free','_bitnet_init','_bitnet_load_model_from_memory','_bitnet_run_inference_simple','_bitnet_is_model_loaded','_bitnet_get_vocab_size','_bitnet_get_embedding_dim','_bitnet_get_num_layers','_bitnet_free_model','_bitnet_cleanup'] -s ALLOW_MEMORY_GROWTH=1 -s INITIAL_MEMORY=1500MB -s MAXIMUM_MEMORY=4GB -s FORCE_FILESYSTEM=1 -s STACK_SIZE=64MB -s DISABLE_EXCEPTION_CATCHING=0 -s ASSERTIONS=1 -s USE_PTHREADS=0 -s PTHREAD_POOL_SIZE=0 --bind -s ERROR_ON_UNDEFINED_SYMBOLS=0 -s MALLOC=dlmalloc -s NO_EXIT_RUNTIME=1 -s WASM_BIGINT=1"
+# SIMD128 selects the vectorized i2_s kernel in src/ggml-bitnet-mad-wasm.cpp;
+# build with BITNET_SIMD=0 for runtimes without it (scalar kernel)
+if [ "${BITNET_SIMD:-1}" = "1" ]; then
+    SIMD_FLAGS="-msimd128"
+else
+    SIMD_FLAGS=""
+fi
+
+# Emscripten compiler flags
+EMCC_FLAGS="-O2 $SIMD_FLAGS -s BUILD_AS_WORKER=0 -s WASM=1 -s MODULARIZE=1 -s EXPORT_ES6=0 -s EXPORTED_RUNTIME_METHODS=['ccall','cwrap','HEAPU8','HEAPU32','HEAPF32','HEAPF64','HEAP8','HEAP32','lengthBytesUTF8','stringToUTF8','UTF8ToString','FS'] -s EXPORTED_FUNCTIONS=['_malloc','_free','_bitnet_init','_bitnet_load_model','_bitnet_load_model_from_memory','_bitnet_load_model_from_file','_bitnet_load_begin','_bitnet_load_feed','_bitnet_load_header_ready','_bitnet_load_end','_bitnet_load_abort','_bitnet_inference_run','_bitnet_generate_begin','_bitnet_generate_begin_grammar','_bitnet_generate_next','_bitnet_generate_is_done','_bitnet_cancel','_bitnet_cancel_clear','_bitnet_cancel_arm','_bitnet_cancel_flag_ptr','_bitnet_kv_cache_clear','_bitnet_session_save','_bitnet_session_load','_bitnet_get_model_hash','_bitnet_set_cache_export','_bitnet_write_model_cache','_bitnet_model_is_cached','_bitnet_set_n_parallel','_bitnet_set_kv_cache_type','_bitnet_set_memory_budget','_bitnet_get_memory_plan','_bitnet_set_paging','_bitnet_get_paging_stats','_bitnet_set_lookup_decoding','_bitnet_draft_load_from_file','_bitnet_draft_load_from_memory','_bitnet_draft_unload','_bitnet_set_draft_decoding','_bitnet_set_context_shift','_bitnet_embed','_bitnet_embed_unload','_bitnet_grammar_compile','_bitnet_grammar_compile_json_schema','_bitnet_grammar_free','_bitnet_set_n_threads','_bitnet_get_n_threads','_bitnet_seq_start','_bitnet_batch_step','_bitnet_seq_take_output','_bitnet_seq_is_done','_bitnet_seq_release','_bitnet_get_model_info','_bitnet_get_stats','_bitnet_run_inference_simple','_bitnet_is_model_loaded','_bitnet_get_vocab_size','_bitnet_get_embedding_dim','_bitnet_get_num_layers','_bitnet_free_model','_bitnet_cleanup','_bitnet_kernel_selftest','_bitnet_sampler_selftest','_bitnet_trace_drain','_bitnet_trace_dropped','_bitnet_set_profiling','_bitnet_get_profile','_bitnet_vocab_blob','_bitnet_vocab_offsets','_bitnet_vocab_n_tokens','_bitnet_detokenize','_bitnet_generate_last_token'] -s ALLOW_MEMORY_GROWTH=1 -s INITIAL_MEMORY=512MB -s MAXIMUM_MEMORY=4GB -s FORCE_FILESYSTEM=1 -s STACK_SIZE=64MB -s DISABLE_EXCEPTION_CATCHING=0 -s ASSERTIONS=1 --bind -s ERROR_ON_UNDEFINED_SYMBOLS=0 -s MALLOC=dlmalloc -s NO_EXIT_RUNTIME=1 -s WASM_BIGINT=1"
 
 # Prepare bitnet-lut-kernels.h by copying a preset one to local include (using ARM TL1 for WASM safety)
 PRESET_KERNEL_HEADER="3rdparty/BitNet/preset_kernels/bitnet_b1_58-3B/bitnet-lut-kernels-tl1.h"
@@ -50,8 +84,8 @@ fi
 echo "Using real GGML and BitNet sources from 3rdparty folders..."
 
 echo "Compiling with Emscripten..."
-echo "Executing: emcc $EMCC_FLAGS $WARNING_FLAGS $COMPILATION_DEFINES $INCLUDE_DIRS $BITNET_SOURCES -o $OUTPUT_JS_FILE"
-emcc $EMCC_FLAGS $WARNING_FLAGS $COMPILATION_DEFINES $INCLUDE_DIRS $BITNET_SOURCES -o $OUTPUT_JS_FILE > emcc_stdout.log 2> emcc_stderr.log
+echo "Executing: emcc $EMCC_FLAGS $THREAD_FLAGS $WARNING_FLAGS $COMPILATION_DEFINES $INCLUDE_DIRS $BITNET_SOURCES -o $OUTPUT_JS_FILE"
+emcc $EMCC_FLAGS $THREAD_FLAGS $WARNING_FLAGS $COMPILATION_DEFINES $INCLUDE_DIRS $BITNET_SOURCES -o $OUTPUT_JS_FILE > emcc_stdout.log 2> emcc_stderr.log
 EMCC_EXIT_CODE=$?
 echo "emcc exit code: $EMCC_EXIT_CODE"
 echo "--- emcc stderr ---"
@@ -61,9 +95,22 @@ echo "--- emcc stdout ---"
 cat emcc_stdout.log
 echo "--- end emcc stdout ---"
 
-if [ $EMCC_EXIT_CODE -eq 0 ] && [ -f "$OUTPUT_FILE" ] && [ -f "$OUTPUT_JS_FILE" ]; then
+# The worker runtime (src/bitnet_worker.js) runs as a module worker, which can
+# only import an ES module loader. Emscripten emits one loader per link, so
+# link a second time with EXPORT_ES6; it shares the .wasm of the first.
+if [ $EMCC_EXIT_CODE -eq 0 ]; then
+    echo "Linking the ES module loader $OUTPUT_ESM_FILE..."
+    emcc $EMCC_FLAGS -s EXPORT_ES6=1 $THREAD_FLAGS $WARNING_FLAGS $COMPILATION_DEFINES $INCLUDE_DIRS $BITNET_SOURCES -o $OUTPUT_ESM_FILE > emcc_esm_stdout.log 2> emcc_esm_stderr.log
+    EMCC_EXIT_CODE=$?
+    echo "emcc (ES module) exit code: $EMCC_EXIT_CODE"
+    if [ $EMCC_EXIT_CODE -ne 0 ]; then
+        cat emcc_esm_stderr.log
+    fi
+fi
+
+if [ $EMCC_EXIT_CODE -eq 0 ] && [ -f "$OUTPUT_FILE" ] && [ -f "$OUTPUT_JS_FILE" ] && [ -f "$OUTPUT_ESM_FILE" ]; then
     echo "Build successful!"
-    echo "Output files: $OUTPUT_JS_FILE, $OUTPUT_FILE"
+    echo "Output files: $OUTPUT_JS_FILE, $OUTPUT_ESM_FILE, $OUTPUT_FILE"
 else
     echo "Build failed. Please check the output from emcc."
     exit 1
@@ -5,6 +5,14 @@ const fs = require('fs');
 const app = express();
 const PORT = 8000;
 
+// Cross-origin isolation, required for SharedArrayBuffer in the
+// multithreaded build (bitnet-mt.js)
+app.use((req, res, next) => {
+    res.set('Cross-Origin-Opener-Policy', 'same-origin');
+    res.set('Cross-Origin-Embedder-Policy', 'require-corp');
+    next();
+});
+
 // Serve static files from the current directory
 app.use(express.static(__dirname, {
     index: ['index.html']
@@ -0,0 +1,369 @@
+// Native benchmark for the bitnet_* C API
+//
+// Links the same bitnet_wasm.cpp the WASM build uses and reports load time,
+// peak RSS, prefill/decode throughput and per-token latency as one JSON
+// object on stdout. Without --model it runs against a synthetic fixture
+// (gguf_fixture.cpp), so results are reproducible offline.
+//
+//   bitnet-bench [--model PATH] [--threads N] [--runs N] [--n-predict N]
+//                [--prompt-chars N] [--seed N] [--lookup N] [--draft PATH [--n-draft N]]
+//                [--kv-type f16|q8_0|q4_0] [--memory-mb N] [--n-ctx N] [--embed N] [--paging N]
+//                [--cache PATH] [--write-fixture PATH] [--verbose]
+//
+// --lookup N switches to greedy decoding with up to N prompt-lookup drafts
+// per step (0 = greedy without drafting), see bitnet_set_lookup_decoding.
+// --draft PATH loads a draft model for speculative decoding with up to
+// --n-draft (default 8) proposals per round.
+// --kv-type sets both KV cache types; --memory-mb and --n-ctx bound the
+// context the load-time planner picks, see bitnet_set_memory_budget.
+// --embed N also embeds N texts of varying length in one bitnet_embed call
+// and reports texts/sec.
+// --paging N pages per-layer weights through a pool of N layers, see
+// bitnet_set_paging; peak_rss_mb then reflects the pool, not the model.
+// --cache PATH writes a preprocessed cache file to PATH after the load,
+// then reloads from it (cache_load_ms) and runs the rest of the bench on
+// the cached model, see bitnet_set_cache_export.
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <sys/resource.h>
+
+#include "gguf_fixture.h"
+
+extern "C" {
+    void bitnet_init();
+    int bitnet_load_model_from_file(const char* path);
+    void bitnet_free_model();
+    void bitnet_set_cache_export(const char* path);
+    int bitnet_write_model_cache();
+    int bitnet_model_is_cached();
+    int bitnet_set_n_threads(int n_threads);
+    void bitnet_set_lookup_decoding(int n_draft, int ngram_size);
+    int bitnet_draft_load_from_file(const char* path);
+    void bitnet_set_draft_decoding(int n_draft_max);
+    int bitnet_set_kv_cache_type(int type_k, int type_v);
+    void bitnet_set_memory_budget(int budget_mb, int n_ctx_max);
+    const char* bitnet_get_memory_plan();
+    int bitnet_set_paging(int n_slots);
+    const char* bitnet_get_paging_stats();
+    int bitnet_embed(const char* const* texts, int n_texts, int pooling, float* out);
+    int bitnet_get_embedding_dim();
+    int bitnet_get_n_threads();
+    int bitnet_generate_begin(const char* input_text, int max_new_tokens);
+    const char* bitnet_generate_next();
+    void bitnet_kv_cache_clear();
+    int bitnet_inference_run(const char* input_text, char* output_buffer, int max_output_len);
+    const char* bitnet_get_stats();
+    int bitnet_kernel_selftest();
+    int bitnet_sampler_selftest(int n_steps);
+    void bitnet_cleanup();
+}
+
+namespace {
+
+struct bench_args {
+    std::string model;
+    std::string write_fixture;
+    std::string draft;
+    int n_threads = 0;
+    int runs = 5;
+    int n_predict = 64;
+    int prompt_chars = 256;
+    uint32_t seed = 42;
+    int lookup = -1;
+    int n_draft = 8;
+    std::string kv_type = "f16";
+    int memory_mb = 0;
+    int n_ctx = 0;
+    int embed = 0;
+    int paging = 0;
+    std::string cache;
+    bool verbose = false;
+};
+
+double now_ms() {
+    using namespace std::chrono;
+    return duration<double, std::milli>(steady_clock::now().time_since_epoch()).count();
+}
+
+double peak_rss_mb() {
+    rusage usage = {};
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss / 1024.0;  // ru_maxrss is in KiB on Linux
+}
+
+double percentile(std::vector<double> values, double p) {
+    if (values.empty()) return 0.0;
+    std::sort(values.begin(), values.end());
+    const size_t idx = std::min(values.size() - 1, static_cast<size_t>(p * (values.size() - 1) + 0.5));
+    return values[idx];
+}
+
+// Pull a numeric field out of the flat JSON from bitnet_get_stats
+double stats_field(const std::string& json, const char* key) {
+    const std::string needle = std::string("\"") + key + "\":";
+    const size_t pos = json.find(needle);
+    return pos == std::string::npos ? 0.0 : std::atof(json.c_str() + pos + needle.size());
+}
+
+// ggml_type id of a KV cache type name, -1 if unknown
+int kv_type_id(const std::string& name) {
+    if (name == "f16")  return 1;
+    if (name == "q8_0") return 8;
+    if (name == "q4_0") return 2;
+    return -1;
+}
+
+// Deterministic prompt: cycles through a short sentence until prompt_chars long
+std::string make_prompt(int prompt_chars) {
+    const std::string sentence = "The quick brown fox jumps over the lazy dog. ";
+    std::string prompt;
+    while (static_cast<int>(prompt.size()) < prompt_chars) {
+        prompt += sentence;
+    }
+    prompt.resize(prompt_chars);
+    return prompt;
+}
+
+bool parse_args(int argc, char** argv, bench_args& args) {
+    for (int i = 1; i < argc; ++i) {
+        const std::string arg = argv[i];
+        auto next = [&]() -> const char* { return i + 1 < argc ? argv[++i] : nullptr; };
+        const char* value = nullptr;
+
+        if (arg == "--verbose") {
+            args.verbose = true;
+            continue;
+        }
+        if (!(value = next())) {
+            std::cerr << "Missing value for " << arg << std::endl;
+            return false;
+        }
+        if (arg == "--model")              args.model = value;
+        else if (arg == "--write-fixture") args.write_fixture = value;
+        else if (arg == "--threads")       args.n_threads = std::atoi(value);
+        else if (arg == "--runs")          args.runs = std::max(1, std::atoi(value));
+        else if (arg == "--n-predict")     args.n_predict = std::max(1, std::atoi(value));
+        else if (arg == "--prompt-chars")  args.prompt_chars = std::max(1, std::atoi(value));
+        else if (arg == "--seed")          args.seed = static_cast<uint32_t>(std::atoi(value));
+        else if (arg == "--lookup")        args.lookup = std::atoi(value);
+        else if (arg == "--draft")         args.draft = value;
+        else if (arg == "--n-draft")       args.n_draft = std::max(1, std::atoi(value));
+        else if (arg == "--kv-type")       args.kv_type = value;
+        else if (arg == "--memory-mb")     args.memory_mb = std::max(0, std::atoi(value));
+        else if (arg == "--n-ctx")         args.n_ctx = std::max(0, std::atoi(value));
+        else if (arg == "--embed")         args.embed = std::max(0, std::atoi(value));
+        else if (arg == "--paging")        args.paging = std::max(0, std::atoi(value));
+        else if (arg == "--cache")         args.cache = value;
+        else {
+            std::cerr << "Unknown argument " << arg << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    bench_args args;
+    if (!parse_args(argc, argv, args)) {
+        return 2;
+    }
+
+    bitnet_fixture_params fixture;
+    fixture.seed = args.seed;
+
+    if (!args.write_fixture.empty()) {
+        if (!bitnet_write_fixture_gguf(args.write_fixture.c_str(), fixture)) {
+            std::cerr << "Failed to write " << args.write_fixture << std::endl;
+            return 1;
+        }
+        std::cerr << "Wrote fixture to " << args.write_fixture << std::endl;
+        return 0;
+    }
+
+    std::string model_path = args.model;
+    if (model_path.empty()) {
+        model_path = "bitnet-bench-fixture.gguf";
+        if (!bitnet_write_fixture_gguf(model_path.c_str(), fixture)) {
+            std::cerr << "Failed to write fixture " << model_path << std::endl;
+            return 1;
+        }
+    }
+
+    // The wrapper logs every token; keep stdout for the JSON result
+    std::ostringstream sink;
+    std::streambuf* cout_buf = std::cout.rdbuf();
+    if (!args.verbose) {
+        std::cout.rdbuf(sink.rdbuf());
+    }
+
+    bitnet_init();
+    bitnet_set_n_threads(args.n_threads);
+    bitnet_set_lookup_decoding(args.lookup, 0);
+    bitnet_set_memory_budget(args.memory_mb, args.n_ctx);
+    bitnet_set_paging(args.paging);
+    bitnet_set_cache_export(args.cache.c_str());
+    const int kv_type = kv_type_id(args.kv_type);
+    if (kv_type < 0 || !bitnet_set_kv_cache_type(kv_type, kv_type)) {
+        std::cout.rdbuf(cout_buf);
+        std::cerr << "Unknown KV cache type " << args.kv_type << std::endl;
+        return 2;
+    }
+
+    const double t_load = now_ms();
+    const int loaded = bitnet_load_model_from_file(model_path.c_str());
+    const double load_ms = now_ms() - t_load;
+    if (!loaded) {
+        std::cout.rdbuf(cout_buf);
+        std::cerr << "Failed to load " << model_path << std::endl;
+        return 1;
+    }
+
+    double cache_load_ms = 0.0;
+    if (!args.cache.empty()) {
+        if (!bitnet_write_model_cache()) {
+            std::cout.rdbuf(cout_buf);
+            std::cerr << "Failed to write the cache " << args.cache << std::endl;
+            return 1;
+        }
+        bitnet_set_cache_export(nullptr);
+        bitnet_free_model();
+        const double t_cache = now_ms();
+        const int cache_loaded = bitnet_load_model_from_file(args.cache.c_str());
+        cache_load_ms = now_ms() - t_cache;
+        if (!cache_loaded || !bitnet_model_is_cached()) {
+            std::cout.rdbuf(cout_buf);
+            std::cerr << "Failed to load the cache written to " << args.cache << std::endl;
+            return 1;
+        }
+    }
+    const std::string plan = bitnet_get_memory_plan();
+
+    if (!args.draft.empty()) {
+        if (!bitnet_draft_load_from_file(args.draft.c_str())) {
+            std::cout.rdbuf(cout_buf);
+            std::cerr << "Failed to load draft model " << args.draft << std::endl;
+            return 1;
+        }
+        bitnet_set_draft_decoding(args.n_draft);
+    }
+
+    const int kernel_mismatches = bitnet_kernel_selftest();
+    const int sampler_mismatches = bitnet_sampler_selftest(256);
+
+    // Warm-up through the one-shot API so first-call costs stay out of the numbers
+    const std::string prompt = make_prompt(args.prompt_chars);
+    std::vector<char> warmup(4096);
+    bitnet_inference_run(prompt.c_str(), warmup.data(), static_cast<int>(warmup.size()));
+
+    // Each run starts from an empty KV cache so the whole prompt is prefilled.
+    // A run can end early on a stop condition; decode_tokens reports how many
+    // tokens were actually timed.
+    std::vector<double> token_ms;
+    int prompt_tokens = 0;
+    double prefill_ms = 0.0;
+    double decode_ms = 0.0;
+    int decode_tokens = 0;
+    int decode_calls = 0;
+    int draft_tokens = 0;
+    int draft_accepted = 0;
+    for (int run = 0; run < args.runs; ++run) {
+        bitnet_kv_cache_clear();
+        if (!bitnet_generate_begin(prompt.c_str(), args.n_predict)) {
+            std::cout.rdbuf(cout_buf);
+            std::cerr << "Generation failed on run " << run << std::endl;
+            return 1;
+        }
+
+        for (;;) {
+            const double t_token = now_ms();
+            if (!bitnet_generate_next()) break;
+            token_ms.push_back(now_ms() - t_token);
+        }
+
+        const std::string stats = bitnet_get_stats();
+        prompt_tokens += static_cast<int>(stats_field(stats, "prompt_tokens"));
+        prefill_ms += stats_field(stats, "prefill_ms");
+        decode_ms += stats_field(stats, "decode_ms");
+        decode_tokens += static_cast<int>(stats_field(stats, "decode_tokens"));
+        decode_calls += static_cast<int>(stats_field(stats, "decode_calls"));
+        draft_tokens += static_cast<int>(stats_field(stats, "draft_tokens"));
+        draft_accepted += static_cast<int>(stats_field(stats, "draft_accepted"));
+    }
+
+    // Embedding throughput: texts of 16..256 characters, one call for all
+    double embed_tps = 0.0;
+    int embed_norm_errors = 0;
+    if (args.embed > 0) {
+        std::vector<std::string> texts;
+        std::vector<const char*> text_ptrs;
+        for (int i = 0; i < args.embed; ++i) {
+            texts.push_back(make_prompt(16 + (i * 37) % 241));
+        }
+        for (const std::string& text : texts) {
+            text_ptrs.push_back(text.c_str());
+        }
+        const int n_embd = bitnet_get_embedding_dim();
+        std::vector<float> embeddings(static_cast<size_t>(args.embed) * n_embd);
+
+        const double t_embed = now_ms();
+        const int n_embedded = bitnet_embed(text_ptrs.data(), args.embed, 1, embeddings.data());
+        const double embed_ms = now_ms() - t_embed;
+        embed_tps = embed_ms > 0.0 ? 1000.0 * std::max(0, n_embedded) / embed_ms : 0.0;
+
+        // Every row must come back unit length
+        for (int i = 0; i < args.embed; ++i) {
+            double sum = 0.0;
+            for (int j = 0; j < n_embd; ++j) {
+                const double v = embeddings[static_cast<size_t>(i) * n_embd + j];
+                sum += v * v;
+            }
+            embed_norm_errors += (i >= n_embedded || std::fabs(sum - 1.0) > 1e-3) ? 1 : 0;
+        }
+    }
+
+    const int n_threads = bitnet_get_n_threads();
+    const std::string paging = bitnet_get_paging_stats();
+    bitnet_cleanup();
+    std::cout.rdbuf(cout_buf);
+
+    // With lookup decoding one timed call can emit several tokens, so
+    // throughput counts tokens rather than calls
+    char json[2048];
+    snprintf(json, sizeof(json),
+             "{\"model\":\"%s\",\"threads\":%d,\"runs\":%d,\"load_ms\":%.3f,\"peak_rss_mb\":%.1f,"
+             "\"prompt_tokens\":%d,\"prefill_tokens_per_sec\":%.2f,"
+             "\"decode_tokens\":%d,\"decode_tokens_per_sec\":%.2f,\"tokens_per_decode\":%.3f,"
+             "\"lookup\":%d,\"draft_acceptance_rate\":%.3f,"
+             "\"kv_type\":\"%s\",\"n_ctx\":%d,\"kv_mb\":%.1f,"
+             "\"latency_ms_p50\":%.3f,\"latency_ms_p99\":%.3f,\"kernel_selftest_mismatches\":%d,"
+             "\"sampler_selftest_mismatches\":%d,\"embed_texts_per_sec\":%.2f,\"embed_norm_errors\":%d,"
+             "\"paging_slots\":%d,\"paging_loads\":%d,\"paging_prefetch_hits\":%d,\"paging_wait_ms\":%.3f,"
+             "\"cache_load_ms\":%.3f}",
+             model_path.c_str(), n_threads, args.runs, load_ms, peak_rss_mb(),
+             prompt_tokens, prefill_ms > 0.0 ? 1000.0 * prompt_tokens / prefill_ms : 0.0,
+             decode_tokens, decode_ms > 0.0 ? 1000.0 * decode_tokens / decode_ms : 0.0,
+             decode_calls > 0 ? static_cast<double>(decode_tokens) / decode_calls : 0.0,
+             args.lookup, draft_tokens > 0 ? static_cast<double>(draft_accepted) / draft_tokens : 0.0,
+             args.kv_type.c_str(), static_cast<int>(stats_field(plan, "n_ctx")),
+             stats_field(plan, "kv_bytes") / (1024.0 * 1024.0),
+             percentile(token_ms, 0.50), percentile(token_ms, 0.99), kernel_mismatches,
+             sampler_mismatches, embed_tps, embed_norm_errors,
+             static_cast<int>(stats_field(paging, "slots")), static_cast<int>(stats_field(paging, "loads")),
+             static_cast<int>(stats_field(paging, "prefetch_hits")), stats_field(paging, "wait_ms"),
+             cache_load_ms);
+    std::cout << json << std::endl;
+
+    return kernel_mismatches == 0 && sampler_mismatches == 0 && embed_norm_errors == 0 ? 0 : 1;
+}
@@ -0,0 +1,169 @@
+// Deterministic BitNet-shaped GGUF fixture for the native benchmark
+
+#include "gguf_fixture.h"
+
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <sys/stat.h>
+
+#include "ggml.h"
+#include "ggml-alloc.h"
+#include "ggml-backend.h"
+
+namespace {
+
+// i2_s payload: n/4 bytes of packed 2-bit values (q = w + 1), then the
+// tensor-wide scale as a float
+void fill_i2s(ggml_tensor* t, std::mt19937& rng) {
+    const int64_t n = ggml_nelements(t);
+    uint8_t* dst = static_cast<uint8_t*>(t->data);
+    std::memset(dst, 0, ggml_nbytes(t));
+
+    std::uniform_int_distribution<int> ternary(0, 2);
+    for (int64_t j = 0; j < n; ++j) {
+        const int64_t block = j / 128;
+        const int k = static_cast<int>(j % 128);
+        dst[block * 32 + k % 32] |= static_cast<uint8_t>(ternary(rng) << (6 - 2 * (k / 32)));
+    }
+
+    const float scale = 1.0f;
+    std::memcpy(dst + n / 4, &scale, sizeof(scale));
+}
+
+void fill_f32(ggml_tensor* t, std::mt19937& rng, float lo, float hi) {
+    std::uniform_real_distribution<float> dist(lo, hi);
+    float* dst = static_cast<float*>(t->data);
+    for (int64_t i = 0; i < ggml_nelements(t); ++i) {
+        dst[i] = dist(rng);
+    }
+}
+
+void fill_ones(ggml_tensor* t) {
+    float* dst = static_cast<float*>(t->data);
+    for (int64_t i = 0; i < ggml_nelements(t); ++i) {
+        dst[i] = 1.0f;
+    }
+}
+
+} // namespace
+
+bool bitnet_write_fixture_gguf(const char* path, const bitnet_fixture_params& params) {
+    const uint32_t n_embd = params.n_embd;
+    const uint32_t n_ff = params.n_ff;
+
+    // Byte-fallback SentencePiece vocab
+    std::vector<std::string> tokens = {"<unk>", "<s>", "</s>"};
+    std::vector<float> scores = {0.0f, 0.0f, 0.0f};
+    std::vector<int32_t> token_types = {2, 3, 3};  // UNKNOWN, CONTROL, CONTROL
+    for (int b = 0; b < 256; ++b) {
+        char name[8];
+        snprintf(name, sizeof(name), "<0x%02X>", b);
+        tokens.push_back(name);
+        scores.push_back(0.0f);
+        token_types.push_back(6);  // BYTE
+    }
+    const uint32_t n_vocab = static_cast<uint32_t>(tokens.size());
+    std::vector<const char*> token_ptrs;
+    for (const std::string& tok : tokens) {
+        token_ptrs.push_back(tok.c_str());
+    }
+
+    gguf_context* gguf = gguf_init_empty();
+    gguf_set_val_str(gguf, "general.architecture", "bitnet");
+    gguf_set_val_str(gguf, "general.name", "bitnet-bench-fixture");
+    gguf_set_val_u32(gguf, "bitnet.context_length", params.n_ctx);
+    gguf_set_val_u32(gguf, "bitnet.embedding_length", n_embd);
+    gguf_set_val_u32(gguf, "bitnet.feed_forward_length", n_ff);
+    gguf_set_val_u32(gguf, "bitnet.block_count", params.n_layer);
+    gguf_set_val_u32(gguf, "bitnet.attention.head_count", params.n_head);
+    gguf_set_val_u32(gguf, "bitnet.attention.head_count_kv", params.n_head);
+    gguf_set_val_u32(gguf, "bitnet.rope.dimension_count", n_embd / params.n_head);
+    gguf_set_val_f32(gguf, "bitnet.attention.layer_norm_rms_epsilon", 1e-5f);
+    gguf_set_val_str(gguf, "tokenizer.ggml.model", "llama");
+    gguf_set_arr_str(gguf, "tokenizer.ggml.tokens", token_ptrs.data(), static_cast<int>(token_ptrs.size()));
+    gguf_set_arr_data(gguf, "tokenizer.ggml.scores", GGUF_TYPE_FLOAT32, scores.data(), static_cast<int>(scores.size()));
+    gguf_set_arr_data(gguf, "tokenizer.ggml.token_type", GGUF_TYPE_INT32, token_types.data(), static_cast<int>(token_types.size()));
+    gguf_set_val_u32(gguf, "tokenizer.ggml.unknown_token_id", 0);
+    gguf_set_val_u32(gguf, "tokenizer.ggml.bos_token_id", 1);
+    gguf_set_val_u32(gguf, "tokenizer.ggml.eos_token_id", 2);
+
+    // Tensor metadata only: the data goes in a CPU backend buffer, which sizes
+    // every tensor (i2_s included) by ggml_nbytes, as the GGUF writer does
+    const size_t n_tensors = 2 + 11 * static_cast<size_t>(params.n_layer);
+    ggml_init_params ctx_params = {};
+    ctx_params.mem_size = n_tensors * ggml_tensor_overhead();
+    ctx_params.no_alloc = true;
+    ggml_context* ctx = ggml_init(ctx_params);
+    if (!ctx) {
+        gguf_free(gguf);
+        return false;
+    }
+
+    enum fill_kind { FILL_EMBD, FILL_ONES, FILL_I2S };
+    std::vector<std::pair<ggml_tensor*, fill_kind>> weights;
+    auto add = [&](ggml_tensor* t, const std::string& name, fill_kind fill) {
+        ggml_set_name(t, name.c_str());
+        weights.emplace_back(t, fill);
+    };
+
+    // BitNet layout: the output projection is tied to token_embd, and each
+    // block normalizes the attention output and the FFN activations again
+    // (attn_sub_norm, ffn_sub_norm) before the projections that follow
+    add(ggml_new_tensor_2d(ctx, GGML_TYPE_F32, n_embd, n_vocab), "token_embd.weight", FILL_EMBD);
+    add(ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_embd), "output_norm.weight", FILL_ONES);
+
+    for (uint32_t il = 0; il < params.n_layer; ++il) {
+        const std::string blk = "blk." + std::to_string(il) + ".";
+        add(ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_embd), blk + "attn_norm.weight", FILL_ONES);
+        for (const char* proj : {"attn_q.weight", "attn_k.weight", "attn_v.weight", "attn_output.weight"}) {
+            add(ggml_new_tensor_2d(ctx, GGML_TYPE_I2_S, n_embd, n_embd), blk + proj, FILL_I2S);
+        }
+        add(ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_embd), blk + "attn_sub_norm.weight", FILL_ONES);
+        add(ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_embd), blk + "ffn_norm.weight", FILL_ONES);
+        add(ggml_new_tensor_2d(ctx, GGML_TYPE_I2_S, n_embd, n_ff), blk + "ffn_gate.weight", FILL_I2S);
+        add(ggml_new_tensor_2d(ctx, GGML_TYPE_I2_S, n_embd, n_ff), blk + "ffn_up.weight", FILL_I2S);
+        add(ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_ff), blk + "ffn_sub_norm.weight", FILL_ONES);
+        add(ggml_new_tensor_2d(ctx, GGML_TYPE_I2_S, n_ff, n_embd), blk + "ffn_down.weight", FILL_I2S);
+    }
+
+    ggml_backend_buffer_t buffer = ggml_backend_alloc_ctx_tensors_from_buft(ctx, ggml_backend_cpu_buffer_type());
+    if (!buffer) {
+        ggml_free(ctx);
+        gguf_free(gguf);
+        return false;
+    }
+
+    // gguf_add_tensor keeps the data pointer, so tensors are added once allocated
+    std::mt19937 rng(params.seed);
+    size_t data_bytes = 0;
+    for (const auto& [t, fill] : weights) {
+        switch (fill) {
+            case FILL_EMBD: fill_f32(t, rng, -1.0f, 1.0f); break;
+            case FILL_ONES: fill_ones(t); break;
+            case FILL_I2S:  fill_i2s(t, rng); break;
+        }
+        gguf_add_tensor(gguf, t);
+        data_bytes += GGML_PAD(ggml_nbytes(t), GGUF_DEFAULT_ALIGNMENT);
+    }
+
+    // gguf_write_to_file reports nothing (it returns void in this ggml), so
+    // a short write shows only as a file smaller than metadata plus data
+    gguf_write_to_file(gguf, path, false);
+    const size_t expected = gguf_get_meta_size(gguf) + data_bytes;
+
+    ggml_backend_buffer_free(buffer);
+    ggml_free(ctx);
+    gguf_free(gguf);
+
+    struct stat st;
+    if (stat(path, &st) != 0 || static_cast<size_t>(st.st_size) != expected) {
+        std::fprintf(stderr, "Fixture %s is incomplete (%zu bytes expected)\n", path, expected);
+        return false;
+    }
+    return true;
+}
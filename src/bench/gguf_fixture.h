@@ -0,0 +1,21 @@
+#pragma once
+#include <cstdint>
+
+// Shape of the synthetic model written by bitnet_write_fixture_gguf. Linear
+// dimensions must be multiples of 128 (the i2_s block size).
+struct bitnet_fixture_params {
+    uint32_t n_embd = 256;
+    uint32_t n_ff = 768;
+    uint32_t n_head = 4;
+    uint32_t n_layer = 4;
+    uint32_t n_ctx = 4096;
+    uint32_t seed = 42;
+};
+
+// Write a small GGUF of the BitNet architecture ("bitnet": sub-norms in
+// every block, output tied to the embeddings): every attention and FFN
+// projection is i2_s with random ternary values, norms and embeddings are
+// F32, and the vocab is a byte-fallback SentencePiece vocab
+// (<unk>, <s>, </s> and the 256 byte tokens). Output is deterministic for a
+// given seed. Returns false if the file cannot be written.
+bool bitnet_write_fixture_gguf(const char* path, const bitnet_fixture_params& params);
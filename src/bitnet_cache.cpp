@@ -0,0 +1,146 @@
+// Preprocessed model cache (see bitnet_cache.h)
+//
+// The file is written the way llama.cpp's quantizer writes its output: GGUF
+// metadata from ggml's gguf writer, then each tensor's bytes padded to the
+// file alignment, streamed from the loaded tensors so no second copy of the
+// model is built in memory. The tensor order and offsets follow the source.
+// The file is sized before any tensor is written, so MEMFS allocates it once
+// instead of growing (and copying) it as the bytes arrive.
+
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+#include "ggml.h"
+#include "bitnet_cache.h"
+#include "bitnet_log.h"
+
+namespace {
+
+const char* const BITNET_CACHE_VERSION_KEY = "bitnet.cache.version";
+const char* const BITNET_CACHE_SOURCE_KEY = "bitnet.cache.source_hash";
+
+// Metadata of the source file, tensor data not loaded
+gguf_context* g_source = nullptr;
+ggml_context* g_source_tensors = nullptr;
+
+bool write_zeros(FILE* f, size_t n) {
+    static const char zeros[GGUF_DEFAULT_ALIGNMENT] = {};
+    return n == 0 || std::fwrite(zeros, 1, n, f) == n;
+}
+
+} // namespace
+
+bool bitnet_cache_keep_source(const char* src_path) {
+    bitnet_cache_drop_source();
+    gguf_init_params params = {true, &g_source_tensors};
+    g_source = gguf_init_from_file(src_path, params);
+    if (!g_source) {
+        BITNET_LOG_ERROR("[bitnet_cache] Failed to read metadata from " << src_path);
+        bitnet_cache_drop_source();
+        return false;
+    }
+    return true;
+}
+
+bool bitnet_cache_has_source() {
+    return g_source != nullptr;
+}
+
+void bitnet_cache_drop_source() {
+    if (g_source) {
+        gguf_free(g_source);
+        g_source = nullptr;
+    }
+    if (g_source_tensors) {
+        ggml_free(g_source_tensors);
+        g_source_tensors = nullptr;
+    }
+}
+
+bool bitnet_cache_write(const llama_model* model, uint64_t source_hash, const char* dst_path) {
+    const int64_t t_start_us = ggml_time_us();
+
+    gguf_context* src = g_source;
+    if (!src) {
+        BITNET_LOG_ERROR("[bitnet_cache] No source metadata kept for this model");
+        return false;
+    }
+
+    // The gguf writer pads tensors to GGUF_DEFAULT_ALIGNMENT, so the file
+    // must say so whatever the source used
+    gguf_context* dst = gguf_init_empty();
+    gguf_set_kv(dst, src);
+    gguf_set_val_u32(dst, "general.alignment", GGUF_DEFAULT_ALIGNMENT);
+    gguf_set_val_u32(dst, BITNET_CACHE_VERSION_KEY, BITNET_CACHE_VERSION);
+    gguf_set_val_u64(dst, BITNET_CACHE_SOURCE_KEY, source_hash);
+
+    std::vector<const ggml_tensor*> tensors;
+    uint64_t data_bytes = 0;
+    bool ok = true;
+    const int64_t n_tensors = gguf_get_n_tensors(src);
+    for (int64_t i = 0; i < n_tensors && ok; ++i) {
+        const char* name = gguf_get_tensor_name(src, i);
+        const ggml_tensor* t = llama_get_model_tensor(const_cast<llama_model*>(model), name);
+        if (!t || !t->data) {
+            BITNET_LOG_ERROR("[bitnet_cache] Tensor " << name << " is not loaded");
+            ok = false;
+            break;
+        }
+        gguf_add_tensor(dst, t);
+        tensors.push_back(t);
+        data_bytes += GGML_PAD(ggml_nbytes(t), GGUF_DEFAULT_ALIGNMENT);
+    }
+
+    // Write next to the destination and rename, so a cut-short write never
+    // leaves a file that looks like a cache
+    const std::string tmp_path = std::string(dst_path) + ".tmp";
+    FILE* f = ok ? std::fopen(tmp_path.c_str(), "wb") : nullptr;
+    if (ok && !f) {
+        BITNET_LOG_ERROR("[bitnet_cache] Failed to create " << tmp_path);
+        ok = false;
+    }
+
+    uint64_t written = 0;
+    if (f) {
+        std::vector<uint8_t> meta(gguf_get_meta_size(dst));
+        gguf_get_meta_data(dst, meta.data());
+        ok = ftruncate(fileno(f), static_cast<off_t>(meta.size() + data_bytes)) == 0 &&
+             std::fwrite(meta.data(), 1, meta.size(), f) == meta.size();
+        written = meta.size();
+
+        for (const ggml_tensor* t : tensors) {
+            if (!ok) break;
+            const size_t nbytes = ggml_nbytes(t);
+            const size_t padded = GGML_PAD(nbytes, GGUF_DEFAULT_ALIGNMENT);
+            ok = std::fwrite(t->data, 1, nbytes, f) == nbytes && write_zeros(f, padded - nbytes);
+            written += padded;
+        }
+        ok = std::fclose(f) == 0 && ok;
+        if (ok) {
+            ok = std::rename(tmp_path.c_str(), dst_path) == 0;
+        }
+        if (!ok) {
+            BITNET_LOG_ERROR("[bitnet_cache] Failed to write " << dst_path);
+            std::remove(tmp_path.c_str());
+        }
+    }
+
+    gguf_free(dst);
+    bitnet_cache_drop_source();
+
+    if (ok) {
+        BITNET_LOG_INFO("[bitnet_cache] Wrote " << (written >> 20) << " MiB to " << dst_path << " in "
+                        << (ggml_time_us() - t_start_us) / 1000.0 << " ms");
+    }
+    return ok;
+}
+
+uint64_t bitnet_cache_source_hash(const BitNetModel& info) {
+    if (bitnet_gguf_get_uint(info, BITNET_CACHE_VERSION_KEY, 0) != BITNET_CACHE_VERSION) {
+        return 0;
+    }
+    return bitnet_gguf_get_uint(info, BITNET_CACHE_SOURCE_KEY, 0);
+}
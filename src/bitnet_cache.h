@@ -0,0 +1,32 @@
+#pragma once
+// Preprocessed model cache. A cache file is the loaded model written back
+// out as GGUF: the source metadata plus bitnet.cache.* keys, and every tensor
+// as the kernels read it after loading. It is tagged with the
+// cache format version and the fingerprint of the source file. Loading a
+// cache file of the current version skips tensor validation, which the cold
+// load already did, and keeps the source's model hash, so session snapshots
+// taken on either file restore on the other. A cache of another version is
+// still a valid GGUF and loads the ordinary way.
+
+#include <cstdint>
+
+#include "llama.h"
+#include "bitnet_wasm.h"
+
+// Bump when the tensor layout the loader produces or the model hash changes
+const uint32_t BITNET_CACHE_VERSION = 2;
+
+// Keep the metadata of src_path, the file the model is being loaded from,
+// so the cache can be written once that file is gone. A streamed load
+// deletes its staging file as soon as the model is in the heap; writing the
+// cache only after that keeps the peak at the heap plus the cache file.
+bool bitnet_cache_keep_source(const char* src_path);
+bool bitnet_cache_has_source();
+void bitnet_cache_drop_source();
+
+// Write model (source fingerprint source_hash) as a cache file at dst_path,
+// using the kept source metadata, which is dropped afterwards
+bool bitnet_cache_write(const llama_model* model, uint64_t source_hash, const char* dst_path);
+
+// Source fingerprint of a cache file of the current version, 0 for anything else
+uint64_t bitnet_cache_source_hash(const BitNetModel& info);
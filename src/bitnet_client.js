@@ -0,0 +1,195 @@
+// Host side of the BitNet worker runtime (bitnet_worker.js). Works the same
+// in a page, where the worker is a module Worker, and under Node, where it is
+// a worker_thread. Every method returns a promise, and the host thread never
+// runs inference.
+//
+//   const bitnet = await BitNetClient.create();
+//   await bitnet.load({ url: 'model.gguf' }, { onProgress });
+//   const request = bitnet.generate('Hello', { maxTokens: 64, onToken: piece => ... });
+//   request.cancel();                       // or abort options.signal
+//   const { text, cancelled } = await request;
+//   await bitnet.terminate();
+
+const isNode = typeof process !== 'undefined' && !!process.versions?.node && typeof window === 'undefined';
+
+export class BitNetClient {
+    constructor(worker) {
+        this.worker = worker;
+        this.nextId = 1;
+        this.requests = new Map();    // id -> { resolve, reject, onMessage }
+        this.cancelFlag = null;       // Int32Array over the worker's shared heap, if any
+    }
+
+    // Start a worker and initialize the WASM module in it. options.workerUrl
+    // and options.moduleUrl override where bitnet_worker.js and the Emscripten
+    // ES module loader (bitnet.mjs, or bitnet-mt.mjs for the pthread build)
+    // come from.
+    static async create(options = {}) {
+        const workerUrl = options.workerUrl || new URL('./bitnet_worker.js', import.meta.url);
+        let worker;
+        if (isNode) {
+            const { Worker } = await import('node:worker_threads');
+            worker = new Worker(workerUrl);
+        } else {
+            worker = new Worker(workerUrl, { type: 'module' });
+        }
+
+        const client = new BitNetClient(worker);
+        if (isNode) {
+            worker.on('message', message => client.onMessage(message));
+            worker.on('error', error => client.failAll(error));
+        } else {
+            worker.onmessage = event => client.onMessage(event.data);
+            worker.onerror = event => client.failAll(new Error(event.message || 'Worker error'));
+        }
+
+        const info = await client.request({ type: 'init', moduleUrl: options.moduleUrl });
+        if (info.cancelFlag) {
+            client.cancelFlag = new Int32Array(info.cancelFlag.buffer, info.cancelFlag.byteOffset, 1);
+        }
+        client.threads = info.threads;
+        return client;
+    }
+
+    onMessage(message) {
+        const entry = this.requests.get(message.id);
+        if (!entry) return;
+
+        if (message.type === 'done' || message.type === 'error') {
+            this.requests.delete(message.id);
+            if (message.type === 'done') {
+                entry.resolve(message.result);
+            } else {
+                const error = new Error(message.message);
+                error.cancelled = !!message.cancelled;
+                entry.reject(error);
+            }
+            return;
+        }
+        if (message.type === 'started') {
+            return;
+        }
+        if (entry.onMessage) {
+            entry.onMessage(message);
+        }
+    }
+
+    failAll(error) {
+        for (const entry of this.requests.values()) {
+            entry.reject(error);
+        }
+        this.requests.clear();
+    }
+
+    // Send one request; resolves with the worker's result
+    request(message, transfer = [], onMessage = null) {
+        const id = this.nextId++;
+        const promise = new Promise((resolve, reject) => {
+            this.requests.set(id, { resolve, reject, onMessage });
+        });
+        this.worker.postMessage({ ...message, id }, transfer);
+        promise.id = id;
+        return promise;
+    }
+
+    // Stop request id: dropped if still queued, ended at the next token if
+    // generating. Through the shared heap this also cuts a prefill short; the
+    // worker arms the flag with the running id, so the swap does nothing
+    // unless id is the request running right now.
+    cancel(id) {
+        if (!this.requests.has(id)) return;
+        if (this.cancelFlag) {
+            Atomics.compareExchange(this.cancelFlag, 0, id, -1);
+        }
+        this.worker.postMessage({ type: 'cancel', id });
+    }
+
+    // Load a model from { url }, { path } (Node: a local file), or { bytes }.
+    // An ArrayBuffer (or a Uint8Array covering its whole buffer) is
+    // transferred, not copied, so it is unusable here afterwards. options:
+    // threads, memoryMb, nCtx, kvType, cache (false disables the preprocessed
+    // model cache), cacheDir (Node), onProgress({ received, expected }).
+    load(source, options = {}) {
+        const { onProgress, ...loadOptions } = options;
+        const message = { type: 'load', options: loadOptions };
+        const transfer = [];
+        if (source.bytes) {
+            const bytes = source.bytes;
+            const whole = ArrayBuffer.isView(bytes) &&
+                bytes.byteOffset === 0 && bytes.byteLength === bytes.buffer.byteLength;
+            message.bytes = ArrayBuffer.isView(bytes)
+                ? (whole ? bytes.buffer : bytes.buffer.slice(bytes.byteOffset, bytes.byteOffset + bytes.byteLength))
+                : bytes;
+            transfer.push(message.bytes);
+        } else {
+            message.url = source.url;
+            message.path = source.path;
+        }
+        return this.request(message, transfer, message => {
+            if (message.type === 'progress' && onProgress) {
+                onProgress(message);
+            }
+        });
+    }
+
+    // Generate from prompt. options: maxTokens, grammar ({ gbnf } or
+    // { schema }), onToken(piece, textSoFar), signal (AbortSignal). The
+    // returned promise resolves with { text, tokens, cancelled } and has a
+    // cancel() method.
+    generate(prompt, options = {}) {
+        const decoder = new TextDecoder('utf-8');
+        let text = '';
+        const request = this.request(
+            { type: 'generate', prompt, maxTokens: options.maxTokens, grammar: options.grammar },
+            [],
+            message => {
+                if (message.type !== 'tokens') return;
+                const piece = decoder.decode(new Uint8Array(message.bytes), { stream: true });
+                if (piece) {
+                    text += piece;
+                    if (options.onToken) options.onToken(piece, text);
+                }
+            });
+
+        const id = request.id;
+        const cancel = () => this.cancel(id);
+        if (options.signal) {
+            if (options.signal.aborted) cancel();
+            else options.signal.addEventListener('abort', cancel, { once: true });
+        }
+
+        const result = request
+            .then(result => {
+                const tail = decoder.decode();
+                if (tail) {
+                    text += tail;
+                    if (options.onToken) options.onToken(tail, text);
+                }
+                return { text, tokens: result.tokens, cancelled: result.cancelled };
+            })
+            .catch(error => {
+                if (error.cancelled) return { text, tokens: 0, cancelled: true };
+                throw error;
+            })
+            .finally(() => {
+                if (options.signal) options.signal.removeEventListener('abort', cancel);
+            });
+        result.id = id;
+        result.cancel = cancel;
+        return result;
+    }
+
+    // { generation, memory, modelLoaded, cached }
+    stats() {
+        return this.request({ type: 'stats' });
+    }
+
+    unload() {
+        return this.request({ type: 'unload' });
+    }
+
+    async terminate() {
+        this.failAll(new Error('Worker terminated'));
+        await this.worker.terminate();
+    }
+}
@@ -0,0 +1,266 @@
+// Draft model for speculative decoding (see bitnet_draft.h)
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#include "bitnet_draft.h"
+#include "bitnet_sampler.h"
+#include "bitnet_log.h"
+
+namespace {
+
+struct bitnet_draft {
+    llama_model* model = nullptr;
+    llama_context* context = nullptr;
+    bitnet_sampler* sampler = nullptr;
+    llama_batch batch = {};
+    std::vector<llama_token> kv_tokens;               // tokens in the draft KV cache, seq 0
+    std::vector<std::vector<llama_token_data>> dist;  // distribution of each proposed token
+    std::vector<float> weights;
+
+    // Adaptive length state: EMAs of accepted tokens and acceptance trials
+    // per round (the acceptance rate is their ratio), and of the cost of one
+    // draft token and one target verification pass
+    double accepted = 0.6;
+    double trials = 1.0;
+    double draft_ms = 0.0;
+    double verify_ms = 0.0;
+};
+
+bitnet_draft g_draft;
+
+const double BITNET_DRAFT_EMA = 0.1;
+
+bool vocab_matches(const llama_model* target, const llama_model* draft) {
+    const int n_vocab = llama_n_vocab(target);
+    if (llama_n_vocab(draft) != n_vocab) {
+        BITNET_LOG_ERROR("[bitnet_draft_load] Vocab size differs: target " << n_vocab
+                         << ", draft " << llama_n_vocab(draft));
+        return false;
+    }
+    if (llama_token_bos(target) != llama_token_bos(draft) || llama_token_eos(target) != llama_token_eos(draft)) {
+        BITNET_LOG_ERROR("[bitnet_draft_load] BOS/EOS tokens differ between target and draft");
+        return false;
+    }
+    for (llama_token id = 0; id < n_vocab; ++id) {
+        if (std::strcmp(llama_token_get_text(target, id), llama_token_get_text(draft, id)) != 0) {
+            BITNET_LOG_ERROR("[bitnet_draft_load] Token " << id << " differs between target and draft");
+            return false;
+        }
+    }
+    return true;
+}
+
+// Make the draft KV cache hold tokens[0, n - 1) and decode the last token so
+// the logits for the first proposal are ready
+bool sync(const std::vector<llama_token>& tokens) {
+    const size_t n_tokens = tokens.size();
+    size_t n_keep = 0;
+    while (n_keep < g_draft.kv_tokens.size() && n_keep + 1 < n_tokens && g_draft.kv_tokens[n_keep] == tokens[n_keep]) {
+        n_keep++;
+    }
+    llama_kv_cache_seq_rm(g_draft.context, 0, static_cast<llama_pos>(n_keep), -1);
+    g_draft.kv_tokens.resize(n_keep);
+
+    const size_t n_batch = llama_n_batch(g_draft.context);
+    for (size_t i = n_keep; i < n_tokens; i += n_batch) {
+        const size_t n_eval = std::min(n_batch, n_tokens - i);
+        llama_batch& batch = g_draft.batch;
+        batch.n_tokens = static_cast<int32_t>(n_eval);
+        for (size_t j = 0; j < n_eval; ++j) {
+            batch.token[j] = tokens[i + j];
+            batch.pos[j] = static_cast<llama_pos>(i + j);
+            batch.n_seq_id[j] = 1;
+            batch.seq_id[j][0] = 0;
+            batch.logits[j] = (i + j == n_tokens - 1);
+        }
+        if (llama_decode(g_draft.context, batch)) {
+            BITNET_LOG_ERROR("[bitnet_draft] Failed to decode " << n_eval << " tokens at " << i);
+            llama_kv_cache_seq_rm(g_draft.context, 0, -1, -1);
+            g_draft.kv_tokens.clear();
+            return false;
+        }
+        g_draft.kv_tokens.insert(g_draft.kv_tokens.end(), tokens.begin() + i, tokens.begin() + i + n_eval);
+    }
+    return true;
+}
+
+} // namespace
+
+bool bitnet_draft_load(const char* path, const llama_model* target, const llama_context* target_ctx,
+                       const common_sampler_params& sparams, int n_threads) {
+    bitnet_draft_free();
+
+    llama_model_params model_params = llama_model_default_params();
+    model_params.use_mmap = false;
+    model_params.use_mlock = false;
+    model_params.n_gpu_layers = 0;
+
+    g_draft.model = llama_load_model_from_file(path, model_params);
+    if (!g_draft.model) {
+        BITNET_LOG_ERROR("[bitnet_draft_load] Failed to load " << path);
+        return false;
+    }
+    if (!vocab_matches(target, g_draft.model)) {
+        bitnet_draft_free();
+        return false;
+    }
+
+    llama_context_params ctx_params = llama_context_default_params();
+    ctx_params.n_ctx = llama_n_ctx(target_ctx);
+    ctx_params.n_batch = llama_n_batch(target_ctx);
+    ctx_params.n_ubatch = llama_n_ubatch(target_ctx);
+    ctx_params.n_seq_max = 1;
+    ctx_params.n_threads = n_threads;
+    ctx_params.n_threads_batch = n_threads;
+    g_draft.context = llama_new_context_with_model(g_draft.model, ctx_params);
+    if (!g_draft.context) {
+        BITNET_LOG_ERROR("[bitnet_draft_load] Failed to create draft context");
+        bitnet_draft_free();
+        return false;
+    }
+
+    // The acceptance test only needs the distribution the draft actually
+    // sampled from, so the draft skips penalties and uses its own RNG stream
+    common_sampler_params draft_params = sparams;
+    draft_params.penalty_repeat = 1.0f;
+    draft_params.penalty_freq = 0.0f;
+    draft_params.penalty_present = 0.0f;
+    if (draft_params.seed != LLAMA_DEFAULT_SEED) {
+        draft_params.seed += 1;
+    }
+    g_draft.sampler = bitnet_sampler_init(g_draft.model, draft_params);
+    if (!g_draft.sampler || !bitnet_sampler_is_fused(g_draft.sampler)) {
+        BITNET_LOG_ERROR("[bitnet_draft_load] Speculative decoding needs the fused sampler configuration");
+        bitnet_draft_free();
+        return false;
+    }
+
+    g_draft.batch = llama_batch_init(ctx_params.n_batch, 0, 1);
+    g_draft.kv_tokens.reserve(ctx_params.n_ctx);
+    g_draft.weights.reserve(std::max(1, sparams.top_k));
+
+    BITNET_LOG_INFO("[bitnet_draft_load] Draft model loaded: " << llama_n_layer(g_draft.model) << " layers, "
+                    << llama_n_embd(g_draft.model) << " embd");
+    return true;
+}
+
+void bitnet_draft_free() {
+    if (g_draft.batch.token) {
+        llama_batch_free(g_draft.batch);
+    }
+    bitnet_sampler_free(g_draft.sampler);
+    if (g_draft.context) {
+        llama_free(g_draft.context);
+    }
+    if (g_draft.model) {
+        llama_free_model(g_draft.model);
+    }
+    g_draft = bitnet_draft();
+}
+
+void bitnet_draft_reset() {
+    if (g_draft.sampler) {
+        bitnet_sampler_reset(g_draft.sampler);
+    }
+}
+
+bool bitnet_draft_loaded() {
+    return g_draft.context != nullptr;
+}
+
+int bitnet_draft_propose(const std::vector<llama_token>& tokens, int n_max, std::vector<llama_token>& draft) {
+    draft.clear();
+    if (!g_draft.context || n_max <= 0 || !sync(tokens)) {
+        return 0;
+    }
+    if (g_draft.dist.size() < static_cast<size_t>(n_max)) {
+        g_draft.dist.resize(n_max);
+    }
+
+    for (int i = 0; i < n_max; ++i) {
+        size_t n_cand = 0;
+        const llama_token_data* cand = bitnet_sampler_dist(g_draft.sampler, llama_get_logits_ith(g_draft.context, -1), &n_cand);
+        if (!cand || n_cand == 0) {
+            break;
+        }
+
+        g_draft.weights.clear();
+        for (size_t j = 0; j < n_cand; ++j) {
+            g_draft.weights.push_back(cand[j].p);
+        }
+        const llama_token token = cand[bitnet_sampler_draw(g_draft.sampler, g_draft.weights.data(), n_cand)].id;
+        g_draft.dist[i].assign(cand, cand + n_cand);
+        draft.push_back(token);
+
+        // The last proposal is never decoded by the draft; the next sync does it
+        // if the target accepts it
+        if (i + 1 == n_max) {
+            break;
+        }
+        llama_batch& batch = g_draft.batch;
+        batch.n_tokens = 1;
+        batch.token[0] = token;
+        batch.pos[0] = static_cast<llama_pos>(g_draft.kv_tokens.size());
+        batch.n_seq_id[0] = 1;
+        batch.seq_id[0][0] = 0;
+        batch.logits[0] = true;
+        if (llama_decode(g_draft.context, batch)) {
+            break;
+        }
+        g_draft.kv_tokens.push_back(token);
+    }
+    return static_cast<int>(draft.size());
+}
+
+const std::vector<llama_token_data>& bitnet_draft_dist(int i) {
+    return g_draft.dist[i];
+}
+
+void bitnet_draft_shift(int n_keep, int n_discard) {
+    const int n_past = static_cast<int>(g_draft.kv_tokens.size());
+    if (!g_draft.context || n_past <= n_keep) {
+        return;
+    }
+    n_discard = std::min(n_discard, n_past - n_keep);
+    llama_kv_cache_seq_rm(g_draft.context, 0, n_keep, n_keep + n_discard);
+    llama_kv_cache_seq_add(g_draft.context, 0, n_keep + n_discard, n_past, -n_discard);
+    g_draft.kv_tokens.erase(g_draft.kv_tokens.begin() + n_keep, g_draft.kv_tokens.begin() + n_keep + n_discard);
+}
+
+// With per-token acceptance rate a, drafting k tokens yields on average
+// (1 - a^(k+1)) / (1 - a) tokens per target pass, at a cost of one pass plus
+// k draft tokens. Pick the k with the best tokens per unit of cost.
+int bitnet_draft_length(int n_max) {
+    if (n_max <= 1 || g_draft.verify_ms <= 0.0) {
+        return std::min(n_max, 4);
+    }
+    const double a = std::min(0.95, std::max(0.05, g_draft.accepted / g_draft.trials));
+    const double c = g_draft.draft_ms / g_draft.verify_ms;
+
+    int best_k = 1;
+    double best_rate = 0.0;
+    for (int k = 1; k <= n_max; ++k) {
+        const double rate = (1.0 - std::pow(a, k + 1)) / (1.0 - a) / (1.0 + c * k);
+        if (rate > best_rate) {
+            best_rate = rate;
+            best_k = k;
+        }
+    }
+    return best_k;
+}
+
+void bitnet_draft_update(int n_drafted, int n_accepted, double draft_ms, double verify_ms) {
+    if (n_drafted <= 0) {
+        return;
+    }
+    // A round is a run of Bernoulli trials that ends at the first rejection
+    const int n_trials = n_accepted + (n_accepted < n_drafted ? 1 : 0);
+    const double per_token_ms = draft_ms / n_drafted;
+
+    g_draft.accepted += BITNET_DRAFT_EMA * (n_accepted - g_draft.accepted);
+    g_draft.trials += BITNET_DRAFT_EMA * (n_trials - g_draft.trials);
+    g_draft.draft_ms = g_draft.draft_ms > 0.0 ? g_draft.draft_ms + BITNET_DRAFT_EMA * (per_token_ms - g_draft.draft_ms) : per_token_ms;
+    g_draft.verify_ms = g_draft.verify_ms > 0.0 ? g_draft.verify_ms + BITNET_DRAFT_EMA * (verify_ms - g_draft.verify_ms) : verify_ms;
+}
@@ -0,0 +1,38 @@
+#pragma once
+// Draft model for speculative decoding. A small model that shares the
+// target's vocabulary lives in its own context next to the BitNet target;
+// each round it proposes tokens autoregressively with its own sampler and
+// records the distribution each one was drawn from, which the target needs
+// for the rejection-sampling acceptance test (bitnet_wasm.cpp). The draft
+// length adapts to the measured acceptance rate and draft/target cost.
+
+#include <vector>
+
+#include "llama.h"
+#include "sampling.h"
+
+// Load the draft model and create its context sized like target_ctx. Fails
+// if the vocabularies differ or the sampler configuration is not fused.
+bool bitnet_draft_load(const char* path, const llama_model* target, const llama_context* target_ctx,
+                       const common_sampler_params& sparams, int n_threads);
+void bitnet_draft_free();
+bool bitnet_draft_loaded();
+
+// Reseed the draft sampler along with the target's at the start of a generation
+void bitnet_draft_reset();
+
+// Propose up to n_max tokens continuing `tokens`. Token i of `draft` was
+// drawn from the distribution returned by bitnet_draft_dist(i).
+int bitnet_draft_propose(const std::vector<llama_token>& tokens, int n_max, std::vector<llama_token>& draft);
+const std::vector<llama_token_data>& bitnet_draft_dist(int i);
+
+// Mirror a context shift of the target: drop draft positions
+// [n_keep, n_keep + n_discard) and slide the rest down
+void bitnet_draft_shift(int n_keep, int n_discard);
+
+// Draft length for the next round, at most n_max
+int bitnet_draft_length(int n_max);
+
+// Feed back the outcome of a round: n_accepted of n_drafted tokens, and the
+// time the draft and the target verification took
+void bitnet_draft_update(int n_drafted, int n_accepted, double draft_ms, double verify_ms);
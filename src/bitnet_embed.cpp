@@ -0,0 +1,173 @@
+// Batched text embeddings (see bitnet_embed.h)
+
+#include <cmath>
+#include <cstring>
+#include <vector>
+
+#include "bitnet_embed.h"
+#include "bitnet_log.h"
+#include "bitnet_pager.h"
+#include "bitnet_profile.h"
+
+namespace {
+
+// Sequences per batch; short texts are packed up to this many at a time
+const int BITNET_EMBED_MAX_SEQS = 64;
+
+struct bitnet_embedder {
+    llama_context* context = nullptr;
+    const llama_model* model = nullptr;
+    enum llama_pooling_type pooling = LLAMA_POOLING_TYPE_NONE;
+    llama_batch batch = {};
+    std::vector<llama_token> tokens;  // scratch for one text
+    std::vector<int> seq_text;        // text index of each sequence in the batch
+};
+
+bitnet_embedder g_embed;
+
+// Write the L2-normalized embedding of sequence s to out
+void store_normalized(int s, float* out, int n_embd) {
+    const float* embd = llama_get_embeddings_seq(g_embed.context, s);
+    double sum = 0.0;
+    for (int i = 0; i < n_embd; ++i) {
+        sum += static_cast<double>(embd[i]) * embd[i];
+    }
+    const float scale = sum > 0.0 ? static_cast<float>(1.0 / std::sqrt(sum)) : 0.0f;
+    for (int i = 0; i < n_embd; ++i) {
+        out[i] = embd[i] * scale;
+    }
+}
+
+// Decode the packed batch and store one row per sequence
+bool flush(float* out, int n_embd) {
+    llama_batch& batch = g_embed.batch;
+    if (batch.n_tokens == 0) {
+        return true;
+    }
+    const int64_t t_start_us = ggml_time_us();
+    const bool ok = llama_decode(g_embed.context, batch) == 0;
+    if (ok) {
+        for (size_t s = 0; s < g_embed.seq_text.size(); ++s) {
+            store_normalized(static_cast<int>(s), out + static_cast<size_t>(g_embed.seq_text[s]) * n_embd, n_embd);
+        }
+        bitnet_trace_push(BITNET_TRACE_EMBED, static_cast<int32_t>(g_embed.seq_text.size()), t_start_us, ggml_time_us());
+        bitnet_profile_count_tokens(batch.n_tokens);
+    } else {
+        BITNET_LOG_ERROR("[bitnet_embed] Failed to decode " << g_embed.seq_text.size() << " texts ("
+                         << batch.n_tokens << " tokens)");
+    }
+    llama_kv_cache_clear(g_embed.context);
+    batch.n_tokens = 0;
+    g_embed.seq_text.clear();
+    return ok;
+}
+
+} // namespace
+
+bool bitnet_embed_init(llama_model* model, enum llama_pooling_type pooling, int n_batch, int n_threads) {
+    if (g_embed.context && g_embed.model == model && g_embed.pooling == pooling) {
+        return true;
+    }
+    bitnet_embed_free();
+
+    // Pooling is computed per ubatch, so a whole batch must be one ubatch;
+    // the KV cache only ever holds the batch being embedded
+    llama_context_params ctx_params = llama_context_default_params();
+    ctx_params.n_ctx = n_batch;
+    ctx_params.n_batch = n_batch;
+    ctx_params.n_ubatch = n_batch;
+    ctx_params.n_seq_max = BITNET_EMBED_MAX_SEQS;
+    ctx_params.n_threads = n_threads;
+    ctx_params.n_threads_batch = n_threads;
+    ctx_params.embeddings = true;
+    ctx_params.pooling_type = pooling;
+    ctx_params.flash_attn = false;
+    ctx_params.offload_kqv = false;
+    ctx_params.cb_eval = bitnet_pager_eval;
+    ctx_params.cb_eval_user_data = nullptr;
+
+    g_embed.context = llama_new_context_with_model(model, ctx_params);
+    if (!g_embed.context) {
+        BITNET_LOG_ERROR("[bitnet_embed_init] Failed to create the embedding context");
+        return false;
+    }
+    g_embed.model = model;
+    g_embed.pooling = pooling;
+    g_embed.batch = llama_batch_init(n_batch, 0, 1);
+    g_embed.tokens.reserve(n_batch);
+    g_embed.seq_text.reserve(BITNET_EMBED_MAX_SEQS);
+
+    BITNET_LOG_INFO("[bitnet_embed_init] Embedding context: n_batch=" << n_batch << ", pooling="
+                    << (pooling == LLAMA_POOLING_TYPE_LAST ? "last" : "mean"));
+    return true;
+}
+
+void bitnet_embed_free() {
+    if (g_embed.batch.token) {
+        llama_batch_free(g_embed.batch);
+    }
+    if (g_embed.context) {
+        llama_free(g_embed.context);
+    }
+    g_embed = bitnet_embedder();
+}
+
+int bitnet_embed_texts(const char* const* texts, int n_texts, float* out) {
+    if (!g_embed.context) {
+        return 0;
+    }
+    const int n_embd = llama_n_embd(g_embed.model);
+    const int n_batch = static_cast<int>(llama_n_batch(g_embed.context));
+    const bool add_bos = llama_add_bos_token(g_embed.model);
+    const int64_t t_start_us = ggml_time_us();
+
+    llama_batch& batch = g_embed.batch;
+    batch.n_tokens = 0;
+    g_embed.seq_text.clear();
+
+    int n_done = 0;  // texts before this index are stored
+    for (int i = 0; i < n_texts; ++i) {
+        const int n_chars = static_cast<int>(std::strlen(texts[i]));
+        std::vector<llama_token>& tokens = g_embed.tokens;
+        tokens.resize(n_batch);
+        int n_tokens = llama_tokenize(g_embed.model, texts[i], n_chars, tokens.data(), n_batch, add_bos, false);
+        if (n_tokens < 0) {
+            // Longer than a batch: tokenize fully, keep the first n_batch tokens
+            tokens.resize(-n_tokens);
+            llama_tokenize(g_embed.model, texts[i], n_chars, tokens.data(), -n_tokens, add_bos, false);
+            BITNET_LOG_WARN("⚠️ [bitnet_embed] Text " << i << " has " << -n_tokens << " tokens; truncated to " << n_batch);
+            n_tokens = n_batch;
+        }
+        if (n_tokens == 0) {
+            // Nothing to pool (empty text without BOS)
+            std::memset(out + static_cast<size_t>(i) * n_embd, 0, sizeof(float) * n_embd);
+            continue;
+        }
+
+        if (batch.n_tokens + n_tokens > n_batch || static_cast<int>(g_embed.seq_text.size()) == BITNET_EMBED_MAX_SEQS) {
+            if (!flush(out, n_embd)) {
+                return n_done;
+            }
+            n_done = i;
+        }
+
+        const llama_seq_id seq = static_cast<llama_seq_id>(g_embed.seq_text.size());
+        for (int j = 0; j < n_tokens; ++j) {
+            const int row = batch.n_tokens++;
+            batch.token[row] = tokens[j];
+            batch.pos[row] = j;
+            batch.n_seq_id[row] = 1;
+            batch.seq_id[row][0] = seq;
+            batch.logits[row] = true;
+        }
+        g_embed.seq_text.push_back(i);
+    }
+    if (!flush(out, n_embd)) {
+        return n_done;
+    }
+
+    const double ms = (ggml_time_us() - t_start_us) / 1000.0;
+    BITNET_LOG_INFO("[bitnet_embed] " << n_texts << " texts in " << ms << " ms ("
+                    << (ms > 0.0 ? 1000.0 * n_texts / ms : 0.0) << " texts/s)");
+    return n_texts;
+}
@@ -0,0 +1,19 @@
+#pragma once
+// Batched text embeddings. A second context on the loaded model runs with
+// embeddings enabled and a pooling layer; texts are packed as separate
+// sequences into n_batch-sized batches, each decoded in a single ubatch, and
+// the pooled hidden states are written L2-normalized to the caller's buffer.
+// The generation context and its KV cache are left untouched.
+
+#include "llama.h"
+
+// Create (or recreate, if the pooling type changes) the embedding context.
+// pooling is LLAMA_POOLING_TYPE_MEAN or LLAMA_POOLING_TYPE_LAST.
+bool bitnet_embed_init(llama_model* model, enum llama_pooling_type pooling, int n_batch, int n_threads);
+void bitnet_embed_free();
+
+// Embed n_texts NUL-terminated strings into out (n_texts * n_embd floats,
+// row i for text i). Texts longer than n_batch tokens are truncated.
+// Returns the number of texts embedded; fewer than n_texts means a decode
+// failed and the remaining rows are unset.
+int bitnet_embed_texts(const char* const* texts, int n_texts, float* out);
@@ -0,0 +1,383 @@
+// GGUF header parsing for BitNet WASM
+//
+// Parses the GGUF header, KV metadata and tensor infos from a (possibly
+// partial) byte buffer. The streaming loader calls this as chunks arrive so a
+// bad file is rejected before the download finishes, and so model metadata is
+// available long before the tensor data has been received.
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "bitnet_wasm.h"
+
+BitNetModel g_model;
+
+namespace {
+
+enum gguf_value_type : uint32_t {
+    GGUF_VALUE_UINT8   = 0,
+    GGUF_VALUE_INT8    = 1,
+    GGUF_VALUE_UINT16  = 2,
+    GGUF_VALUE_INT16   = 3,
+    GGUF_VALUE_UINT32  = 4,
+    GGUF_VALUE_INT32   = 5,
+    GGUF_VALUE_FLOAT32 = 6,
+    GGUF_VALUE_BOOL    = 7,
+    GGUF_VALUE_STRING  = 8,
+    GGUF_VALUE_ARRAY   = 9,
+    GGUF_VALUE_UINT64  = 10,
+    GGUF_VALUE_INT64   = 11,
+    GGUF_VALUE_FLOAT64 = 12,
+};
+
+// Sanity limits so a corrupt length field can't make us wait for gigabytes
+// of "header" before failing
+constexpr uint64_t GGUF_MAX_STRING   = 1ull << 24;
+constexpr uint64_t GGUF_MAX_ELEMENTS = 1ull << 28;
+constexpr uint32_t GGUF_MAX_DIMS     = 4;
+
+// Bounds-checked reader over the bytes received so far. Reads past the end set
+// `need_more` rather than failing, so the caller can retry with more data.
+struct gguf_reader {
+    const uint8_t* data;
+    size_t size;
+    size_t pos = 0;
+    bool need_more = false;
+    bool bad = false;
+
+    bool read_raw(void* dst, size_t n) {
+        if (need_more || bad) return false;
+        if (size - pos < n) {
+            need_more = true;
+            return false;
+        }
+        std::memcpy(dst, data + pos, n);
+        pos += n;
+        return true;
+    }
+
+    template <typename T>
+    bool read(T& v) { return read_raw(&v, sizeof(T)); }
+
+    bool read_string(std::string& s) {
+        uint64_t len = 0;
+        if (!read(len)) return false;
+        if (len > GGUF_MAX_STRING) {
+            bad = true;
+            return false;
+        }
+        s.resize(len);
+        return read_raw(&s[0], len);
+    }
+
+    bool skip(uint64_t n) {
+        if (need_more || bad) return false;
+        if (size - pos < n) {
+            need_more = true;
+            return false;
+        }
+        pos += n;
+        return true;
+    }
+};
+
+size_t gguf_scalar_size(uint32_t type) {
+    switch (type) {
+        case GGUF_VALUE_UINT8:
+        case GGUF_VALUE_INT8:
+        case GGUF_VALUE_BOOL:    return 1;
+        case GGUF_VALUE_UINT16:
+        case GGUF_VALUE_INT16:   return 2;
+        case GGUF_VALUE_UINT32:
+        case GGUF_VALUE_INT32:
+        case GGUF_VALUE_FLOAT32: return 4;
+        case GGUF_VALUE_UINT64:
+        case GGUF_VALUE_INT64:
+        case GGUF_VALUE_FLOAT64: return 8;
+        default:                 return 0;
+    }
+}
+
+// Reads one value of `type`; its raw bytes are appended to `out` when given
+bool gguf_read_value(gguf_reader& r, uint32_t type, std::vector<uint8_t>* out) {
+    const size_t start = r.pos;
+
+    if (type == GGUF_VALUE_STRING) {
+        uint64_t len = 0;
+        if (!r.read(len)) return false;
+        if (len > GGUF_MAX_STRING) {
+            r.bad = true;
+            return false;
+        }
+        if (!r.skip(len)) return false;
+    } else if (type == GGUF_VALUE_ARRAY) {
+        uint32_t elem_type = 0;
+        uint64_t n = 0;
+        if (!r.read(elem_type) || !r.read(n)) return false;
+        if (n > GGUF_MAX_ELEMENTS || elem_type == GGUF_VALUE_ARRAY) {
+            r.bad = true;
+            return false;
+        }
+        const size_t elem_size = gguf_scalar_size(elem_type);
+        if (elem_size > 0) {
+            if (!r.skip(n * elem_size)) return false;
+        } else if (elem_type == GGUF_VALUE_STRING) {
+            for (uint64_t i = 0; i < n; ++i) {
+                if (!gguf_read_value(r, GGUF_VALUE_STRING, nullptr)) return false;
+            }
+        } else {
+            r.bad = true;
+            return false;
+        }
+    } else {
+        const size_t n = gguf_scalar_size(type);
+        if (n == 0) {
+            r.bad = true;
+            return false;
+        }
+        if (!r.skip(n)) return false;
+    }
+
+    if (out) {
+        out->assign(r.data + start, r.data + r.pos);
+    }
+    return true;
+}
+
+const gguf_kv_pair* gguf_find(const BitNetModel& model, const std::string& key) {
+    for (const auto& kv : model.metadata) {
+        if (kv.key == key) return &kv;
+    }
+    return nullptr;
+}
+
+uint32_t gguf_get_u32(const BitNetModel& model, const std::string& key, uint32_t def) {
+    const gguf_kv_pair* kv = gguf_find(model, key);
+    if (!kv) return def;
+    if ((kv->value_type == GGUF_VALUE_UINT32 || kv->value_type == GGUF_VALUE_INT32) && kv->value_data.size() == 4) {
+        uint32_t v;
+        std::memcpy(&v, kv->value_data.data(), 4);
+        return v;
+    }
+    if ((kv->value_type == GGUF_VALUE_UINT64 || kv->value_type == GGUF_VALUE_INT64) && kv->value_data.size() == 8) {
+        uint64_t v;
+        std::memcpy(&v, kv->value_data.data(), 8);
+        return static_cast<uint32_t>(v);
+    }
+    return def;
+}
+
+std::string gguf_get_str(const BitNetModel& model, const std::string& key) {
+    const gguf_kv_pair* kv = gguf_find(model, key);
+    if (!kv || kv->value_type != GGUF_VALUE_STRING || kv->value_data.size() < 8) return "";
+    return std::string(reinterpret_cast<const char*>(kv->value_data.data()) + 8, kv->value_data.size() - 8);
+}
+
+uint32_t gguf_get_array_len(const BitNetModel& model, const std::string& key) {
+    const gguf_kv_pair* kv = gguf_find(model, key);
+    if (!kv || kv->value_type != GGUF_VALUE_ARRAY || kv->value_data.size() < 12) return 0;
+    uint64_t n;
+    std::memcpy(&n, kv->value_data.data() + 4, 8);
+    return static_cast<uint32_t>(n);
+}
+
+} // namespace
+
+int parse_gguf_header(const uint8_t* data, size_t size, BitNetModel& model) {
+    gguf_reader r{data, size};
+    gguf_header header{};
+
+    if (!r.read_raw(header.magic, 4)) return 0;
+    if (std::memcmp(header.magic, "GGUF", 4) != 0) return -1;
+    if (!r.read(header.version) || !r.read(header.n_tensors) || !r.read(header.n_kv)) return 0;
+    if (header.version < 2 || header.n_tensors > GGUF_MAX_ELEMENTS || header.n_kv > GGUF_MAX_ELEMENTS) return -1;
+
+    // The counts come from the file: grow the lists as records parse rather
+    // than sizing them up front, and reserve no more than the bytes left
+    // could hold (a key-value pair takes at least 13, a tensor info 24)
+    std::vector<gguf_kv_pair> metadata;
+    metadata.reserve(std::min<uint64_t>(header.n_kv, (size - r.pos) / 13));
+    for (uint64_t i = 0; i < header.n_kv; ++i) {
+        gguf_kv_pair kv;
+        if (!r.read_string(kv.key) || !r.read(kv.value_type) ||
+            !gguf_read_value(r, kv.value_type, &kv.value_data)) {
+            return r.bad ? -1 : 0;
+        }
+        metadata.push_back(std::move(kv));
+    }
+
+    std::vector<gguf_tensor_info> tensors;
+    tensors.reserve(std::min<uint64_t>(header.n_tensors, (size - r.pos) / 24));
+    for (uint64_t i = 0; i < header.n_tensors; ++i) {
+        tensors.emplace_back();
+        gguf_tensor_info& t = tensors.back();
+        if (!r.read_string(t.name) || !r.read(t.n_dimensions)) return r.bad ? -1 : 0;
+        if (t.n_dimensions > GGUF_MAX_DIMS) return -1;
+        t.dimensions.resize(t.n_dimensions);
+        for (auto& d : t.dimensions) {
+            if (!r.read(d)) return 0;
+        }
+        if (!r.read(t.type) || !r.read(t.offset)) return 0;
+    }
+
+    model.metadata = std::move(metadata);
+    model.tensors = std::move(tensors);
+
+    const uint32_t alignment = gguf_get_u32(model, "general.alignment", 32);
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0) return -1;
+    model.data_offset = (r.pos + alignment - 1) / alignment * alignment;
+
+    model.arch = gguf_get_str(model, "general.architecture");
+    model.vocab_size = gguf_get_array_len(model, "tokenizer.ggml.tokens");
+    model.n_embd = gguf_get_u32(model, model.arch + ".embedding_length", 0);
+    model.n_head = gguf_get_u32(model, model.arch + ".attention.head_count", 0);
+    model.n_layer = gguf_get_u32(model, model.arch + ".block_count", 0);
+    model.n_ctx = gguf_get_u32(model, model.arch + ".context_length", 0);
+    model.loaded = true;
+
+    return 1;
+}
+
+bool parse_gguf_file(const uint8_t* file_data, size_t file_size, BitNetModel& model) {
+    return parse_gguf_header(file_data, file_size, model) == 1;
+}
+
+uint64_t bitnet_gguf_get_uint(const BitNetModel& model, const char* key, uint64_t def) {
+    const gguf_kv_pair* kv = gguf_find(model, key);
+    if (!kv) return def;
+    if (kv->value_type == GGUF_VALUE_UINT32 && kv->value_data.size() == 4) {
+        uint32_t v;
+        std::memcpy(&v, kv->value_data.data(), 4);
+        return v;
+    }
+    if (kv->value_type == GGUF_VALUE_UINT64 && kv->value_data.size() == 8) {
+        uint64_t v;
+        std::memcpy(&v, kv->value_data.data(), 8);
+        return v;
+    }
+    return def;
+}
+
+// Parse the header of a GGUF file on disk, reading only as much of the file as
+// the header needs: the read window doubles until the parse completes.
+bool parse_gguf_header_file(const char* path, BitNetModel& model) {
+    FILE* f = std::fopen(path, "rb");
+    if (!f) return false;
+
+    const size_t max_header = 64 * 1024 * 1024;
+    std::vector<uint8_t> buf;
+    int status = 0;
+    for (size_t window = 1024 * 1024; status == 0 && window <= max_header; window *= 2) {
+        const size_t have = buf.size();
+        buf.resize(window);
+        const size_t n = std::fread(buf.data() + have, 1, window - have, f);
+        buf.resize(have + n);
+
+        status = parse_gguf_header(buf.data(), buf.size(), model);
+        if (n < window - have) break;  // EOF: whatever parsed is all there is
+    }
+
+    std::fclose(f);
+    return status == 1;
+}
+
+namespace {
+
+const uint64_t HASH_PRIME_1 = 0x9e3779b185ebca87ull;
+const uint64_t HASH_PRIME_2 = 0xc2b2ae3d27d4eb4full;
+
+uint64_t rotl64(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+uint64_t read_u64(const uint8_t* p) {
+    uint64_t v;
+    std::memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+// One 32-byte stripe: four independent multiply-rotate lanes, so the
+// multiplies pipeline instead of waiting on each other
+void hash_stripe(uint64_t* lanes, const uint8_t* p) {
+    for (int i = 0; i < 4; ++i) {
+        lanes[i] = rotl64(lanes[i] + read_u64(p + 8 * i) * HASH_PRIME_2, 31) * HASH_PRIME_1;
+    }
+}
+
+uint64_t hash_avalanche(uint64_t h) {
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdull;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ull;
+    h ^= h >> 33;
+    return h;
+}
+
+} // namespace
+
+bitnet_file_hasher::bitnet_file_hasher() {
+    lanes[0] = HASH_PRIME_1 + HASH_PRIME_2;
+    lanes[1] = HASH_PRIME_2;
+    lanes[2] = 0;
+    lanes[3] = 0 - HASH_PRIME_1;
+}
+
+void bitnet_file_hasher::update(const uint8_t* data, size_t len) {
+    total += len;
+    if (n_carry > 0) {
+        const size_t take = std::min(len, sizeof(carry) - n_carry);
+        std::memcpy(carry + n_carry, data, take);
+        n_carry += take;
+        data += take;
+        len -= take;
+        if (n_carry < sizeof(carry)) {
+            return;
+        }
+        hash_stripe(lanes, carry);
+        n_carry = 0;
+    }
+    for (; len >= sizeof(carry); data += sizeof(carry), len -= sizeof(carry)) {
+        hash_stripe(lanes, data);
+    }
+    std::memcpy(carry, data, len);
+    n_carry = len;
+}
+
+uint64_t bitnet_file_hasher::digest() const {
+    uint64_t h = rotl64(lanes[0], 1) + rotl64(lanes[1], 7) + rotl64(lanes[2], 12) + rotl64(lanes[3], 18);
+    h ^= total * HASH_PRIME_1;
+    for (size_t i = 0; i < n_carry; ++i) {
+        h = rotl64(h ^ (carry[i] * HASH_PRIME_2), 11) * HASH_PRIME_1;
+    }
+    return hash_avalanche(h);
+}
+
+// Full hash of a model file, read in 4 MiB chunks. Used to key session
+// snapshots and caches to the exact model they were built from; two files
+// that differ in any byte get different keys.
+uint64_t bitnet_fingerprint_file(const char* path) {
+    const int fd = open(path, O_RDONLY);
+    if (fd < 0) return 0;
+
+    bitnet_file_hasher hasher;
+    std::vector<uint8_t> buf(4 * 1024 * 1024);
+    for (;;) {
+        const ssize_t r = read(fd, buf.data(), buf.size());
+        if (r < 0) {
+            close(fd);
+            return 0;
+        }
+        if (r == 0) break;
+        hasher.update(buf.data(), static_cast<size_t>(r));
+    }
+
+    close(fd);
+    return hasher.total > 0 ? hasher.digest() : 0;
+}
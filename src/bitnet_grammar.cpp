@@ -0,0 +1,399 @@
+// Grammar-constrained decoding (see bitnet_grammar.h)
+//
+// Parsing and stack advancement are llama-grammar's own
+// (llama_grammar_init_impl, llama_grammar_accept,
+// llama_grammar_reject_candidates_for_stack), so a state allows exactly the
+// tokens llama_grammar_apply would leave. What this module adds is the
+// memoization: token texts are decoded to code points once per model, and
+// the candidate rejection over the whole vocabulary runs once per state
+// rather than once per sampled token.
+
+#include <algorithm>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "bitnet_grammar.h"
+#include "bitnet_log.h"
+#include "bitnet_vocab.h"
+#include "llama-grammar.h"
+#include "json-schema-to-grammar.h"
+
+namespace {
+
+// Masks kept at once per grammar (n_vocab / 8 bytes each); the oldest are
+// dropped and rebuilt if their state is visited again
+const size_t BITNET_GRAMMAR_MAX_MASKS = 256;
+
+enum token_kind : uint8_t {
+    TOKEN_UNUSABLE = 0,  // empty piece, never allowed
+    TOKEN_TEXT = 1,
+    TOKEN_EOG = 2,       // allowed only once the grammar is complete
+};
+
+struct grammar_state {
+    llama_grammar_stacks stacks;
+    llama_partial_utf8 partial = {0, 0};        // UTF-8 sequence left open by the last token
+    std::vector<uint64_t> allowed;              // empty until first needed
+    std::unordered_map<llama_token, int> next;  // transitions taken so far
+};
+
+struct bitnet_grammar {
+    llama_grammar* parsed = nullptr;            // owns the rules the stacks point into
+    std::vector<grammar_state> states;          // state 0 is the start
+    std::unordered_map<std::string, int> index; // state key -> id
+    std::deque<int> masked;                     // states holding a mask, oldest first
+
+    ~bitnet_grammar() {
+        if (parsed) {
+            llama_grammar_free_impl(parsed);
+        }
+    }
+};
+
+// Every token's text decoded from a clean UTF-8 boundary, shared by all
+// grammars on the model
+struct vocab_code_points {
+    const llama_model* model = nullptr;
+    std::vector<uint32_t> data;               // 0-terminated code point runs
+    std::vector<uint32_t> offsets;            // token id's run starts at data[offsets[id]]
+    std::vector<llama_partial_utf8> partial;  // sequence left open at the end of each token
+    std::vector<uint8_t> kind;                // token_kind
+    std::vector<llama_token> eog;
+};
+
+std::vector<std::unique_ptr<bitnet_grammar>> g_grammars;  // index = handle - 1
+vocab_code_points g_vocab_cp;
+
+// Scratch for masks built from a state with an open UTF-8 sequence
+std::vector<uint32_t> g_scratch_cp;
+std::vector<uint32_t> g_scratch_offsets;
+std::vector<llama_partial_utf8> g_scratch_partial;
+llama_grammar_candidates g_candidates;
+
+// decode_utf8 from llama-grammar.cpp over a length-bounded string: appends
+// the code points of src and a terminating 0 to out, and returns the
+// sequence left open at the end ({0, -1} or n_remain < 0 if invalid)
+llama_partial_utf8 decode_utf8(const char* src, size_t n, llama_partial_utf8 start, std::vector<uint32_t>& out) {
+    static const int lookup[] = {1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 2, 2, 3, 4};
+    const size_t begin = out.size();
+    size_t pos = 0;
+    uint32_t value = start.value;
+    int n_remain = start.n_remain;
+
+    // Continue the previous token's sequence, if any
+    while (pos < n && n_remain > 0) {
+        const uint8_t next_byte = static_cast<uint8_t>(src[pos]);
+        if ((next_byte >> 6) != 2) {
+            out.push_back(0);
+            return {0, -1};
+        }
+        value = (value << 6) + (next_byte & 0x3F);
+        ++pos;
+        --n_remain;
+    }
+    if (start.n_remain > 0 && n_remain == 0) {
+        out.push_back(value);
+    }
+
+    // Decode the following sequences, the last of which may be incomplete
+    while (pos < n) {
+        const uint8_t first_byte = static_cast<uint8_t>(src[pos]);
+        n_remain = lookup[first_byte >> 4] - 1;
+        if (n_remain < 0) {
+            out.resize(begin);
+            out.push_back(0);
+            return {0, n_remain};
+        }
+        value = first_byte & ((1 << (7 - n_remain)) - 1);
+        ++pos;
+        while (pos < n && n_remain > 0) {
+            value = (value << 6) + (static_cast<uint8_t>(src[pos]) & 0x3F);
+            ++pos;
+            --n_remain;
+        }
+        if (n_remain == 0) {
+            out.push_back(value);
+        }
+    }
+    out.push_back(0);
+    return {value, n_remain};
+}
+
+// Token text up to its first NUL, as llama-grammar sees it
+const char* token_text(llama_token id, size_t* n) {
+    const char* piece = bitnet_vocab_piece(id, n);
+    *n = static_cast<size_t>(std::find(piece, piece + *n, '\0') - piece);
+    return piece;
+}
+
+void build_vocab_code_points(const llama_model* model) {
+    if (g_vocab_cp.model == model) {
+        return;
+    }
+    vocab_code_points& cp = g_vocab_cp;
+    cp = vocab_code_points();
+
+    const int n_vocab = llama_n_vocab(model);
+    cp.offsets.resize(n_vocab);
+    cp.partial.assign(n_vocab, {0, 0});
+    cp.kind.assign(n_vocab, TOKEN_UNUSABLE);
+    for (llama_token id = 0; id < n_vocab; ++id) {
+        cp.offsets[id] = static_cast<uint32_t>(cp.data.size());
+        if (llama_token_is_eog(model, id)) {
+            cp.kind[id] = TOKEN_EOG;
+            cp.eog.push_back(id);
+            cp.data.push_back(0);
+            continue;
+        }
+        size_t n = 0;
+        const char* text = token_text(id, &n);
+        if (n == 0) {
+            cp.data.push_back(0);
+            continue;
+        }
+        cp.kind[id] = TOKEN_TEXT;
+        cp.partial[id] = decode_utf8(text, n, {0, 0}, cp.data);
+    }
+    cp.model = model;
+    BITNET_LOG_DEBUG("[bitnet_grammar] Decoded " << n_vocab << " token texts (" << cp.data.size() << " code points)");
+}
+
+bitnet_grammar* lookup(int handle) {
+    if (handle <= 0 || handle > static_cast<int>(g_grammars.size())) {
+        return nullptr;
+    }
+    return g_grammars[handle - 1].get();
+}
+
+bool has_empty_stack(const llama_grammar_stacks& stacks) {
+    for (const llama_grammar_stack& stack : stacks) {
+        if (stack.empty()) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Id of the state (stacks, partial), adding it if new. Stacks are sorted so
+// the same parse set reached in a different order is the same state.
+int intern_state(bitnet_grammar& g, llama_grammar_stacks&& stacks, llama_partial_utf8 partial) {
+    std::sort(stacks.begin(), stacks.end());
+
+    std::string key;
+    for (const llama_grammar_stack& stack : stacks) {
+        const uint32_t depth = static_cast<uint32_t>(stack.size());
+        key.append(reinterpret_cast<const char*>(&depth), sizeof(depth));
+        key.append(reinterpret_cast<const char*>(stack.data()), sizeof(stack[0]) * stack.size());
+    }
+    key.append(reinterpret_cast<const char*>(&partial.value), sizeof(partial.value));
+    key.append(reinterpret_cast<const char*>(&partial.n_remain), sizeof(partial.n_remain));
+
+    auto it = g.index.find(key);
+    if (it != g.index.end()) {
+        return it->second;
+    }
+    const int id = static_cast<int>(g.states.size());
+    g.states.emplace_back();
+    g.states.back().stacks = std::move(stacks);
+    g.states.back().partial = partial;
+    g.index.emplace(std::move(key), id);
+    return id;
+}
+
+// Build the allowed-token bitset of a state: every text token survives
+// unless all stacks reject it, as in llama_grammar_reject_candidates
+void compute_mask(bitnet_grammar& g, int state_id) {
+    const vocab_code_points& cp = g_vocab_cp;
+    const int n_vocab = static_cast<int>(cp.kind.size());
+    grammar_state& st = g.states[state_id];
+    st.allowed.assign(static_cast<size_t>(n_vocab) / 64 + 1, 0);
+
+    g_candidates.clear();
+    if (st.partial.n_remain == 0) {
+        for (llama_token id = 0; id < n_vocab; ++id) {
+            if (cp.kind[id] == TOKEN_TEXT) {
+                g_candidates.push_back({static_cast<size_t>(id), cp.data.data() + cp.offsets[id], cp.partial[id]});
+            }
+        }
+    } else {
+        // The last token ended mid-sequence: every text continues from there
+        g_scratch_cp.clear();
+        g_scratch_offsets.clear();
+        g_scratch_partial.clear();
+        for (llama_token id = 0; id < n_vocab; ++id) {
+            if (cp.kind[id] == TOKEN_TEXT) {
+                size_t n = 0;
+                const char* text = token_text(id, &n);
+                g_scratch_offsets.push_back(static_cast<uint32_t>(g_scratch_cp.size()));
+                g_scratch_partial.push_back(decode_utf8(text, n, st.partial, g_scratch_cp));
+            }
+        }
+        size_t i = 0;
+        for (llama_token id = 0; id < n_vocab; ++id) {
+            if (cp.kind[id] == TOKEN_TEXT) {
+                g_candidates.push_back({static_cast<size_t>(id), g_scratch_cp.data() + g_scratch_offsets[i], g_scratch_partial[i]});
+                ++i;
+            }
+        }
+    }
+
+    for (const llama_grammar_candidate& c : g_candidates) {
+        st.allowed[c.index >> 6] |= uint64_t(1) << (c.index & 63);
+    }
+    if (!g_candidates.empty() && !st.stacks.empty()) {
+        const llama_grammar_rules& rules = llama_grammar_get_rules(g.parsed);
+        llama_grammar_candidates rejects = llama_grammar_reject_candidates_for_stack(rules, st.stacks.front(), g_candidates);
+        for (size_t i = 1; i < st.stacks.size() && !rejects.empty(); ++i) {
+            rejects = llama_grammar_reject_candidates_for_stack(rules, st.stacks[i], rejects);
+        }
+        for (const llama_grammar_candidate& c : rejects) {
+            st.allowed[c.index >> 6] &= ~(uint64_t(1) << (c.index & 63));
+        }
+    }
+    if (has_empty_stack(st.stacks)) {
+        for (const llama_token id : cp.eog) {
+            st.allowed[id >> 6] |= uint64_t(1) << (id & 63);
+        }
+    }
+
+    g.masked.push_back(state_id);
+    if (g.masked.size() > BITNET_GRAMMAR_MAX_MASKS) {
+        std::vector<uint64_t>().swap(g.states[g.masked.front()].allowed);
+        g.masked.pop_front();
+    }
+}
+
+const uint64_t* state_mask(bitnet_grammar& g, int state) {
+    if (g.states[state].allowed.empty()) {
+        compute_mask(g, state);
+    }
+    return g.states[state].allowed.data();
+}
+
+} // namespace
+
+int bitnet_grammar_create(const llama_model* model, const char* gbnf, const char* root) {
+    build_vocab_code_points(model);
+
+    std::unique_ptr<bitnet_grammar> g(new bitnet_grammar());
+    g->parsed = llama_grammar_init_impl(nullptr, gbnf, root ? root : "root");
+    if (!g->parsed) {
+        BITNET_LOG_ERROR("[bitnet_grammar_create] Failed to parse grammar");
+        return 0;
+    }
+    llama_grammar_stacks stacks = llama_grammar_get_stacks(g->parsed);
+    if (stacks.empty()) {
+        BITNET_LOG_ERROR("[bitnet_grammar_create] Grammar accepts nothing");
+        return 0;
+    }
+    intern_state(*g, std::move(stacks), {0, 0});
+
+    // Reuse a freed slot so handles stay small
+    size_t slot = 0;
+    while (slot < g_grammars.size() && g_grammars[slot]) {
+        ++slot;
+    }
+    if (slot == g_grammars.size()) {
+        g_grammars.emplace_back();
+    }
+    g_grammars[slot] = std::move(g);
+
+    BITNET_LOG_INFO("[bitnet_grammar_create] Grammar " << slot + 1 << " compiled ("
+                    << llama_grammar_get_rules(g_grammars[slot]->parsed).size() << " rules)");
+    return static_cast<int>(slot + 1);
+}
+
+int bitnet_grammar_create_from_schema(const llama_model* model, const char* schema) {
+    std::string gbnf;
+    try {
+        gbnf = json_schema_to_grammar(nlohmann::ordered_json::parse(schema));
+    } catch (const std::exception& e) {
+        BITNET_LOG_ERROR("[bitnet_grammar_create_from_schema] " << e.what());
+        return 0;
+    }
+    BITNET_LOG_DEBUG("[bitnet_grammar_create_from_schema] GBNF:\n" << gbnf);
+    return bitnet_grammar_create(model, gbnf.c_str(), "root");
+}
+
+void bitnet_grammar_destroy(int handle) {
+    if (lookup(handle)) {
+        g_grammars[handle - 1].reset();
+    }
+}
+
+void bitnet_grammar_destroy_all() {
+    g_grammars.clear();
+    g_vocab_cp = vocab_code_points();
+    std::vector<uint32_t>().swap(g_scratch_cp);
+    std::vector<uint32_t>().swap(g_scratch_offsets);
+    std::vector<llama_partial_utf8>().swap(g_scratch_partial);
+    llama_grammar_candidates().swap(g_candidates);
+}
+
+bool bitnet_grammar_valid(int handle) {
+    return lookup(handle) != nullptr;
+}
+
+int bitnet_grammar_initial_state(int handle) {
+    return lookup(handle) ? 0 : -1;
+}
+
+const uint64_t* bitnet_grammar_allowed(int handle, int state) {
+    bitnet_grammar* g = lookup(handle);
+    if (!g || state < 0 || state >= static_cast<int>(g->states.size())) {
+        return nullptr;
+    }
+    return state_mask(*g, state);
+}
+
+int bitnet_grammar_next(int handle, int state, llama_token token) {
+    bitnet_grammar* g = lookup(handle);
+    const vocab_code_points& cp = g_vocab_cp;
+    if (!g || state < 0 || state >= static_cast<int>(g->states.size()) ||
+        token < 0 || token >= static_cast<int>(cp.kind.size())) {
+        return -1;
+    }
+
+    auto it = g->states[state].next.find(token);
+    if (it != g->states[state].next.end()) {
+        return it->second;
+    }
+    const uint64_t* allowed = state_mask(*g, state);
+    if (!(allowed[token >> 6] & (uint64_t(1) << (token & 63)))) {
+        return -1;
+    }
+    if (cp.kind[token] == TOKEN_EOG) {
+        return state;
+    }
+
+    // llama_grammar_accept_impl: advance the stacks over each code point
+    const grammar_state& st = g->states[state];
+    std::vector<uint32_t> decoded;
+    const uint32_t* code_points = cp.data.data() + cp.offsets[token];
+    llama_partial_utf8 partial = cp.partial[token];
+    if (st.partial.n_remain != 0) {
+        size_t n = 0;
+        const char* text = token_text(token, &n);
+        partial = decode_utf8(text, n, st.partial, decoded);
+        code_points = decoded.data();
+    }
+
+    const llama_grammar_rules& rules = llama_grammar_get_rules(g->parsed);
+    llama_grammar_stacks stacks = st.stacks;
+    llama_grammar_stacks stacks_new;
+    for (const uint32_t* c = code_points; *c != 0; ++c) {
+        llama_grammar_accept(rules, stacks, *c, stacks_new);
+        stacks.swap(stacks_new);
+    }
+    if (stacks.empty()) {
+        return -1;
+    }
+
+    const int next = intern_state(*g, std::move(stacks), partial);
+    g->states[state].next.emplace(token, next);
+    return next;
+}
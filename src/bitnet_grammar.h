@@ -0,0 +1,37 @@
+#pragma once
+// Grammar-constrained decoding. A GBNF grammar (or a JSON schema, converted
+// to GBNF) is compiled once into an automaton over the vocabulary: a state is
+// a set of llama-grammar parse stacks plus a pending partial UTF-8 sequence,
+// and each state caches, on first visit, the bitset of tokens it allows and
+// its transitions by token. Constraining a step is then a bitset handed to
+// the sampler instead of a walk of every token's text through the grammar.
+// Compiled grammars are addressed by handle and reused across requests; they
+// are built against the loaded model's vocabulary and freed with it.
+
+#include <cstdint>
+
+#include "llama.h"
+
+// Compile GBNF text starting at rule root (NULL for "root"). Returns a
+// handle > 0, or 0 if the grammar does not parse.
+int bitnet_grammar_create(const llama_model* model, const char* gbnf, const char* root);
+
+// Compile a JSON schema through llama.cpp's json_schema_to_grammar.
+// Returns a handle > 0, or 0 if the schema is invalid or unsupported.
+int bitnet_grammar_create_from_schema(const llama_model* model, const char* schema);
+
+void bitnet_grammar_destroy(int handle);
+void bitnet_grammar_destroy_all();
+bool bitnet_grammar_valid(int handle);
+
+// Automaton walk. State ids stay valid for the grammar's lifetime.
+int bitnet_grammar_initial_state(int handle);
+
+// Tokens allowed in state, one bit per token id; valid until the next call
+// into this module. End-of-generation tokens are allowed once the grammar
+// is complete.
+const uint64_t* bitnet_grammar_allowed(int handle, int state);
+
+// State after token (end-of-generation keeps the state), or -1 if state
+// does not allow token
+int bitnet_grammar_next(int handle, int state, llama_token token);
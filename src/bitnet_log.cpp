@@ -0,0 +1,53 @@
+// Trace ring buffer (see bitnet_log.h)
+
+#include <algorithm>
+
+#include "bitnet_log.h"
+
+#ifdef __EMSCRIPTEN__
+#include <emscripten.h>
+#else
+#define EMSCRIPTEN_KEEPALIVE
+#endif
+
+namespace {
+
+bitnet_trace_record g_trace[BITNET_TRACE_CAPACITY];
+size_t g_trace_head = 0;   // index of the oldest record
+size_t g_trace_count = 0;
+uint32_t g_trace_dropped = 0;
+
+} // namespace
+
+void bitnet_trace_push(bitnet_trace_type type, int32_t value, int64_t t_start_us, int64_t t_end_us) {
+    const size_t slot = (g_trace_head + g_trace_count) % BITNET_TRACE_CAPACITY;
+    g_trace[slot] = {type, value, t_start_us / 1000.0, (t_end_us - t_start_us) / 1000.0};
+
+    if (g_trace_count < BITNET_TRACE_CAPACITY) {
+        g_trace_count++;
+    } else {
+        g_trace_head = (g_trace_head + 1) % BITNET_TRACE_CAPACITY;
+        g_trace_dropped++;
+    }
+}
+
+extern "C" {
+    // Move up to max_records of the oldest trace records into `out` and
+    // return how many were written
+    __attribute__((visibility("default"))) EMSCRIPTEN_KEEPALIVE int bitnet_trace_drain(bitnet_trace_record* out, int max_records) {
+        const size_t n = std::min(g_trace_count, static_cast<size_t>(std::max(0, max_records)));
+        for (size_t i = 0; i < n; ++i) {
+            out[i] = g_trace[(g_trace_head + i) % BITNET_TRACE_CAPACITY];
+        }
+        g_trace_head = (g_trace_head + n) % BITNET_TRACE_CAPACITY;
+        g_trace_count -= n;
+        return static_cast<int>(n);
+    }
+
+    // Records overwritten before they were drained, since the last call
+    __attribute__((visibility("default"))) EMSCRIPTEN_KEEPALIVE int bitnet_trace_dropped() {
+        const uint32_t dropped = g_trace_dropped;
+        g_trace_dropped = 0;
+        return static_cast<int>(dropped);
+    }
+}
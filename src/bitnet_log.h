@@ -0,0 +1,69 @@
+#pragma once
+// Logging and tracing for BitNet WASM
+//
+// BITNET_LOG_* take a stream expression: BITNET_LOG_INFO("n=" << n). Levels
+// above BITNET_LOG_LEVEL compile to nothing, arguments included, so debug
+// output costs nothing in release builds (NDEBUG defaults to INFO). Under
+// Emscripten every emitted line is a synchronous call into the JS console, so
+// anything per-token belongs in DEBUG or in the trace ring below.
+
+#include <cstdint>
+#include <iostream>
+
+#define BITNET_LOG_LEVEL_ERROR 0
+#define BITNET_LOG_LEVEL_WARN  1
+#define BITNET_LOG_LEVEL_INFO  2
+#define BITNET_LOG_LEVEL_DEBUG 3
+
+#ifndef BITNET_LOG_LEVEL
+#ifdef NDEBUG
+#define BITNET_LOG_LEVEL BITNET_LOG_LEVEL_INFO
+#else
+#define BITNET_LOG_LEVEL BITNET_LOG_LEVEL_DEBUG
+#endif
+#endif
+
+#define BITNET_LOG_ERROR(expr) do { std::cerr << expr << std::endl; } while (0)
+
+#if BITNET_LOG_LEVEL >= BITNET_LOG_LEVEL_WARN
+#define BITNET_LOG_WARN(expr) do { std::cerr << expr << std::endl; } while (0)
+#else
+#define BITNET_LOG_WARN(expr) do { } while (0)
+#endif
+
+#if BITNET_LOG_LEVEL >= BITNET_LOG_LEVEL_INFO
+#define BITNET_LOG_INFO(expr) do { std::cout << expr << std::endl; } while (0)
+#else
+#define BITNET_LOG_INFO(expr) do { } while (0)
+#endif
+
+#if BITNET_LOG_LEVEL >= BITNET_LOG_LEVEL_DEBUG
+#define BITNET_LOG_DEBUG(expr) do { std::cout << expr << std::endl; } while (0)
+#else
+#define BITNET_LOG_DEBUG(expr) do { } while (0)
+#endif
+
+// Trace ring: fixed-size in-memory record of timed events, drained by the host
+// through bitnet_trace_drain. When full, the oldest records are overwritten.
+enum bitnet_trace_type : uint32_t {
+    BITNET_TRACE_TOKENIZE = 1,  // value: prompt tokens
+    BITNET_TRACE_PREFILL  = 2,  // value: tokens decoded in this chunk
+    BITNET_TRACE_DECODE   = 3,  // value: token id decoded (batch size for bitnet_batch_step)
+    BITNET_TRACE_SAMPLE   = 4,  // value: token id sampled
+    BITNET_TRACE_SHIFT    = 5,  // value: tokens discarded by a context shift
+    BITNET_TRACE_EMBED    = 6,  // value: texts embedded in this batch
+};
+
+// 24 bytes, read from JS as HEAPU32[i*6], HEAP32[i*6+1], HEAPF64[i*3+1..2]
+struct bitnet_trace_record {
+    uint32_t type;
+    int32_t value;
+    double t_start_ms;  // ggml_time_us based, same clock for every record
+    double duration_ms;
+};
+
+static_assert(sizeof(bitnet_trace_record) == 24, "trace record layout is part of the JS ABI");
+
+#define BITNET_TRACE_CAPACITY 4096
+
+void bitnet_trace_push(bitnet_trace_type type, int32_t value, int64_t t_start_us, int64_t t_end_us);
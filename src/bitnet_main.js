@@ -1,30 +1,19 @@
 // BitNet WASM inference main.js
-import ModuleFactory from '../bitnet.js';
+//
+// The WASM module runs in a worker (bitnet_worker.js); this page only talks
+// to it through BitNetClient, so loading and generation never block the UI.
+import { BitNetClient } from './bitnet_client.js';
 
-// Global variable to store the WASM module instance
-let wasmModule = null;
+// Client for the worker running the WASM module
+let bitnet = null;
 let modelLoaded = false;
 
-// Helper function to allocate string in WASM memory
-function allocateString(str) {
-    const len = wasmModule.lengthBytesUTF8(str) + 1;
-    const ptr = wasmModule._malloc(len);
-    wasmModule.stringToUTF8(str, ptr, len);
-    return { ptr, len, free: () => wasmModule._free(ptr) };
-}
-
-// Helper function to read string from WASM memory
-function readString(ptr, maxLen = 1024) {
-    const buffer = new Uint8Array(wasmModule.HEAPU8.buffer, ptr, maxLen);
-    let str = '';
-    for (let i = 0; i < maxLen; i++) {
-        if (buffer[i] === 0) break;
-        str += String.fromCharCode(buffer[i]);
-    }
-    return str;
-}
+// Generation in flight, so the cancel button can stop it
+let currentGeneration = null;
 
-// Load model from URL
+// Load model from URL. The worker downloads (or reads its model cache) and
+// streams the file into the loader itself, so no model bytes pass through
+// this thread.
 async function loadModelFromURL(modelPath) {
     const outputElement = document.getElementById('output');
     const loadStatusElement = document.getElementById('load-status');
@@ -33,69 +22,30 @@ async function loadModelFromURL(modelPath) {
         outputElement.innerHTML += `Loading model from ${modelPath}...<br>`;
         loadStatusElement.innerHTML = 'Loading model...';
         
-        const response = await fetch(modelPath);
-        if (!response.ok) {
-            throw new Error(`Failed to fetch model: ${response.status} ${response.statusText}`);
-        }
-        
-        const arrayBuffer = await response.arrayBuffer();
-        const modelSize = arrayBuffer.byteLength;
-        
-        outputElement.innerHTML += `Model downloaded: ${(modelSize / (1024 * 1024)).toFixed(2)} MB<br>`;
-        loadStatusElement.innerHTML = 'Processing model...';
+        const info = await bitnet.load({ url: modelPath }, {
+            onProgress: ({ received, expected }) => {
+                const receivedMB = (received / (1024 * 1024)).toFixed(1);
+                loadStatusElement.innerHTML = expected
+                    ? `Downloading model... ${receivedMB} MB (${Math.round(received * 100 / expected)}%)`
+                    : `Downloading model... ${receivedMB} MB`;
+            },
+        });
         
-        // Allocate memory in WASM for the model
-        const modelPtr = wasmModule._malloc(modelSize);
-        if (!modelPtr) {
-            throw new Error('Failed to allocate memory for model');
+        if (info.cached) {
+            outputElement.innerHTML += `Used the preprocessed model cache<br>`;
         }
-        
-        // Copy model data to WASM memory
-        const modelData = new Uint8Array(wasmModule.HEAPU8.buffer, modelPtr, modelSize);
-        modelData.set(new Uint8Array(arrayBuffer));
-        
-        outputElement.innerHTML += `Model data copied to WASM memory<br>`;
-        loadStatusElement.innerHTML = 'Loading model into BitNet...';
-        
-        // Load model using BitNet
-        const result = wasmModule._bitnet_load_model(modelPtr, modelSize);
-        
-        // Free the temporary model data
-        wasmModule._free(modelPtr);
-        
-        if (result === 1) {
-            modelLoaded = true;
-            outputElement.innerHTML += `<span class="success">Model loaded successfully!</span><br>`;
-            loadStatusElement.innerHTML = '<span class="success">Model loaded successfully!</span>';
-            
-            // Get model info
-            const vocabSizePtr = wasmModule._malloc(4);
-            const nEmbdPtr = wasmModule._malloc(4);
-            const nLayerPtr = wasmModule._malloc(4);
-            
-            wasmModule._bitnet_get_model_info(vocabSizePtr, nEmbdPtr, nLayerPtr);
-            
-            const vocabSize = new Uint32Array(wasmModule.HEAPU8.buffer, vocabSizePtr, 1)[0];
-            const nEmbd = new Uint32Array(wasmModule.HEAPU8.buffer, nEmbdPtr, 1)[0];
-            const nLayer = new Uint32Array(wasmModule.HEAPU8.buffer, nLayerPtr, 1)[0];
-            
-            wasmModule._free(vocabSizePtr);
-            wasmModule._free(nEmbdPtr);
-            wasmModule._free(nLayerPtr);
-            
-            outputElement.innerHTML += `Model info: vocab=${vocabSize}, embd=${nEmbd}, layers=${nLayer}<br>`;
-            
-            // Enable inference button
-            const inferenceButton = document.getElementById('run-inference');
-            if (inferenceButton) {
-                inferenceButton.disabled = false;
-            }
-            
-            return true;
-        } else {
-            throw new Error('BitNet failed to load model');
+        modelLoaded = true;
+        outputElement.innerHTML += `<span class="success">Model loaded successfully!</span><br>`;
+        loadStatusElement.innerHTML = '<span class="success">Model loaded successfully!</span>';
+        outputElement.innerHTML += `Model info: vocab=${info.vocabSize}, embd=${info.nEmbd}, layers=${info.nLayer}<br>`;
+        
+        // Enable inference button
+        const inferenceButton = document.getElementById('run-inference');
+        if (inferenceButton) {
+            inferenceButton.disabled = false;
         }
         
+        return true;
     } catch (error) {
         outputElement.innerHTML += `<span class="error">Error loading model: ${error.message}</span><br>`;
         loadStatusElement.innerHTML = `<span class="error">Error: ${error.message}</span>`;
@@ -105,7 +55,7 @@ async function loadModelFromURL(modelPath) {
 }
 
 // Run BitNet inference
-function runBitNetInference(inputText) {
+async function runBitNetInference(inputText) {
     const outputElement = document.getElementById('output');
     const resultElement = document.getElementById('inference-result');
     
@@ -116,37 +66,41 @@ function runBitNetInference(inputText) {
         return;
     }
     
+    const cancelButton = document.getElementById('cancel-inference');
     try {
         outputElement.innerHTML += `Running BitNet inference on: "${inputText}"<br>`;
         resultElement.innerHTML = 'Running inference...';
         
-        // Allocate input string
-        const inputAlloc = allocateString(inputText);
-        
-        // Allocate output buffer
-        const maxOutputLen = 512;
-        const outputPtr = wasmModule._malloc(maxOutputLen);
-        
-        // Run inference
-        const outputLen = wasmModule._bitnet_inference_run(inputAlloc.ptr, outputPtr, maxOutputLen);
+        const maxTokens = 128;
+        currentGeneration = bitnet.generate(inputText, {
+            maxTokens,
+            onToken: (piece, textSoFar) => {
+                resultElement.textContent = textSoFar;
+            },
+        });
+        if (cancelButton) cancelButton.disabled = false;
+        const { text: outputText, cancelled } = await currentGeneration;
         
-        if (outputLen > 0) {
-            const outputText = readString(outputPtr, outputLen);
+        if (cancelled) {
+            outputElement.innerHTML += `Inference cancelled<br>`;
+        } else if (outputText.length > 0) {
             outputElement.innerHTML += `<span class="success">Inference completed!</span><br>`;
-            resultElement.innerHTML = `<div class="model-output"><strong>BitNet Output:</strong><br>${outputText}</div>`;
+            
+            const { generation: stats } = await bitnet.stats();
+            outputElement.innerHTML += `Prefill: ${stats.prompt_tokens} tokens at ${stats.prefill_tokens_per_sec.toFixed(1)} tok/s, ` +
+                `decode: ${stats.decode_tokens} tokens at ${stats.decode_tokens_per_sec.toFixed(1)} tok/s<br>`;
         } else {
             throw new Error('Inference failed or returned empty result');
         }
         
-        // Clean up
-        inputAlloc.free();
-        wasmModule._free(outputPtr);
-        
     } catch (error) {
         const errorMsg = `Error during inference: ${error.message}`;
         outputElement.innerHTML += `<span class="error">${errorMsg}</span><br>`;
         resultElement.innerHTML = `<span class="error">${errorMsg}</span>`;
         console.error('Inference error:', error);
+    } finally {
+        currentGeneration = null;
+        if (cancelButton) cancelButton.disabled = true;
     }
 }
 
@@ -273,45 +227,21 @@ function createMatrix(data, rows, cols) {
     };
 }
 
-// Initialize WASM module
-function onWasmInitialized(wasmModuleInstance) {
-    wasmModule = wasmModuleInstance;
+// The worker has initialized the WASM module
+function onWasmInitialized(client) {
+    bitnet = client;
     
     const outputElement = document.getElementById('output');
     const statusElement = document.getElementById('status');
     
     outputElement.innerHTML = 'BitNet WASM Module Initialized and Ready.<br>';
+    outputElement.innerHTML += `BitNet inference engine running in a worker (${client.threads} thread(s)` +
+        `${client.cancelFlag ? ', shared-heap cancellation' : ''}).<br>`;
     if (statusElement) {
         statusElement.textContent = 'WASM module initialized. Ready to use BitNet functions.';
         statusElement.classList.add('success');
     }
     
-    // Initialize BitNet
-    try {
-        wasmModule._bitnet_init();
-        outputElement.innerHTML += 'BitNet inference engine initialized successfully.<br>';
-        
-        // Check available functions
-        const availableFunctions = [];
-        if (typeof wasmModule._bitnet_init === 'function') availableFunctions.push('bitnet_init');
-        if (typeof wasmModule._bitnet_load_model === 'function') availableFunctions.push('bitnet_load_model');
-        if (typeof wasmModule._bitnet_inference_run === 'function') availableFunctions.push('bitnet_inference_run');
-        if (typeof wasmModule._bitnet_get_model_info === 'function') availableFunctions.push('bitnet_get_model_info');
-        if (typeof wasmModule._bitnet_is_model_loaded === 'function') availableFunctions.push('bitnet_is_model_loaded');
-        if (typeof wasmModule._bitnet_free_model === 'function') availableFunctions.push('bitnet_free_model');
-        
-        outputElement.innerHTML += `Available BitNet functions: ${availableFunctions.join(', ')}<br>`;
-        
-    } catch (e) {
-        console.error('Error initializing BitNet:', e);
-        outputElement.innerHTML += `<span class="error">Error initializing BitNet: ${e}</span><br>`;
-        if (statusElement) {
-            statusElement.textContent = 'Error initializing BitNet.';
-            statusElement.classList.add('error');
-        }
-        return;
-    }
-    
     setupModelInferenceDemo();
     setupMatrixMultiplicationDemo();
     setupTensorTransformationDemo();
@@ -349,6 +279,14 @@ function setupModelInferenceDemo() {
             runBitNetInference(inputText);
         });
     }
+    
+    const cancelButton = document.getElementById('cancel-inference');
+    if (cancelButton) {
+        cancelButton.disabled = true;
+        cancelButton.addEventListener('click', () => {
+            if (currentGeneration) currentGeneration.cancel();
+        });
+    }
 }
 
 // Set up the matrix multiplication demo
@@ -442,8 +380,7 @@ function setupTensorTransformationDemo() {
 // Initialize the module when the page loads
 document.addEventListener('DOMContentLoaded', async () => {
     try {
-        const wasmModuleInstance = await ModuleFactory();
-        onWasmInitialized(wasmModuleInstance);
+        onWasmInitialized(await BitNetClient.create());
     } catch (error) {
         console.error('Failed to initialize WASM module:', error);
         const statusElement = document.getElementById('status');
@@ -0,0 +1,165 @@
+// Load-time memory planner (see bitnet_memplan.h)
+
+#include <algorithm>
+#include <cstdlib>
+#include <string>
+
+#ifdef __EMSCRIPTEN__
+#include <emscripten/heap.h>
+#endif
+
+#include "bitnet_memplan.h"
+#include "bitnet_log.h"
+#include "bitnet_pager.h"
+#include "ggml.h"
+
+namespace {
+
+// Headroom kept outside the planned buffers for everything else the runtime
+// allocates: tokenizer and vocab tables, sampler scratch, batches, stacks
+const uint64_t BITNET_MEMORY_RESERVE = 128ull << 20;
+
+// Graph metadata of the compute context (tensor and node overhead)
+const uint64_t BITNET_GRAPH_OVERHEAD = 8ull << 20;
+
+// Extra output rows the verification batches of lookup and draft decoding
+// ask logits for, on top of one row per sequence
+const uint64_t BITNET_OUTPUT_ROWS = 16;
+
+// n_ctx granularity; llama.cpp pads the KV cache to 256 cells with flash
+// attention and 32 without
+const uint32_t BITNET_CTX_STEP = 256;
+
+struct model_dims {
+    uint64_t n_layer = 0;
+    uint64_t n_embd = 0;
+    uint64_t n_head = 0;
+    uint64_t n_head_kv = 0;
+    uint64_t n_ff = 0;
+    uint64_t n_vocab = 0;
+};
+
+// Integer metadata value "<arch>.<key>", or fallback if absent
+uint64_t meta_u64(const llama_model* model, const std::string& arch, const char* key, uint64_t fallback) {
+    char buf[64];
+    const std::string name = arch + "." + key;
+    if (llama_model_meta_val_str(model, name.c_str(), buf, sizeof(buf)) <= 0) {
+        return fallback;
+    }
+    const uint64_t value = std::strtoull(buf, nullptr, 10);
+    return value > 0 ? value : fallback;
+}
+
+model_dims read_dims(const llama_model* model) {
+    model_dims dims;
+    dims.n_layer = llama_n_layer(model);
+    dims.n_embd = llama_n_embd(model);
+    dims.n_head = std::max(1, llama_n_head(model));
+    dims.n_vocab = llama_n_vocab(model);
+
+    char arch[64] = {};
+    llama_model_meta_val_str(model, "general.architecture", arch, sizeof(arch));
+    dims.n_head_kv = meta_u64(model, arch, "attention.head_count_kv", dims.n_head);
+    dims.n_ff = meta_u64(model, arch, "feed_forward_length", 4 * dims.n_embd);
+    return dims;
+}
+
+// KV cache bytes per context token, across all layers
+uint64_t kv_bytes_per_token(const model_dims& dims, const llama_context_params& cparams) {
+    const int64_t n_embd_gqa = static_cast<int64_t>(dims.n_embd / dims.n_head * dims.n_head_kv);
+    return dims.n_layer * (ggml_row_size(cparams.type_k, n_embd_gqa) + ggml_row_size(cparams.type_v, n_embd_gqa));
+}
+
+uint64_t n_ubatch_of(const llama_context_params& cparams, uint32_t n_ctx) {
+    return std::min({cparams.n_ubatch, cparams.n_batch, n_ctx});
+}
+
+// Compute buffer bytes that grow with the context: the attention mask and,
+// without flash attention, the f32 KQ scores and their softmax
+uint64_t compute_bytes_per_token(const model_dims& dims, const llama_context_params& cparams, uint64_t n_ubatch) {
+    const uint64_t mask = (n_ubatch + 31) / 32 * 32 * (cparams.flash_attn ? 2 : 4);
+    const uint64_t scores = cparams.flash_attn ? 0 : 2 * n_ubatch * dims.n_head * 4;
+    return mask + scores;
+}
+
+// Compute and output buffer bytes that do not depend on the context size:
+// the f32 activations of one ubatch through a layer and the logits
+uint64_t compute_bytes_fixed(const model_dims& dims, const llama_context_params& cparams, uint64_t n_ubatch) {
+    const uint64_t activations = n_ubatch * (4 * dims.n_embd + 2 * dims.n_ff + dims.n_vocab) * 4;
+    const uint64_t output = dims.n_vocab * 4 * (cparams.n_seq_max + BITNET_OUTPUT_ROWS);
+    return activations + output + BITNET_GRAPH_OVERHEAD;
+}
+
+bool kv_types_fit(const model_dims& dims, const llama_context_params& cparams) {
+    const int64_t n_embd_head = static_cast<int64_t>(dims.n_embd / dims.n_head);
+    for (const ggml_type type : {cparams.type_k, cparams.type_v}) {
+        if (n_embd_head % ggml_blck_size(type) != 0) {
+            BITNET_LOG_ERROR("[bitnet_memory_plan] KV type " << ggml_type_name(type) << " needs the head size ("
+                             << n_embd_head << ") to be a multiple of " << ggml_blck_size(type));
+            return false;
+        }
+    }
+    return true;
+}
+
+} // namespace
+
+uint64_t bitnet_memory_default_budget() {
+#ifdef __EMSCRIPTEN__
+    return emscripten_get_heap_max();
+#else
+    return 0;
+#endif
+}
+
+uint64_t bitnet_memory_ctx_bytes(const llama_model* model, const llama_context_params& cparams, uint32_t n_ctx) {
+    const model_dims dims = read_dims(model);
+    const uint64_t n_ubatch = n_ubatch_of(cparams, n_ctx);
+    return n_ctx * (kv_bytes_per_token(dims, cparams) + compute_bytes_per_token(dims, cparams, n_ubatch))
+           + compute_bytes_fixed(dims, cparams, n_ubatch);
+}
+
+bool bitnet_memory_plan_ctx(const llama_model* model, const llama_context_params& cparams,
+                            uint64_t budget, uint32_t n_ctx_max, bitnet_memory_plan& plan) {
+    const model_dims dims = read_dims(model);
+    if (!kv_types_fit(dims, cparams)) {
+        return false;
+    }
+
+    plan = bitnet_memory_plan();
+    plan.type_k = cparams.type_k;
+    plan.type_v = cparams.type_v;
+    plan.budget_bytes = budget;
+    // A paged model only keeps its slot pool and non-layer tensors resident
+    plan.weight_bytes = bitnet_pager_active() ? bitnet_pager_get_stats().resident_bytes : llama_model_size(model);
+    plan.reserve_bytes = BITNET_MEMORY_RESERVE;
+
+    // Both per-token terms only shrink once n_ctx drops below n_ubatch, so
+    // sizing them at the full ubatch keeps the estimate conservative
+    const uint64_t n_ubatch = n_ubatch_of(cparams, std::max(n_ctx_max, BITNET_CTX_STEP));
+    const uint64_t per_token = kv_bytes_per_token(dims, cparams) + compute_bytes_per_token(dims, cparams, n_ubatch);
+    const uint64_t fixed = plan.weight_bytes + plan.reserve_bytes + compute_bytes_fixed(dims, cparams, n_ubatch);
+
+    uint64_t n_ctx = n_ctx_max;
+    if (budget > 0) {
+        n_ctx = budget > fixed ? std::min<uint64_t>(n_ctx, (budget - fixed) / per_token) : 0;
+    }
+    n_ctx = n_ctx / BITNET_CTX_STEP * BITNET_CTX_STEP;
+    if (n_ctx < BITNET_CTX_STEP) {
+        BITNET_LOG_ERROR("[bitnet_memory_plan] Budget of " << (budget >> 20) << " MiB leaves no room for a context: "
+                         << "weights " << (plan.weight_bytes >> 20) << " MiB, fixed buffers "
+                         << ((fixed - plan.weight_bytes) >> 20) << " MiB, " << per_token << " bytes per token");
+        return false;
+    }
+
+    plan.n_ctx = static_cast<uint32_t>(n_ctx);
+    plan.kv_bytes = n_ctx * kv_bytes_per_token(dims, cparams);
+    plan.compute_bytes = bitnet_memory_ctx_bytes(model, cparams, plan.n_ctx) - plan.kv_bytes;
+
+    BITNET_LOG_INFO("[bitnet_memory_plan] n_ctx=" << plan.n_ctx << " (max " << n_ctx_max << "): KV "
+                    << ggml_type_name(cparams.type_k) << "/" << ggml_type_name(cparams.type_v) << " "
+                    << (plan.kv_bytes >> 20) << " MiB, compute " << (plan.compute_bytes >> 20) << " MiB, weights "
+                    << (plan.weight_bytes >> 20) << " MiB, budget "
+                    << (budget > 0 ? std::to_string(budget >> 20) + " MiB" : std::string("unlimited")));
+    return true;
+}
@@ -0,0 +1,35 @@
+#pragma once
+// Load-time memory planner. Estimates what a context costs (KV cache,
+// compute buffer, output buffer) from the model hyperparameters and the
+// context parameters, and picks the largest n_ctx whose total footprint,
+// weights included, fits a memory budget, so the context is created on the
+// first try instead of by trial and error.
+
+#include <cstdint>
+
+#include "llama.h"
+
+struct bitnet_memory_plan {
+    uint32_t n_ctx = 0;
+    ggml_type type_k = GGML_TYPE_F16;
+    ggml_type type_v = GGML_TYPE_F16;
+    uint64_t budget_bytes = 0;   // 0 = unlimited
+    uint64_t weight_bytes = 0;
+    uint64_t kv_bytes = 0;       // at n_ctx
+    uint64_t compute_bytes = 0;  // at n_ctx, output buffer included
+    uint64_t reserve_bytes = 0;  // runtime headroom: tokenizer, sampler, stacks
+};
+
+// Total memory available to the process: the wasm heap limit, or 0
+// (unlimited) in native builds
+uint64_t bitnet_memory_default_budget();
+
+// Plan the context for cparams (n_batch, n_ubatch, n_seq_max, KV types and
+// flash_attn are taken as given; n_ctx is ignored). n_ctx is the largest
+// multiple of 256 that fits budget, capped at n_ctx_max. Returns false if
+// not even 256 tokens fit or the KV types do not suit the head size.
+bool bitnet_memory_plan_ctx(const llama_model* model, const llama_context_params& cparams,
+                            uint64_t budget, uint32_t n_ctx_max, bitnet_memory_plan& plan);
+
+// Footprint of a context of n_ctx tokens under the same estimate
+uint64_t bitnet_memory_ctx_bytes(const llama_model* model, const llama_context_params& cparams, uint32_t n_ctx);
@@ -0,0 +1,141 @@
+// Persistent store for preprocessed model cache files (bitnet_set_cache_export).
+//
+// Entries are keyed by the model URL (or any string) and remember the source
+// model hash reported by bitnet_get_model_hash() and what identified the
+// source when the entry was made (its ETag, Last-Modified and length, or a
+// local file's size and mtime), so callers can tell a stale entry. get()
+// returns { response, hash, source }; the response body streams from the
+// store, so a warm start never stages the file anywhere but MEMFS. put(key,
+// data, { hash, size, source }) takes the file as a Uint8Array or as a
+// ReadableStream of its size bytes, written through without collecting it
+// in memory. Backends, in order of preference: Node's file system, the
+// Origin Private File System, the Cache API.
+
+const CACHE_NAME = 'bitnet-model-cache';
+
+// Cache entry names must be plain file names in OPFS and on disk
+function entryName(key) {
+    let h = 0x811c9dc5;
+    for (let i = 0; i < key.length; i++) {
+        h = Math.imul(h ^ key.charCodeAt(i), 0x01000193) >>> 0;
+    }
+    return `${key.replace(/[^A-Za-z0-9._-]+/g, '_').slice(-80)}-${h.toString(16)}.gguf`;
+}
+
+async function openNodeCache(dir) {
+    const fs = await import('node:fs/promises');
+    const { createReadStream } = await import('node:fs');
+    const { Readable } = await import('node:stream');
+    const path = await import('node:path');
+    await fs.mkdir(dir, { recursive: true });
+    const file = key => path.join(dir, entryName(key));
+    return {
+        kind: 'fs',
+        async get(key) {
+            try {
+                const meta = JSON.parse(await fs.readFile(file(key) + '.json', 'utf8'));
+                const { size } = await fs.stat(file(key));
+                const response = new Response(Readable.toWeb(createReadStream(file(key))), {
+                    headers: { 'Content-Length': String(size) },
+                });
+                return { response, hash: meta.hash, source: meta.source };
+            } catch {
+                return null;
+            }
+        },
+        async put(key, data, { hash, source }) {
+            // Data first, metadata last: an entry without metadata is not found
+            await fs.writeFile(file(key), data instanceof ReadableStream ? Readable.fromWeb(data) : data);
+            await fs.writeFile(file(key) + '.json', JSON.stringify({ hash, source }));
+        },
+        async delete(key) {
+            await Promise.all([fs.rm(file(key), { force: true }), fs.rm(file(key) + '.json', { force: true })]);
+        },
+    };
+}
+
+async function openOpfsCache() {
+    const root = await navigator.storage.getDirectory();
+    const dir = await root.getDirectoryHandle(CACHE_NAME, { create: true });
+    const write = async (name, data) => {
+        const writable = await (await dir.getFileHandle(name, { create: true })).createWritable();
+        if (data instanceof ReadableStream) {
+            await data.pipeTo(writable);    // closes writable when done
+        } else {
+            await writable.write(data);
+            await writable.close();
+        }
+    };
+    return {
+        kind: 'opfs',
+        async get(key) {
+            try {
+                const name = entryName(key);
+                const meta = await (await dir.getFileHandle(name + '.json')).getFile();
+                const file = await (await dir.getFileHandle(name)).getFile();
+                const { hash, source } = JSON.parse(await meta.text());
+                return { response: new Response(file), hash, source };
+            } catch {
+                return null;
+            }
+        },
+        async put(key, data, { hash, source }) {
+            const name = entryName(key);
+            await write(name, data);
+            await write(name + '.json', JSON.stringify({ hash, source }));
+        },
+        async delete(key) {
+            const name = entryName(key);
+            await Promise.all([name, name + '.json'].map(n => dir.removeEntry(n).catch(() => {})));
+        },
+    };
+}
+
+async function openHttpCache() {
+    const cache = await caches.open(CACHE_NAME);
+    const request = key => new Request(`/${CACHE_NAME}/${entryName(key)}`);
+    return {
+        kind: 'cache',
+        async get(key) {
+            const response = await cache.match(request(key));
+            if (!response) return null;
+            const source = response.headers.get('X-BitNet-Model-Source');
+            return {
+                response,
+                hash: response.headers.get('X-BitNet-Model-Hash'),
+                source: source ? JSON.parse(source) : null,
+            };
+        },
+        async put(key, data, { hash, size = data.length, source }) {
+            await cache.put(request(key), new Response(data, {
+                headers: {
+                    'Content-Length': String(size),
+                    'X-BitNet-Model-Hash': hash,
+                    'X-BitNet-Model-Source': JSON.stringify(source || null),
+                },
+            }));
+        },
+        async delete(key) {
+            await cache.delete(request(key));
+        },
+    };
+}
+
+// Open the best available store, or null if there is none. options.dir is
+// the cache directory under Node (default ./.bitnet-cache).
+export async function openModelCache(options = {}) {
+    try {
+        if (typeof process !== 'undefined' && process.versions?.node) {
+            return await openNodeCache(options.dir || '.bitnet-cache');
+        }
+        if (globalThis.navigator?.storage?.getDirectory) {
+            return await openOpfsCache();
+        }
+        if (globalThis.caches) {
+            return await openHttpCache();
+        }
+    } catch (error) {
+        console.warn('BitNet model cache unavailable:', error);
+    }
+    return null;
+}
@@ -0,0 +1,465 @@
+// Per-layer weight paging (see bitnet_pager.h)
+//
+// The ggml scheduler asks the eval callback about every node before
+// computing, and computes up to the first node the callback wants to see.
+// The pager wants the first node that reads a layer's weights: while being
+// asked it makes the layer resident, and once that node has run (the
+// previous layer is finished) it starts reading the layer after. Slots are
+// only reassigned on the calling thread; the read-ahead thread fills bytes.
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#ifndef __EMSCRIPTEN__
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#include "ggml.h"
+#include "bitnet_pager.h"
+#include "bitnet_log.h"
+#include "bitnet_profile.h"
+
+namespace {
+
+const size_t BITNET_PAGER_ALIGNMENT = 64;
+
+struct paged_tensor {
+    ggml_tensor* tensor = nullptr;
+    void* home = nullptr;      // data as loaded
+    bool mapped = false;       // home lies in the loader's file mapping
+    uint64_t file_offset = 0;
+    size_t nbytes = 0;
+    size_t slot_offset = 0;
+};
+
+struct paged_layer {
+    std::vector<paged_tensor> tensors;
+    size_t bytes = 0;          // slot space the layer takes
+    int slot = -1;             // -1 = reading from the mapping
+};
+
+struct pager_slot {
+    uint8_t* data = nullptr;
+    int layer = -1;
+    uint64_t last_use = 0;
+    bool filling = false;      // the read-ahead thread owns it
+};
+
+struct bitnet_pager {
+    int fd = -1;
+    std::vector<paged_layer> layers;
+    std::vector<pager_slot> slots;
+    std::unordered_map<const ggml_tensor*, int> layer_of;  // weight -> layer
+    uint64_t clock = 0;
+    int current = -1;          // layer whose ops are running
+    bool asked = false;        // the pager asked for the node being computed
+    bool profile_asked = false;
+
+    // Read-ahead thread, one job at a time
+    std::thread worker;
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool queued = false;
+    bool stop = false;
+    int job_layer = -1;        // layer being read ahead, -1 = idle
+    int job_slot = -1;
+    bool job_ok = false;
+
+    bitnet_pager_stats stats;
+};
+
+std::unique_ptr<bitnet_pager> g_pager;
+bitnet_pager_stats g_no_stats;
+
+size_t align_up(size_t n, size_t alignment) {
+    return (n + alignment - 1) / alignment * alignment;
+}
+
+#ifndef __EMSCRIPTEN__
+
+bool read_layer(const bitnet_pager& p, int il, int slot) {
+    uint8_t* base = p.slots[slot].data;
+    for (const paged_tensor& pt : p.layers[il].tensors) {
+        size_t done = 0;
+        while (done < pt.nbytes) {
+            const ssize_t n = pread(p.fd, base + pt.slot_offset + done, pt.nbytes - done,
+                                    static_cast<off_t>(pt.file_offset + done));
+            if (n <= 0) {
+                return false;
+            }
+            done += static_cast<size_t>(n);
+        }
+    }
+    return true;
+}
+
+// Drop the mapping's pages under [addr, addr + n); they fault back in from
+// the file if anything reads them
+void release_pages(void* addr, size_t n) {
+    const uintptr_t page = static_cast<uintptr_t>(sysconf(_SC_PAGESIZE));
+    const uintptr_t begin = (reinterpret_cast<uintptr_t>(addr) + page - 1) / page * page;
+    const uintptr_t end = (reinterpret_cast<uintptr_t>(addr) + n) / page * page;
+    if (end > begin) {
+        madvise(reinterpret_cast<void*>(begin), end - begin, MADV_DONTNEED);
+    }
+}
+
+void worker_main(bitnet_pager* p) {
+    std::unique_lock<std::mutex> lock(p->mutex);
+    for (;;) {
+        p->cv.wait(lock, [p] { return p->stop || p->queued; });
+        if (p->stop) {
+            return;
+        }
+        p->queued = false;
+        const int il = p->job_layer;
+        const int slot = p->job_slot;
+        lock.unlock();
+        const bool ok = read_layer(*p, il, slot);
+        lock.lock();
+        p->job_ok = ok;
+        p->job_layer = -1;
+        p->cv.notify_all();
+    }
+}
+
+#endif
+
+void point_at_slot(bitnet_pager& p, int il, int slot) {
+    paged_layer& layer = p.layers[il];
+    for (paged_tensor& pt : layer.tensors) {
+        pt.tensor->data = p.slots[slot].data + pt.slot_offset;
+    }
+    layer.slot = slot;
+    p.slots[slot].layer = il;
+    p.stats.loads++;
+    p.stats.bytes_read += layer.bytes;
+}
+
+void evict(bitnet_pager& p, int slot) {
+    const int il = p.slots[slot].layer;
+    if (il >= 0) {
+        for (paged_tensor& pt : p.layers[il].tensors) {
+            pt.tensor->data = pt.home;
+        }
+        p.layers[il].slot = -1;
+    }
+    p.slots[slot].layer = -1;
+}
+
+// Least recently used slot that is neither being filled nor holding the
+// current layer
+int pick_victim(const bitnet_pager& p) {
+    int victim = -1;
+    for (int s = 0; s < static_cast<int>(p.slots.size()); ++s) {
+        const pager_slot& slot = p.slots[s];
+        if (slot.filling || (slot.layer >= 0 && slot.layer == p.current)) {
+            continue;
+        }
+        if (victim < 0 || slot.last_use < p.slots[victim].last_use) {
+            victim = s;
+        }
+    }
+    return victim;
+}
+
+// Wait for the read-ahead in flight, if any, and publish its slot
+void finish_read_ahead(bitnet_pager& p) {
+    int slot = -1;
+    for (int s = 0; s < static_cast<int>(p.slots.size()); ++s) {
+        if (p.slots[s].filling) {
+            slot = s;
+        }
+    }
+    if (slot < 0) {
+        return;
+    }
+
+    const int64_t t_start_us = ggml_time_us();
+    bool ok = false;
+    {
+        std::unique_lock<std::mutex> lock(p.mutex);
+        p.cv.wait(lock, [&p] { return p.job_layer < 0 && !p.queued; });
+        ok = p.job_ok;
+    }
+    p.stats.wait_ms += (ggml_time_us() - t_start_us) / 1000.0;
+
+    pager_slot& s = p.slots[slot];
+    const int il = s.layer;
+    s.filling = false;
+    if (ok) {
+        point_at_slot(p, il, slot);
+        p.stats.prefetch_hits++;
+    } else {
+        BITNET_LOG_WARN("⚠️ [bitnet_pager] Read-ahead of layer " << il << " failed");
+        p.layers[il].slot = -1;
+        s.layer = -1;
+    }
+}
+
+// Make layer il resident before its first op runs
+void ensure(bitnet_pager& p, int il) {
+    paged_layer& layer = p.layers[il];
+    if (layer.slot >= 0 && p.slots[layer.slot].filling) {
+        finish_read_ahead(p);
+    }
+    if (layer.slot < 0) {
+        // Not read ahead: a read in flight may hold the only free slot
+        finish_read_ahead(p);
+        const int slot = pick_victim(p);
+        const int64_t t_start_us = ggml_time_us();
+        bool ok = false;
+#ifndef __EMSCRIPTEN__
+        if (slot >= 0) {
+            evict(p, slot);
+            ok = read_layer(p, il, slot);
+        }
+#endif
+        p.stats.wait_ms += (ggml_time_us() - t_start_us) / 1000.0;
+        if (!ok) {
+            // The tensors keep reading their homes (the mapping, or memory
+            // that was never released): slower, still correct
+            BITNET_LOG_ERROR("[bitnet_pager] Failed to read layer " << il);
+            p.current = il;
+            return;
+        }
+        point_at_slot(p, il, slot);
+    }
+    p.slots[layer.slot].last_use = ++p.clock;
+    p.current = il;
+}
+
+// Start reading layer il in the background if it is not resident
+void read_ahead(bitnet_pager& p, int il) {
+    if (p.layers[il].slot >= 0 || p.layers[il].tensors.empty()) {
+        return;
+    }
+    for (const pager_slot& slot : p.slots) {
+        if (slot.filling) {
+            return;
+        }
+    }
+    const int slot = pick_victim(p);
+    if (slot < 0) {
+        return;
+    }
+    evict(p, slot);
+    p.slots[slot].layer = il;
+    p.slots[slot].filling = true;
+    p.layers[il].slot = slot;
+
+    std::lock_guard<std::mutex> lock(p.mutex);
+    p.job_layer = il;
+    p.job_slot = slot;
+    p.queued = true;
+    p.cv.notify_all();
+}
+
+} // namespace
+
+bool bitnet_pager_init(llama_model* model, const char* path, const BitNetModel& info, int n_slots) {
+    bitnet_pager_free();
+#ifdef __EMSCRIPTEN__
+    (void) model; (void) path; (void) info; (void) n_slots;
+    BITNET_LOG_WARN("⚠️ [bitnet_pager] Paging needs a mapped model file and is not available in the WASM build");
+    return false;
+#else
+    std::unique_ptr<bitnet_pager> p(new bitnet_pager());
+    const int n_layer = llama_n_layer(model);
+    p->layers.resize(n_layer);
+
+    // A mapped tensor sits at the mapping's base plus its file offset. A
+    // tensor the loader placed anywhere else lives in ordinary memory that
+    // must never be released, so find the base the most tensors agree on and
+    // trust only pointers that match it
+    std::unordered_map<uintptr_t, int> base_votes;
+    uintptr_t map_base = 0;
+    int map_votes = 0;
+    for (const gguf_tensor_info& ti : info.tensors) {
+        const ggml_tensor* t = llama_get_model_tensor(model, ti.name.c_str());
+        if (!t || !t->data) {
+            continue;
+        }
+        const uintptr_t base = reinterpret_cast<uintptr_t>(t->data) - (info.data_offset + ti.offset);
+        const int votes = ++base_votes[base];
+        if (votes > map_votes) {
+            map_base = base;
+            map_votes = votes;
+        }
+    }
+    // mmap returns page-aligned addresses; anything else is not a mapping
+    if (map_base % static_cast<uintptr_t>(sysconf(_SC_PAGESIZE)) != 0) {
+        map_base = 0;
+    }
+
+    uint64_t paged_bytes = 0;
+    size_t n_unmapped = 0;
+    uint64_t unmapped_bytes = 0;
+    for (const gguf_tensor_info& ti : info.tensors) {
+        int il = -1;
+        if (std::sscanf(ti.name.c_str(), "blk.%d.", &il) != 1 || il < 0 || il >= n_layer) {
+            continue;
+        }
+        ggml_tensor* t = llama_get_model_tensor(model, ti.name.c_str());
+        if (!t || !t->data) {
+            continue;
+        }
+        paged_layer& layer = p->layers[il];
+        paged_tensor pt;
+        pt.tensor = t;
+        pt.home = t->data;
+        pt.file_offset = info.data_offset + ti.offset;
+        pt.nbytes = ggml_nbytes(t);
+        pt.mapped = map_base != 0 && reinterpret_cast<uintptr_t>(t->data) == map_base + pt.file_offset;
+        if (!pt.mapped) {
+            n_unmapped++;
+            unmapped_bytes += pt.nbytes;
+        }
+        pt.slot_offset = layer.bytes;
+        layer.bytes += align_up(pt.nbytes, BITNET_PAGER_ALIGNMENT);
+        layer.tensors.push_back(pt);
+        p->layer_of[t] = il;
+        paged_bytes += pt.nbytes;
+    }
+
+    size_t slot_bytes = 0;
+    for (const paged_layer& layer : p->layers) {
+        slot_bytes = std::max(slot_bytes, layer.bytes);
+    }
+    if (slot_bytes == 0) {
+        BITNET_LOG_WARN("⚠️ [bitnet_pager] Model has no per-layer tensors to page");
+        return false;
+    }
+
+    p->fd = open(path, O_RDONLY);
+    if (p->fd < 0) {
+        BITNET_LOG_ERROR("[bitnet_pager] Failed to open " << path);
+        return false;
+    }
+
+    n_slots = std::min(std::max(2, n_slots), n_layer);
+    p->slots.resize(n_slots);
+    for (pager_slot& slot : p->slots) {
+        void* data = nullptr;
+        if (posix_memalign(&data, BITNET_PAGER_ALIGNMENT, slot_bytes) != 0) {
+            BITNET_LOG_ERROR("[bitnet_pager] Failed to allocate " << n_slots << " slots of " << slot_bytes << " bytes");
+            for (pager_slot& s : p->slots) {
+                std::free(s.data);
+            }
+            close(p->fd);
+            return false;
+        }
+        slot.data = static_cast<uint8_t*>(data);
+    }
+
+    // Loading touched the mapping; from here on it is only a fallback.
+    // Tensors living elsewhere keep their memory, which stays their fallback.
+    for (const paged_layer& layer : p->layers) {
+        for (const paged_tensor& pt : layer.tensors) {
+            if (pt.mapped) {
+                release_pages(pt.home, pt.nbytes);
+            }
+        }
+    }
+    if (n_unmapped > 0) {
+        BITNET_LOG_WARN("⚠️ [bitnet_pager] " << n_unmapped << " layer tensors are not in the file mapping"
+                        << "; their loaded copies stay resident");
+    }
+
+    bitnet_pager_stats& stats = p->stats;
+    stats.n_layers = n_layer;
+    stats.n_slots = n_slots;
+    stats.slot_bytes = slot_bytes;
+    stats.resident_bytes = static_cast<uint64_t>(n_slots) * slot_bytes + (llama_model_size(model) - paged_bytes) +
+                           unmapped_bytes;
+
+    p->worker = std::thread(worker_main, p.get());
+    g_pager = std::move(p);
+
+    BITNET_LOG_INFO("[bitnet_pager] Paging " << n_layer << " layers (" << (paged_bytes >> 20) << " MiB) through "
+                    << n_slots << " slots of " << (slot_bytes >> 20) << " MiB; resident weights "
+                    << (stats.resident_bytes >> 20) << " MiB");
+    return true;
+#endif
+}
+
+void bitnet_pager_free() {
+    if (!g_pager) {
+        return;
+    }
+    bitnet_pager& p = *g_pager;
+    {
+        std::lock_guard<std::mutex> lock(p.mutex);
+        p.stop = true;
+        p.cv.notify_all();
+    }
+    if (p.worker.joinable()) {
+        p.worker.join();
+    }
+    for (paged_layer& layer : p.layers) {
+        for (paged_tensor& pt : layer.tensors) {
+            pt.tensor->data = pt.home;
+        }
+    }
+    for (pager_slot& slot : p.slots) {
+        std::free(slot.data);
+    }
+#ifndef __EMSCRIPTEN__
+    if (p.fd >= 0) {
+        close(p.fd);
+    }
+#endif
+    g_pager.reset();
+}
+
+bool bitnet_pager_active() {
+    return g_pager != nullptr;
+}
+
+const bitnet_pager_stats& bitnet_pager_get_stats() {
+    return g_pager ? g_pager->stats : g_no_stats;
+}
+
+bool bitnet_pager_eval(struct ggml_tensor* t, bool ask, void* user_data) {
+    if (!g_pager) {
+        return bitnet_profile_eval(t, ask, user_data);
+    }
+    bitnet_pager& p = *g_pager;
+
+    if (ask) {
+        bool want = false;
+        for (int i = 0; i < GGML_MAX_SRC; ++i) {
+            const ggml_tensor* src = t->src[i];
+            if (!src) {
+                continue;
+            }
+            auto it = p.layer_of.find(src->view_src ? src->view_src : src);
+            if (it != p.layer_of.end() && it->second != p.current) {
+                ensure(p, it->second);
+                want = true;
+            }
+        }
+        p.asked = want;
+        p.profile_asked = bitnet_profile_eval(t, true, user_data);
+        return want || p.profile_asked;
+    }
+
+    if (p.asked) {
+        // The previous layer has finished; read the next one (layer 0 of the
+        // next graph after the last) while this one computes
+        p.asked = false;
+        if (p.current >= 0) {
+            read_ahead(p, (p.current + 1) % static_cast<int>(p.layers.size()));
+        }
+    }
+    return p.profile_asked ? bitnet_profile_eval(t, false, user_data) : true;
+}
@@ -0,0 +1,44 @@
+#pragma once
+// On-demand paging of per-layer weights, for models larger than the memory
+// we want resident. Every "blk.N.*" tensor is served from a small LRU pool
+// of 64-byte aligned slots, one layer per slot. The eval callback reads a
+// layer from the model file into a slot just before its first op runs, and
+// a background thread reads the next layer while the current one computes.
+// Tensors of layers outside the pool point back at the loader's file
+// mapping, whose pages are released, so the resident weights are the pool
+// plus the non-layer tensors (embeddings, output) whatever the model size.
+// Layer tensors found outside the mapping are paged too, but their loaded
+// copies stay resident: that memory is not backed by the file.
+//
+// The loader has to map the file rather than copy it for this to save any
+// memory, so paging is only available in native builds; llama.cpp's wasm
+// loader copies every weight into the heap.
+
+#include <cstdint>
+
+#include "llama.h"
+#include "bitnet_wasm.h"
+
+struct bitnet_pager_stats {
+    int n_layers = 0;             // layers with paged tensors
+    int n_slots = 0;
+    uint64_t slot_bytes = 0;
+    uint64_t resident_bytes = 0;  // pool plus the non-layer tensors
+    uint64_t loads = 0;           // layers read into the pool
+    uint64_t prefetch_hits = 0;   // loads read ahead of the layer's first op
+    uint64_t bytes_read = 0;
+    double wait_ms = 0.0;         // compute stalled on reads
+};
+
+// Page the layers of model, which must have been loaded with use_mmap from
+// path (tensor infos in info). n_slots layers (at least 2) stay resident.
+// Returns false, leaving the model as loaded, if paging is not possible.
+bool bitnet_pager_init(llama_model* model, const char* path, const BitNetModel& info, int n_slots);
+void bitnet_pager_free();
+bool bitnet_pager_active();
+const bitnet_pager_stats& bitnet_pager_get_stats();
+
+// Eval callback for contexts on the loaded model: pages a layer in ahead of
+// its first op, then hands the node to bitnet_profile_eval. A plain
+// pass-through to the profiler when paging is off.
+bool bitnet_pager_eval(struct ggml_tensor* t, bool ask, void* user_data);
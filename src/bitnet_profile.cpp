@@ -0,0 +1,164 @@
+// ggml graph profiler (see bitnet_profile.h)
+//
+// When profiling is on, the eval callback asks to observe every node, so the
+// scheduler computes the graph one node at a time and the time between the
+// "ask" and "done" callbacks is that node's compute time. This serializes the
+// graph and adds per-node overhead, so absolute numbers run a little high;
+// the split between ops and layers is what matters.
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "ggml.h"
+#include "bitnet_profile.h"
+
+#ifdef __EMSCRIPTEN__
+#include <emscripten.h>
+#else
+#define EMSCRIPTEN_KEEPALIVE
+#endif
+
+namespace {
+
+struct bitnet_profile_entry {
+    int64_t count = 0;
+    int64_t time_us = 0;
+    uint64_t bytes = 0;
+};
+
+struct bitnet_profile {
+    bool enabled = false;
+    int64_t n_tokens = 0;
+    int64_t t_ask_us = 0;
+    std::map<std::string, bitnet_profile_entry> ops;
+    std::vector<bitnet_profile_entry> layers;
+    bitnet_profile_entry other;  // nodes outside the repeating blocks (embeddings, output head)
+};
+
+bitnet_profile g_profile;
+
+// llama.cpp names per-layer nodes "<name>-<il>"
+int layer_of(const ggml_tensor* t) {
+    const char* dash = std::strrchr(t->name, '-');
+    if (!dash || dash[1] < '0' || dash[1] > '9') return -1;
+    return std::atoi(dash + 1);
+}
+
+// Matmuls are split by weight type so the ternary projections, attention
+// over the KV cache and the output head show up separately
+std::string op_key(const ggml_tensor* t) {
+    std::string key = ggml_op_desc(t);
+    if (t->op == GGML_OP_MUL_MAT && t->src[0]) {
+        key += "(";
+        key += ggml_type_name(t->src[0]->type);
+        key += ")";
+    }
+    return key;
+}
+
+uint64_t bytes_touched(const ggml_tensor* t) {
+    uint64_t bytes = ggml_nbytes(t);
+    for (int i = 0; i < GGML_MAX_SRC; ++i) {
+        if (t->src[i]) {
+            bytes += ggml_nbytes(t->src[i]);
+        }
+    }
+    return bytes;
+}
+
+void add(bitnet_profile_entry& e, int64_t time_us, uint64_t bytes) {
+    e.count++;
+    e.time_us += time_us;
+    e.bytes += bytes;
+}
+
+} // namespace
+
+bool bitnet_profile_eval(struct ggml_tensor* t, bool ask, void* user_data) {
+    (void) user_data;
+
+    if (ask) {
+        if (g_profile.enabled) {
+            g_profile.t_ask_us = ggml_time_us();
+        }
+        return g_profile.enabled;
+    }
+
+    const int64_t time_us = ggml_time_us() - g_profile.t_ask_us;
+    const uint64_t bytes = bytes_touched(t);
+
+    add(g_profile.ops[op_key(t)], time_us, bytes);
+
+    const int il = layer_of(t);
+    if (il >= 0) {
+        if (static_cast<size_t>(il) >= g_profile.layers.size()) {
+            g_profile.layers.resize(il + 1);
+        }
+        add(g_profile.layers[il], time_us, bytes);
+    } else {
+        add(g_profile.other, time_us, bytes);
+    }
+    return true;
+}
+
+void bitnet_profile_count_tokens(int n) {
+    if (g_profile.enabled) {
+        g_profile.n_tokens += n;
+    }
+}
+
+extern "C" {
+    // Start (1) or stop (0) profiling. Starting clears the previous profile.
+    __attribute__((visibility("default"))) EMSCRIPTEN_KEEPALIVE void bitnet_set_profiling(int enabled) {
+        if (enabled && !g_profile.enabled) {
+            g_profile = bitnet_profile();
+        }
+        g_profile.enabled = enabled != 0;
+    }
+
+    // Profile collected since profiling was enabled, as JSON: totals, ops
+    // sorted by time, and per-layer time. Valid until the next call.
+    __attribute__((visibility("default"))) EMSCRIPTEN_KEEPALIVE const char* bitnet_get_profile() {
+        static std::string report;
+        char buf[256];
+
+        std::vector<std::pair<std::string, bitnet_profile_entry>> ops(g_profile.ops.begin(), g_profile.ops.end());
+        std::sort(ops.begin(), ops.end(), [](const auto& a, const auto& b) { return a.second.time_us > b.second.time_us; });
+
+        int64_t total_us = 0;
+        for (const auto& op : ops) {
+            total_us += op.second.time_us;
+        }
+
+        snprintf(buf, sizeof(buf), "{\"enabled\":%s,\"tokens\":%lld,\"total_ms\":%.3f,\"ops\":[",
+                 g_profile.enabled ? "true" : "false", static_cast<long long>(g_profile.n_tokens), total_us / 1000.0);
+        report = buf;
+
+        for (size_t i = 0; i < ops.size(); ++i) {
+            const bitnet_profile_entry& e = ops[i].second;
+            snprintf(buf, sizeof(buf), "%s{\"op\":\"%s\",\"count\":%lld,\"ms\":%.3f,\"bytes\":%llu}",
+                     i ? "," : "", ops[i].first.c_str(), static_cast<long long>(e.count), e.time_us / 1000.0,
+                     static_cast<unsigned long long>(e.bytes));
+            report += buf;
+        }
+
+        report += "],\"layers\":[";
+        for (size_t il = 0; il < g_profile.layers.size(); ++il) {
+            const bitnet_profile_entry& e = g_profile.layers[il];
+            snprintf(buf, sizeof(buf), "%s{\"layer\":%zu,\"ms\":%.3f,\"bytes\":%llu}",
+                     il ? "," : "", il, e.time_us / 1000.0, static_cast<unsigned long long>(e.bytes));
+            report += buf;
+        }
+
+        snprintf(buf, sizeof(buf), "],\"other\":{\"ms\":%.3f,\"bytes\":%llu}}",
+                 g_profile.other.time_us / 1000.0, static_cast<unsigned long long>(g_profile.other.bytes));
+        report += buf;
+
+        return report.c_str();
+    }
+}
@@ -0,0 +1,12 @@
+#pragma once
+// Per-op / per-layer profiler driven by the ggml scheduler's eval callback.
+// Contexts on the loaded model reach bitnet_profile_eval through their
+// cb_eval (bitnet_pager_eval); it is a no-op until profiling is enabled with
+// bitnet_set_profiling(1).
+
+struct ggml_tensor;
+
+bool bitnet_profile_eval(struct ggml_tensor* t, bool ask, void* user_data);
+
+// Credit n processed tokens to the current profile (no-op when disabled)
+void bitnet_profile_count_tokens(int n);
@@ -0,0 +1,520 @@
+// Fused token sampler (see bitnet_sampler.h)
+//
+// Each stage reproduces the float arithmetic of its llama-sampling.cpp
+// counterpart, so for the same seed the survivors, their probabilities and
+// the draws from the mt19937 match the common_sampler chain. Exact logit ties
+// at the top-k boundary may resolve to a different (equally likely) token.
+
+#include <algorithm>
+#include <cmath>
+#include <random>
+#include <sstream>
+#include <vector>
+
+#include "bitnet_sampler.h"
+#include "bitnet_log.h"
+
+#if defined(__wasm_simd128__)
+#include <wasm_simd128.h>
+#endif
+
+struct bitnet_sampler {
+    common_sampler* fallback = nullptr;
+
+    int n_vocab = 0;
+    llama_token eos = LLAMA_TOKEN_NULL;
+    llama_token nl = LLAMA_TOKEN_NULL;
+
+    int top_k = 0;
+    float top_p = 1.0f;
+    float min_p = 0.0f;
+    float temp = 1.0f;
+    size_t min_keep = 0;
+    bool use_top_p = false;
+    bool use_min_p = false;
+    bool use_temp = false;
+
+    int penalty_last_n = 0;
+    float penalty_repeat = 1.0f;
+    float penalty_freq = 0.0f;
+    float penalty_present = 0.0f;
+    bool penalize_nl = false;
+    bool ignore_eos = false;
+
+    uint32_t seed_param = 0;    // as configured; LLAMA_DEFAULT_SEED = fresh random seed per reset
+    uint32_t seed = 0;          // seed of the current RNG stream
+    std::mt19937 rng;
+
+    // Ring of the last penalty_last_n accepted tokens
+    std::vector<llama_token> prev;
+    size_t prev_head = 0;
+    size_t prev_count = 0;
+
+    // Per-call scratch, sized at init so sampling does not allocate
+    std::vector<llama_token> recent;
+    std::vector<llama_token_data> penalized;  // recent tokens with their penalized logits
+    std::vector<uint64_t> penalized_bits;     // membership bitmap for `penalized`
+    const uint64_t* allowed = nullptr;        // caller's token mask, nullptr = all
+    std::vector<llama_token_data> cand;       // top-k heap, then the sorted survivors
+    std::vector<float> probs;
+};
+
+namespace {
+
+uint32_t resolve_seed(uint32_t seed) {
+    if (seed == LLAMA_DEFAULT_SEED) {
+        std::random_device rd;
+        return rd();
+    }
+    return seed;
+}
+
+// Map params.samplers onto the fused stage order. Returns false when the
+// chain contains a stage the fused path does not implement, or runs the
+// supported ones in a different order.
+bool map_stages(const common_sampler_params& params, bitnet_sampler& smpl) {
+    bool use_top_k = false;
+    int last_rank = -1;
+    for (const common_sampler_type type : params.samplers) {
+        int rank = -1;
+        switch (type) {
+            case COMMON_SAMPLER_TYPE_TOP_K:       rank = 0; use_top_k = true;       break;
+            case COMMON_SAMPLER_TYPE_TOP_P:       rank = 1; smpl.use_top_p = true;  break;
+            case COMMON_SAMPLER_TYPE_MIN_P:       rank = 2; smpl.use_min_p = true;  break;
+            case COMMON_SAMPLER_TYPE_TEMPERATURE: rank = 3; smpl.use_temp = true;   break;
+            case COMMON_SAMPLER_TYPE_TFS_Z:
+                if (params.tfs_z >= 1.0f) continue;
+                return false;
+            case COMMON_SAMPLER_TYPE_TYPICAL_P:
+                if (params.typ_p >= 1.0f) continue;
+                return false;
+            default:
+                return false;
+        }
+        if (rank <= last_rank) {
+            return false;
+        }
+        last_rank = rank;
+    }
+    return use_top_k;
+}
+
+bool logit_greater(const llama_token_data& a, const llama_token_data& b) {
+    return a.logit > b.logit;
+}
+
+// llama_sampler_softmax_impl on already sorted candidates
+void softmax(std::vector<llama_token_data>& cand) {
+    const float max_l = cand[0].logit;
+    float cum_sum = 0.0f;
+    for (llama_token_data& c : cand) {
+        const float p = expf(c.logit - max_l);
+        c.p = p;
+        cum_sum += p;
+    }
+    for (llama_token_data& c : cand) {
+        c.p /= cum_sum;
+    }
+}
+
+// Build the sparse penalty set from the recent-token ring
+void collect_penalties(bitnet_sampler& smpl, const float* logits) {
+    smpl.penalized.clear();
+
+    if (smpl.ignore_eos && smpl.eos >= 0 && smpl.eos < smpl.n_vocab) {
+        smpl.penalized.push_back({smpl.eos, -INFINITY, 0.0f});
+    }
+
+    const bool active = smpl.penalty_last_n > 0 && smpl.prev_count > 0 &&
+                        (smpl.penalty_repeat != 1.0f || smpl.penalty_freq != 0.0f || smpl.penalty_present != 0.0f);
+    if (active) {
+        smpl.recent.clear();
+        for (size_t i = 0; i < smpl.prev_count; ++i) {
+            smpl.recent.push_back(smpl.prev[(smpl.prev_head + i) % smpl.prev.size()]);
+        }
+        std::sort(smpl.recent.begin(), smpl.recent.end());
+
+        for (size_t i = 0; i < smpl.recent.size();) {
+            const llama_token id = smpl.recent[i];
+            size_t j = i;
+            while (j < smpl.recent.size() && smpl.recent[j] == id) ++j;
+            const int count = static_cast<int>(j - i);
+            i = j;
+
+            if (id < 0 || id >= smpl.n_vocab || (id == smpl.nl && !smpl.penalize_nl) ||
+                (smpl.ignore_eos && id == smpl.eos)) {
+                continue;
+            }
+
+            // llama_sampler_penalties_impl
+            float logit = logits[id];
+            if (logit <= 0) {
+                logit *= smpl.penalty_repeat;
+            } else {
+                logit /= smpl.penalty_repeat;
+            }
+            logit -= float(count) * smpl.penalty_freq + float(count > 0) * smpl.penalty_present;
+            smpl.penalized.push_back({id, logit, 0.0f});
+        }
+    }
+
+    for (const llama_token_data& c : smpl.penalized) {
+        smpl.penalized_bits[c.id >> 6] |= uint64_t(1) << (c.id & 63);
+    }
+}
+
+// Offer one candidate to the top-k min-heap; returns the new admission threshold
+inline float heap_offer(std::vector<llama_token_data>& heap, size_t k, llama_token id, float logit) {
+    if (heap.size() < k) {
+        heap.push_back({id, logit, 0.0f});
+        std::push_heap(heap.begin(), heap.end(), logit_greater);
+    } else if (logit > heap.front().logit) {
+        std::pop_heap(heap.begin(), heap.end(), logit_greater);
+        heap.back() = {id, logit, 0.0f};
+        std::push_heap(heap.begin(), heap.end(), logit_greater);
+    }
+    return heap.size() < k ? -INFINITY : heap.front().logit;
+}
+
+// One pass over the raw logits keeping the k largest. Penalized tokens are
+// skipped here and offered afterwards with their adjusted logits. Most
+// logits fall below the threshold once the heap fills, so the pass is a
+// compare per element (four per instruction with SIMD128).
+void select_top_k(bitnet_sampler& smpl, const float* logits) {
+    std::vector<llama_token_data>& heap = smpl.cand;
+    const size_t k = static_cast<size_t>(std::min(smpl.top_k, smpl.n_vocab));
+    heap.clear();
+
+    const uint64_t* bits = smpl.penalized_bits.data();
+    float thresh = -INFINITY;
+    auto offer = [&](int id) {
+        const float logit = logits[id];
+        if (logit > thresh && !(bits[id >> 6] & (uint64_t(1) << (id & 63)))) {
+            thresh = heap_offer(heap, k, id, logit);
+        }
+    };
+
+    if (smpl.allowed) {
+        // Constrained: only the mask's tokens compete, one word at a time
+        // (a grammar state typically allows a small fraction of the vocab)
+        const int n_words = (smpl.n_vocab + 63) / 64;
+        for (int w = 0; w < n_words; ++w) {
+            for (uint64_t word = smpl.allowed[w]; word; word &= word - 1) {
+                const int id = w * 64 + __builtin_ctzll(word);
+                if (id < smpl.n_vocab) {
+                    offer(id);
+                }
+            }
+        }
+        for (const llama_token_data& c : smpl.penalized) {
+            if (smpl.allowed[c.id >> 6] & (uint64_t(1) << (c.id & 63))) {
+                heap_offer(heap, k, c.id, c.logit);
+            }
+            smpl.penalized_bits[c.id >> 6] = 0;
+        }
+        return;
+    }
+
+    int i = 0;
+#if defined(__wasm_simd128__)
+    for (; i + 16 <= smpl.n_vocab; i += 16) {
+        const v128_t t = wasm_f32x4_splat(thresh);
+        const v128_t gt = wasm_v128_or(
+            wasm_v128_or(wasm_f32x4_gt(wasm_v128_load(logits + i), t),
+                         wasm_f32x4_gt(wasm_v128_load(logits + i + 4), t)),
+            wasm_v128_or(wasm_f32x4_gt(wasm_v128_load(logits + i + 8), t),
+                         wasm_f32x4_gt(wasm_v128_load(logits + i + 12), t)));
+        if (!wasm_v128_any_true(gt)) {
+            continue;
+        }
+        for (int j = i; j < i + 16; ++j) {
+            offer(j);
+        }
+    }
+#endif
+    for (; i < smpl.n_vocab; ++i) {
+        offer(i);
+    }
+
+    for (const llama_token_data& c : smpl.penalized) {
+        heap_offer(heap, k, c.id, c.logit);
+        smpl.penalized_bits[c.id >> 6] = 0;
+    }
+}
+
+// Run every stage up to the final softmax, leaving the survivors in
+// smpl.cand sorted by logit with their probabilities. Returns false if no
+// candidate survives.
+bool build_dist(bitnet_sampler& smpl, const float* logits) {
+    collect_penalties(smpl, logits);
+    select_top_k(smpl, logits);
+
+    std::vector<llama_token_data>& cand = smpl.cand;
+    if (cand.empty()) {
+        return false;
+    }
+    std::sort(cand.begin(), cand.end(), logit_greater);
+
+    // llama_sampler_top_p_apply
+    if (smpl.use_top_p && smpl.top_p < 1.0f) {
+        softmax(cand);
+        float cum_sum = 0.0f;
+        size_t last_idx = cand.size();
+        for (size_t i = 0; i < cand.size(); ++i) {
+            cum_sum += cand[i].p;
+            if (cum_sum >= smpl.top_p && i + 1 >= smpl.min_keep) {
+                last_idx = i + 1;
+                break;
+            }
+        }
+        cand.resize(last_idx);
+    }
+
+    // llama_sampler_min_p_apply, sorted path
+    if (smpl.use_min_p && smpl.min_p > 0.0f) {
+        const float min_logit = cand[0].logit + logf(smpl.min_p);
+        size_t i = 1;
+        for (; i < cand.size(); ++i) {
+            if (cand[i].logit < min_logit && i >= smpl.min_keep) {
+                break;
+            }
+        }
+        cand.resize(i);
+    }
+
+    // llama_sampler_temp_impl
+    if (smpl.use_temp) {
+        if (smpl.temp <= 0.0f) {
+            cand.resize(1);
+        } else {
+            for (llama_token_data& c : cand) {
+                c.logit /= smpl.temp;
+            }
+        }
+    }
+
+    softmax(cand);
+    return true;
+}
+
+int draw(bitnet_sampler& smpl, const float* weights, size_t n) {
+    std::discrete_distribution<int> dist(weights, weights + n);
+    return dist(smpl.rng);
+}
+
+// llama_sampler_dist_apply
+llama_token sample_logits(bitnet_sampler& smpl, const float* logits) {
+    if (!build_dist(smpl, logits)) {
+        return LLAMA_TOKEN_NULL;
+    }
+    smpl.probs.clear();
+    for (const llama_token_data& c : smpl.cand) {
+        smpl.probs.push_back(c.p);
+    }
+    return smpl.cand[draw(smpl, smpl.probs.data(), smpl.probs.size())].id;
+}
+
+} // namespace
+
+bitnet_sampler* bitnet_sampler_init(const llama_model* model, const common_sampler_params& params) {
+    bitnet_sampler* smpl = new bitnet_sampler();
+    smpl->n_vocab = llama_n_vocab(model);
+
+    const bool fused = params.mirostat == 0 && params.grammar.empty() && params.logit_bias.empty() &&
+                       params.dynatemp_range <= 0.0f && params.top_k > 0 && map_stages(params, *smpl);
+    if (!fused) {
+        BITNET_LOG_INFO("[bitnet_sampler_init] Sampler configuration not fused, using common_sampler");
+        smpl->fallback = common_sampler_init(model, params);
+        if (!smpl->fallback) {
+            delete smpl;
+            return nullptr;
+        }
+        return smpl;
+    }
+
+    smpl->eos = llama_token_eos(model);
+    smpl->nl = llama_token_nl(model);
+    smpl->top_k = params.top_k;
+    smpl->top_p = params.top_p;
+    smpl->min_p = params.min_p;
+    smpl->temp = params.temp;
+    smpl->min_keep = static_cast<size_t>(std::max(0, params.min_keep));
+    smpl->penalty_last_n = std::max(0, params.penalty_last_n);
+    smpl->penalty_repeat = params.penalty_repeat;
+    smpl->penalty_freq = params.penalty_freq;
+    smpl->penalty_present = params.penalty_present;
+    smpl->penalize_nl = params.penalize_nl;
+    smpl->ignore_eos = params.ignore_eos;
+    smpl->seed_param = params.seed;
+    smpl->seed = resolve_seed(params.seed);
+    smpl->rng.seed(smpl->seed);
+
+    smpl->prev.resize(std::max(1, smpl->penalty_last_n));
+    smpl->recent.reserve(smpl->prev.size());
+    smpl->penalized.reserve(smpl->prev.size() + 1);
+    smpl->penalized_bits.assign(static_cast<size_t>(smpl->n_vocab) / 64 + 1, 0);
+    smpl->cand.reserve(static_cast<size_t>(std::min(smpl->top_k, smpl->n_vocab)));
+    smpl->probs.reserve(smpl->cand.capacity());
+    return smpl;
+}
+
+void bitnet_sampler_free(bitnet_sampler* smpl) {
+    if (!smpl) return;
+    if (smpl->fallback) {
+        common_sampler_free(smpl->fallback);
+    }
+    delete smpl;
+}
+
+bool bitnet_sampler_is_fused(const bitnet_sampler* smpl) {
+    return smpl->fallback == nullptr;
+}
+
+void bitnet_sampler_reset(bitnet_sampler* smpl) {
+    if (smpl->fallback) {
+        common_sampler_reset(smpl->fallback);
+        return;
+    }
+    smpl->prev_head = 0;
+    smpl->prev_count = 0;
+    // Like llama_sampler_dist_reset: a random seed is drawn again, so each
+    // generation gets its own stream rather than replaying the first one
+    smpl->seed = resolve_seed(smpl->seed_param);
+    smpl->rng.seed(smpl->seed);
+}
+
+void bitnet_sampler_accept(bitnet_sampler* smpl, llama_token token) {
+    if (smpl->fallback) {
+        common_sampler_accept(smpl->fallback, token, true);
+        return;
+    }
+    if (smpl->penalty_last_n == 0) {
+        return;
+    }
+    const size_t capacity = smpl->prev.size();
+    if (smpl->prev_count < capacity) {
+        smpl->prev[(smpl->prev_head + smpl->prev_count) % capacity] = token;
+        smpl->prev_count++;
+    } else {
+        smpl->prev[smpl->prev_head] = token;
+        smpl->prev_head = (smpl->prev_head + 1) % capacity;
+    }
+}
+
+std::string bitnet_sampler_get_rng(const bitnet_sampler* smpl) {
+    if (smpl->fallback) {
+        return std::string();
+    }
+    std::ostringstream out;
+    out << smpl->rng;
+    return out.str();
+}
+
+bool bitnet_sampler_set_rng(bitnet_sampler* smpl, const std::string& state) {
+    if (smpl->fallback) {
+        return state.empty();
+    }
+    std::istringstream in(state);
+    std::mt19937 rng;
+    if (!(in >> rng)) {
+        return false;
+    }
+    smpl->rng = rng;
+    return true;
+}
+
+llama_token bitnet_sampler_sample(bitnet_sampler* smpl, llama_context* ctx, int idx) {
+    if (smpl->fallback) {
+        if (smpl->allowed) {
+            // The chain reads the context's logits, so mask them in place
+            float* logits = llama_get_logits_ith(ctx, idx);
+            for (int id = 0; id < smpl->n_vocab; ++id) {
+                if (!(smpl->allowed[id >> 6] & (uint64_t(1) << (id & 63)))) {
+                    logits[id] = -INFINITY;
+                }
+            }
+        }
+        return common_sampler_sample(smpl->fallback, ctx, idx);
+    }
+    return sample_logits(*smpl, llama_get_logits_ith(ctx, idx));
+}
+
+void bitnet_sampler_set_allowed(bitnet_sampler* smpl, const uint64_t* allowed) {
+    smpl->allowed = allowed;
+}
+
+const llama_token_data* bitnet_sampler_dist(bitnet_sampler* smpl, const float* logits, size_t* n) {
+    if (smpl->fallback || !build_dist(*smpl, logits)) {
+        *n = 0;
+        return nullptr;
+    }
+    *n = smpl->cand.size();
+    return smpl->cand.data();
+}
+
+int bitnet_sampler_draw(bitnet_sampler* smpl, const float* weights, size_t n) {
+    return draw(*smpl, weights, n);
+}
+
+float bitnet_sampler_uniform(bitnet_sampler* smpl) {
+    return std::uniform_real_distribution<float>(0.0f, 1.0f)(smpl->rng);
+}
+
+int bitnet_sampler_verify(const llama_model* model, const common_sampler_params& params, int n_steps) {
+    common_sampler_params test_params = params;
+    test_params.seed = 1234;
+
+    bitnet_sampler* fused = bitnet_sampler_init(model, test_params);
+    if (!fused || fused->fallback) {
+        bitnet_sampler_free(fused);
+        return 0;
+    }
+
+    // Same stages common_sampler_init adds for this configuration
+    llama_sampler* chain = llama_sampler_chain_init(llama_sampler_chain_default_params());
+    llama_sampler_chain_add(chain, llama_sampler_init_penalties(
+        fused->n_vocab, fused->eos, fused->nl, test_params.penalty_last_n, test_params.penalty_repeat,
+        test_params.penalty_freq, test_params.penalty_present, test_params.penalize_nl, test_params.ignore_eos));
+    llama_sampler_chain_add(chain, llama_sampler_init_top_k(test_params.top_k));
+    if (fused->use_top_p) llama_sampler_chain_add(chain, llama_sampler_init_top_p(test_params.top_p, test_params.min_keep));
+    if (fused->use_min_p) llama_sampler_chain_add(chain, llama_sampler_init_min_p(test_params.min_p, test_params.min_keep));
+    if (fused->use_temp)  llama_sampler_chain_add(chain, llama_sampler_init_temp(test_params.temp));
+    llama_sampler_chain_add(chain, llama_sampler_init_dist(test_params.seed));
+
+    std::mt19937 rng(42);
+    std::normal_distribution<float> normal(0.0f, 3.0f);
+    std::vector<float> logits(fused->n_vocab);
+    std::vector<llama_token_data> cur(fused->n_vocab);
+
+    int mismatches = 0;
+    llama_token last = LLAMA_TOKEN_NULL;
+    for (int step = 0; step < n_steps; ++step) {
+        for (float& l : logits) {
+            l = normal(rng);
+        }
+        // Keep recently sampled tokens competitive so the penalties matter
+        if (last >= 0) {
+            logits[last] += 6.0f;
+        }
+
+        for (int id = 0; id < fused->n_vocab; ++id) {
+            cur[id] = {id, logits[id], 0.0f};
+        }
+        llama_token_data_array cur_p = {cur.data(), cur.size(), -1, false};
+        llama_sampler_apply(chain, &cur_p);
+        const llama_token expected = cur_p.data[cur_p.selected].id;
+        const llama_token actual = sample_logits(*fused, logits.data());
+        if (actual != expected) {
+            mismatches++;
+        }
+
+        // Both histories follow the reference so one mismatch does not cascade
+        llama_sampler_accept(chain, expected);
+        bitnet_sampler_accept(fused, expected);
+        last = expected;
+    }
+
+    llama_sampler_free(chain);
+    bitnet_sampler_free(fused);
+    return mismatches;
+}
@@ -0,0 +1,58 @@
+#pragma once
+// Fused token sampler for large vocabularies.
+//
+// Produces the same distribution as the common_sampler chain for the same
+// seed (penalties -> top_k -> top_p -> min_p -> temperature -> dist), but
+// never materializes or sorts a full-vocab candidate array: penalties touch
+// only the recent-token set, one thresholded pass over the logits selects the
+// top-k survivors, and the softmax runs over those alone. Configurations the
+// fused path does not cover (mirostat, grammar, logit bias, tail-free,
+// typical, dynamic temperature, custom sampler order, top_k <= 0) fall back to
+// a wrapped common_sampler.
+
+#include <string>
+
+#include "llama.h"
+#include "sampling.h"
+
+struct bitnet_sampler;
+
+bitnet_sampler* bitnet_sampler_init(const llama_model* model, const common_sampler_params& params);
+void bitnet_sampler_free(bitnet_sampler* smpl);
+bool bitnet_sampler_is_fused(const bitnet_sampler* smpl);
+
+// Clear the penalty history and reseed, like common_sampler_reset: the
+// configured seed again, or a fresh random one for LLAMA_DEFAULT_SEED
+void bitnet_sampler_reset(bitnet_sampler* smpl);
+void bitnet_sampler_accept(bitnet_sampler* smpl, llama_token token);
+
+// The RNG's full state in std::mt19937's text form, for session snapshots: a
+// restored sampler continues the saved stream exactly. Empty for the
+// common_sampler fallback, whose RNG sits inside llama.cpp out of reach; it
+// keeps the stream its reset drew. set returns false for a malformed state.
+std::string bitnet_sampler_get_rng(const bitnet_sampler* smpl);
+bool bitnet_sampler_set_rng(bitnet_sampler* smpl, const std::string& state);
+
+// Sample from the logits of batch row idx (-1 for the last row)
+llama_token bitnet_sampler_sample(bitnet_sampler* smpl, llama_context* ctx, int idx);
+
+// Restrict sampling to the tokens set in `allowed` (one bit per token id,
+// e.g. a grammar state's mask), or lift the restriction with nullptr. The
+// bitset is read, not copied, and must outlive the samples it applies to.
+void bitnet_sampler_set_allowed(bitnet_sampler* smpl, const uint64_t* allowed);
+
+// Distribution the next token would be drawn from: the surviving candidates
+// sorted by logit, with probabilities. Valid until the next call on smpl.
+// Returns nullptr for the common_sampler fallback.
+const llama_token_data* bitnet_sampler_dist(bitnet_sampler* smpl, const float* logits, size_t* n);
+
+// Draws from the sampler's RNG: an index into `weights` with probability
+// proportional to its weight, and a uniform float in [0, 1)
+int bitnet_sampler_draw(bitnet_sampler* smpl, const float* weights, size_t n);
+float bitnet_sampler_uniform(bitnet_sampler* smpl);
+
+// Run the fused sampler and a reference llama_sampler chain built like
+// common_sampler_init side by side over n_steps of random logits with the
+// same fixed seed. Returns the number of steps where they picked different
+// tokens (0 when the fused path is not in use).
+int bitnet_sampler_verify(const llama_model* model, const common_sampler_params& params, int n_steps);
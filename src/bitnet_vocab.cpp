@@ -0,0 +1,121 @@
+// Vocabulary piece table (see bitnet_vocab.h)
+
+#include <algorithm>
+#include <vector>
+
+#include "bitnet_vocab.h"
+#include "bitnet_log.h"
+
+#ifdef __EMSCRIPTEN__
+#include <emscripten.h>
+#else
+#define EMSCRIPTEN_KEEPALIVE
+#endif
+
+namespace {
+
+std::vector<char> g_vocab_blob;
+std::vector<uint32_t> g_vocab_offsets;  // n_vocab + 1 entries
+
+} // namespace
+
+bool bitnet_vocab_build(const llama_model* model) {
+    bitnet_vocab_release();
+
+    const int n_vocab = llama_n_vocab(model);
+    if (n_vocab <= 0) {
+        return false;
+    }
+
+    g_vocab_offsets.resize(static_cast<size_t>(n_vocab) + 1);
+    g_vocab_blob.reserve(static_cast<size_t>(n_vocab) * 8);
+
+    std::vector<char> piece(256);
+    for (int id = 0; id < n_vocab; ++id) {
+        g_vocab_offsets[id] = static_cast<uint32_t>(g_vocab_blob.size());
+
+        int n_piece = llama_token_to_piece(model, id, piece.data(), static_cast<int32_t>(piece.size()), 0, true);
+        if (n_piece < 0) {
+            // Negative return is the required size
+            piece.resize(-n_piece);
+            n_piece = llama_token_to_piece(model, id, piece.data(), static_cast<int32_t>(piece.size()), 0, true);
+        }
+        if (n_piece > 0) {
+            g_vocab_blob.insert(g_vocab_blob.end(), piece.data(), piece.data() + n_piece);
+        }
+    }
+    g_vocab_offsets[n_vocab] = static_cast<uint32_t>(g_vocab_blob.size());
+    g_vocab_blob.shrink_to_fit();
+
+    BITNET_LOG_INFO("[bitnet_vocab_build] " << n_vocab << " pieces, "
+                    << g_vocab_blob.size() / 1024 << " KiB");
+    return true;
+}
+
+void bitnet_vocab_release() {
+    std::vector<char>().swap(g_vocab_blob);
+    std::vector<uint32_t>().swap(g_vocab_offsets);
+}
+
+const char* bitnet_vocab_piece(llama_token token, size_t* len) {
+    if (token < 0 || static_cast<size_t>(token) + 1 >= g_vocab_offsets.size()) {
+        *len = 0;
+        return "";
+    }
+    const uint32_t begin = g_vocab_offsets[token];
+    *len = g_vocab_offsets[token + 1] - begin;
+    return g_vocab_blob.data() + begin;
+}
+
+size_t bitnet_utf8_complete_prefix(const char* s, size_t n) {
+    // A sequence is at most 4 bytes, so only the last 3 can start an
+    // unfinished one
+    const size_t lookback = std::min<size_t>(n, 3);
+    for (size_t i = 1; i <= lookback; ++i) {
+        const unsigned char c = static_cast<unsigned char>(s[n - i]);
+        if ((c & 0xC0) == 0x80) {
+            continue;  // continuation byte, keep looking for the lead
+        }
+        size_t expected = 1;
+        if ((c & 0xE0) == 0xC0) expected = 2;
+        else if ((c & 0xF0) == 0xE0) expected = 3;
+        else if ((c & 0xF8) == 0xF0) expected = 4;
+        return expected > i ? n - i : n;
+    }
+    return n;
+}
+
+extern "C" {
+    // Start of the piece blob in linear memory (valid until the model is freed)
+    __attribute__((visibility("default"))) EMSCRIPTEN_KEEPALIVE const char* bitnet_vocab_blob() {
+        return g_vocab_blob.data();
+    }
+
+    // n_vocab + 1 uint32 offsets into the blob
+    __attribute__((visibility("default"))) EMSCRIPTEN_KEEPALIVE const uint32_t* bitnet_vocab_offsets() {
+        return g_vocab_offsets.data();
+    }
+
+    __attribute__((visibility("default"))) EMSCRIPTEN_KEEPALIVE int bitnet_vocab_n_tokens() {
+        return g_vocab_offsets.empty() ? 0 : static_cast<int>(g_vocab_offsets.size() - 1);
+    }
+
+    // Concatenate the pieces of n tokens into out (NUL-terminated, truncated
+    // to max_len - 1 bytes) and return the number of bytes written
+    __attribute__((visibility("default"))) EMSCRIPTEN_KEEPALIVE int bitnet_detokenize(const llama_token* tokens, int n_tokens, char* out, int max_len) {
+        if (!out || max_len <= 0) {
+            return 0;
+        }
+        size_t n_out = 0;
+        const size_t cap = static_cast<size_t>(max_len) - 1;
+        for (int i = 0; i < n_tokens && n_out < cap; ++i) {
+            size_t len = 0;
+            const char* piece = bitnet_vocab_piece(tokens[i], &len);
+            len = std::min(len, cap - n_out);
+            std::copy(piece, piece + len, out + n_out);
+            n_out += len;
+        }
+        out[n_out] = '\0';
+        return static_cast<int>(n_out);
+    }
+}
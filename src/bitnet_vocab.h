@@ -0,0 +1,23 @@
+#pragma once
+// Load-time table of every token's text. All pieces live in one contiguous
+// blob; offsets[id] .. offsets[id + 1] is token id's UTF-8 bytes (special
+// tokens rendered). Built by bitnet_load_model_from_file, so detokenizing is
+// a lookup rather than a llama_token_to_piece call, and JS can read pieces
+// straight out of HEAPU8 via bitnet_vocab_blob / bitnet_vocab_offsets.
+
+#include <cstddef>
+#include <cstdint>
+
+#include "llama.h"
+
+bool bitnet_vocab_build(const llama_model* model);
+void bitnet_vocab_release();
+
+// Bytes of a token, or an empty piece for ids outside the table
+const char* bitnet_vocab_piece(llama_token token, size_t* len);
+
+// Length of the longest prefix of s that does not end inside a UTF-8
+// sequence. Streaming output emits that prefix and carries the rest over to
+// the next token. Malformed bytes count as complete so they are never held
+// back indefinitely.
+size_t bitnet_utf8_complete_prefix(const char* s, size_t n);
@@ -1,37 +1,23 @@
+#include <algorithm>
+#include <atomic>
+#include <cmath>
 #include <iostream>
 #include <fstream>
 #include <vector>
 #include <string>
 #include <memory>
+#include <random>
+#include <thread>
 #include <cstdio>
 #include <cstring>
+#include <unistd.h>
 
 #ifdef __EMSCRIPTEN__
 #include <emscripten.h>
 #include <emscripten/bind.h>
-
-// WASM-specific memory alignment helpers for BitNet
-static void* aligned_malloc(size_t size, size_t alignment) {
-    // Ensure alignment is a power of 2
-    if ((alignment & (alignment - 1)) != 0) {
-        alignment = 16; // Default to 16-byte alignment
-    }
-    
-    void* ptr = malloc(size + alignment - 1);
-    if (!ptr) return nullptr;
-    
-    // Align the pointer
-    uintptr_t addr = (uintptr_t)ptr;
-    uintptr_t aligned_addr = (addr + alignment - 1) & ~(alignment - 1);
-    
-    return (void*)aligned_addr;
-}
-
-static void aligned_free(void* ptr) {
-    if (ptr) {
-        free(ptr);
-    }
-}
+#else
+// Native builds (src/bench) link the same exports as plain functions
+#define EMSCRIPTEN_KEEPALIVE
 #endif
 
 // Use the real BitNet and llama.cpp headers from 3rdparty
@@ -40,21 +26,969 @@ static void aligned_free(void* ptr) {
 #include "sampling.h"
 #include "ggml-bitnet.h"
 #include "bitnet_wasm.h"
+#include "bitnet_log.h"
+#include "bitnet_profile.h"
+#include "bitnet_vocab.h"
+#include "bitnet_sampler.h"
+#include "bitnet_draft.h"
+#include "bitnet_memplan.h"
+#include "bitnet_embed.h"
+#include "bitnet_grammar.h"
+#include "bitnet_pager.h"
+#include "bitnet_cache.h"
+
+// i2_s dot product (ggml-bitnet-mad-wasm.cpp) and its scalar reference
+extern "C" void ggml_vec_dot_i2_i8_s(int n, float* s, size_t bs, const void* vx, size_t bx, const void* vy, size_t by, int nrc);
+extern "C" void ggml_vec_dot_i2_i8_s_ref(int n, float* s, size_t bs, const void* vx, size_t bx, const void* vy, size_t by, int nrc);
 
 // Global state using real llama.cpp structures
 static struct common_init_result g_init_result = {};
-static struct common_sampler* g_sampler = nullptr;
+static bitnet_sampler* g_sampler = nullptr;
+static common_sampler_params g_sampler_params;  // configuration g_sampler and the slots were built with
 static bool g_initialized = false;
 
 // BitNet debug counter
 static int bitnet_ops_count = 0;
 
+// Settings that only take effect on the next model load
+struct bitnet_load_config {
+    int n_parallel = 0;  // concurrent sequences for the bitnet_seq_* API
+    int n_threads = 0;   // ggml compute threads, 0 = one per core
+    ggml_type type_k = GGML_TYPE_F16;  // KV cache types; a quantized V needs flash attention
+    ggml_type type_v = GGML_TYPE_F16;
+    uint64_t memory_budget = 0;        // bytes, 0 = bitnet_memory_default_budget()
+    uint32_t n_ctx_max = 0;            // 0 = the model's training context
+    int paging_slots = 0;              // layers kept resident when paging, 0 = no paging
+    std::string cache_path;            // where bitnet_write_model_cache writes, empty = no cache export
+};
+
+static bitnet_load_config g_load_config;
+
+// How the current context was sized, reported by bitnet_get_memory_plan
+static bitnet_memory_plan g_memory_plan;
+
+// The current model came from a preprocessed cache file
+static bool g_model_from_cache = false;
+
+// Thread count actually used for a request of n_threads (0 = auto). The
+// single-threaded WASM build always runs on the calling thread; the pthread
+// build is capped by its worker pool, since spawning more workers would have
+// to yield to the JS event loop while ggml is blocked waiting for them.
+static int bitnet_resolve_n_threads(int n_threads) {
+#if defined(__EMSCRIPTEN__) && !defined(__EMSCRIPTEN_PTHREADS__)
+    (void) n_threads;
+    return 1;
+#else
+    if (n_threads <= 0) {
+        n_threads = static_cast<int>(std::thread::hardware_concurrency());
+    }
+#ifdef BITNET_PTHREAD_POOL_SIZE
+    n_threads = std::min(n_threads, BITNET_PTHREAD_POOL_SIZE + 1);
+#endif
+    return std::max(1, n_threads);
+#endif
+}
+
+// Incremental model ingestion (bitnet_load_begin / feed / end). Chunks are
+// appended to a MEMFS file as they arrive; only the GGUF header is buffered,
+// and only until it parses. The file is a full copy of the model: llama.cpp
+// can only load from a file, so until bitnet_load_end has read it into the
+// tensor buffers and removed it, memory peaks at about twice the model size.
+// Placing tensor bytes into their final buffers as they arrive would need a
+// loader of our own and is not done.
+struct bitnet_load_stream {
+    FILE* file = nullptr;
+    std::vector<uint8_t> header;
+    size_t parse_at = 0;           // buffered header size that triggers the next parse
+    bool header_ready = false;
+    size_t received = 0;
+    size_t expected = 0;
+    bitnet_file_hasher hasher;     // model hash, computed as the chunks pass
+};
+
+static const char* BITNET_STREAM_PATH = "/tmp/model-stream.gguf";
+static const size_t BITNET_MAX_HEADER_BYTES = 64 * 1024 * 1024;
+static bitnet_load_stream g_load_stream;
+
+static void bitnet_load_stream_reset(bool remove_file) {
+    if (g_load_stream.file) {
+        fclose(g_load_stream.file);
+    }
+    if (remove_file) {
+        std::remove(BITNET_STREAM_PATH);
+    }
+    g_load_stream = bitnet_load_stream();
+}
+
+// Parse the buffered header, but only once it has doubled since the last
+// incomplete attempt (or when the stream ends): a large header arriving in
+// small fetch chunks is then parsed a logarithmic number of times instead
+// of once per chunk. Returns the parse_gguf_header status.
+static int bitnet_load_stream_parse(bool at_end) {
+    bitnet_load_stream& stream = g_load_stream;
+    if (!at_end && stream.header.size() < stream.parse_at) {
+        return 0;
+    }
+    
+    const int status = parse_gguf_header(stream.header.data(), stream.header.size(), g_model);
+    if (status == 0) {
+        stream.parse_at = 2 * stream.header.size();
+    } else if (status == 1) {
+        stream.header_ready = true;
+        std::vector<uint8_t>().swap(stream.header);
+        
+        BITNET_LOG_INFO("[bitnet_load_stream] GGUF header parsed after " << stream.received << " bytes: arch="
+                  << g_model.arch << ", tensors=" << g_model.tensors.size()
+                  << ", vocab=" << g_model.vocab_size << ", layers=" << g_model.n_layer);
+    }
+    return status;
+}
+
+// Timing of the most recent inference call, reported by bitnet_get_stats
+struct bitnet_perf_stats {
+    int n_prompt_tokens = 0;
+    int n_prompt_reused = 0;
+    double prefill_ms = 0.0;
+    int n_decode_tokens = 0;
+    double decode_ms = 0.0;
+    int n_decode_calls = 0;      // llama_decode calls that produced n_decode_tokens
+    int n_draft_tokens = 0;      // speculative tokens submitted for verification
+    int n_draft_accepted = 0;    // ... and accepted
+    int n_ctx_shifts = 0;        // context shifts during this call
+};
+
+static bitnet_perf_stats g_stats;
+
+// Cancellation request for the running generation, checked between prefill
+// chunks and between tokens: 0 idle, > 0 the id of the request that may be
+// cancelled (bitnet_cancel_arm), -1 cancelled. Set by bitnet_cancel, or by
+// another thread swapping the armed id for -1 straight in the word at
+// bitnet_cancel_flag_ptr (the worker runtime's host does this with
+// Atomics.compareExchange when the heap is shared, so a cancel meant for a
+// request that has already finished does not hit the next one). Only
+// arming or clearing resets it, so a cancel that lands while a request is
+// starting is never lost.
+static std::atomic<int32_t> g_cancel{0};
+static_assert(sizeof(g_cancel) == sizeof(int32_t), "cancel flag must be a plain int32 in the heap");
+
+static bool bitnet_cancel_requested() {
+    return g_cancel.load(std::memory_order_relaxed) < 0;
+}
+
+static double bitnet_stats_prefill_tps() {
+    return g_stats.prefill_ms > 0.0 ? 1000.0 * g_stats.n_prompt_tokens / g_stats.prefill_ms : 0.0;
+}
+
+static double bitnet_stats_decode_tps() {
+    return g_stats.decode_ms > 0.0 ? 1000.0 * g_stats.n_decode_tokens / g_stats.decode_ms : 0.0;
+}
+
+// Tokens currently held in the KV cache for seq 0, in position order. Lets a
+// new prompt reuse the longest prefix it shares with the previous call.
+static std::vector<llama_token> g_kv_tokens;
+
+// Batch shared by prefill, single-stream decode and bitnet_batch_step,
+// allocated once per context (n_batch rows) so decoding never allocates
+static llama_batch g_batch = {};
+
+// Drop seq 0 from the KV cache; parallel sequences keep their cells
+static void bitnet_kv_reset() {
+    if (g_init_result.context) {
+        llama_kv_cache_seq_rm(g_init_result.context, 0, -1, -1);
+    }
+    g_kv_tokens.clear();
+}
+
+// Decode `tokens` into seq 0 starting at position n_past, n_ubatch tokens per
+// llama_decode, requesting logits only for the final token
+static bool bitnet_prefill(const llama_token* tokens, int n_tokens, int n_past) {
+    llama_context* ctx = g_init_result.context;
+    const int n_chunk = std::max(1, static_cast<int>(std::min(llama_n_ubatch(ctx), llama_n_batch(ctx))));
+    
+    const int64_t t_start_us = ggml_time_us();
+    
+    llama_batch& batch = g_batch;
+    for (int i = 0; i < n_tokens; i += n_chunk) {
+        // The chunks decoded so far stay in the KV cache for the next prompt
+        if (bitnet_cancel_requested()) {
+            BITNET_LOG_INFO("Prefill cancelled after " << i << " of " << n_tokens << " tokens");
+            return false;
+        }
+        const int n_eval = std::min(n_chunk, n_tokens - i);
+        
+        batch.n_tokens = n_eval;
+        for (int j = 0; j < n_eval; ++j) {
+            batch.token[j] = tokens[i + j];
+            batch.pos[j] = n_past + i + j;
+            batch.n_seq_id[j] = 1;
+            batch.seq_id[j][0] = 0;
+            batch.logits[j] = (i + j == n_tokens - 1);
+        }
+        
+        const int64_t t_chunk_us = ggml_time_us();
+        if (llama_decode(ctx, batch)) {
+            BITNET_LOG_ERROR("Failed to decode prompt tokens " << i << ".." << (i + n_eval - 1));
+            bitnet_kv_reset();
+            return false;
+        }
+        bitnet_trace_push(BITNET_TRACE_PREFILL, n_eval, t_chunk_us, ggml_time_us());
+        bitnet_profile_count_tokens(n_eval);
+        g_kv_tokens.insert(g_kv_tokens.end(), tokens + i, tokens + i + n_eval);
+    }
+    
+    g_stats.n_prompt_tokens = n_tokens;
+    g_stats.prefill_ms = (ggml_time_us() - t_start_us) / 1000.0;
+    return true;
+}
+
+// Fingerprint of the loaded model file; session snapshots are keyed to it
+static uint64_t g_model_hash = 0;
+
+// Set by loads that already saw every byte of the file (streamed or from
+// memory), so bitnet_load_model_from_file takes this hash instead of
+// reading the file again; 0 = not known
+static uint64_t g_pending_model_hash = 0;
+
+// Set by bitnet_session_load so the next generation keeps the restored
+// sampler history instead of resetting it
+static bool g_sampler_restored = false;
+
+// Session snapshot layout: header, KV token history, sampler history, the
+// sampler RNG state, then the llama.cpp sequence state for seq 0
+struct bitnet_session_header {
+    char magic[4];
+    uint32_t version;
+    uint64_t model_hash;
+    uint32_t n_ctx;
+    uint32_t n_tokens;
+    uint32_t n_sampler_tokens;
+    uint32_t rng_size;
+    uint64_t state_size;
+};
+
+static const char BITNET_SESSION_MAGIC[4] = {'B', 'N', 'S', 'S'};
+static const uint32_t BITNET_SESSION_VERSION = 2;
+
+// State of the in-flight generation (bitnet_generate_begin / bitnet_generate_next)
+struct bitnet_generation {
+    std::vector<llama_token> tokens;  // prompt followed by generated tokens
+    size_t n_prompt = 0;
+    int n_generated = 0;
+    int max_new_tokens = 0;
+    int consecutive_repeats = 0;
+    llama_token last_token = LLAMA_TOKEN_NULL;
+    bool done = true;
+    std::string piece;                // text of the most recent token
+    std::string pending;              // unfinished UTF-8 sequence carried to the next token
+    int i_logits = -1;                // batch row holding the logits for the next token (-1 = last)
+    bool stopped = false;             // a drafted token hit a stop condition; end after the accepted ones
+    llama_token next_token = LLAMA_TOKEN_NULL;  // replacement drawn when a draft-model proposal was rejected
+    int grammar = 0;                  // constraining grammar handle (0 = none)
+    int grammar_state = -1;           // automaton state after the tokens generated so far
+};
+
+static const int BITNET_DEFAULT_MAX_NEW_TOKENS = 32;
+static bitnet_generation g_gen;
+
+// Clear a generation for reuse, keeping the capacity of its buffers
+static void bitnet_generation_reset(bitnet_generation& gen) {
+    gen.tokens.clear();
+    gen.n_prompt = 0;
+    gen.n_generated = 0;
+    gen.max_new_tokens = 0;
+    gen.consecutive_repeats = 0;
+    gen.last_token = LLAMA_TOKEN_NULL;
+    gen.done = true;
+    gen.piece.clear();
+    gen.pending.clear();
+    gen.i_logits = -1;
+    gen.stopped = false;
+    gen.next_token = LLAMA_TOKEN_NULL;
+    gen.grammar = 0;
+    gen.grammar_state = -1;
+}
+
+static void bitnet_generation_accept(bitnet_generation& gen, llama_token token) {
+    gen.last_token = token;
+    gen.tokens.push_back(token);
+    gen.n_generated++;
+}
+
+// Decoding mode of bitnet_generate_*. With n_draft >= 0 tokens are picked
+// greedily; n_draft > 0 additionally drafts up to that many tokens per step
+// by prompt lookup and verifies them in the same decode.
+struct bitnet_lookup_config {
+    int n_draft = -1;    // < 0: sample with g_sampler
+    int ngram_max = 3;   // longest suffix matched against the history
+    int ngram_min = 1;
+};
+
+static bitnet_lookup_config g_lookup;
+static std::vector<llama_token> g_draft;  // reserved to n_batch at load
+
+// Draft-model speculative decoding (bitnet_draft.cpp): at most this many
+// proposals per round while a draft model is loaded; 0 disables
+static int g_spec_n_draft_max = 0;
+static std::vector<float> g_spec_weights;
+
+// Append a token's text to out, holding back a trailing partial UTF-8
+// sequence in gen.pending until the token that completes it arrives
+static void bitnet_append_piece(bitnet_generation& gen, llama_token token, std::string& out) {
+    size_t n_piece = 0;
+    const char* piece = bitnet_vocab_piece(token, &n_piece);
+    gen.pending.append(piece, n_piece);
+    
+    const size_t n_complete = bitnet_utf8_complete_prefix(gen.pending.data(), gen.pending.size());
+    out.append(gen.pending, 0, n_complete);
+    gen.pending.erase(0, n_complete);
+}
+
+// Sliding-window context for seq 0. When the context fills up, the first
+// n_keep tokens (attention sinks, or the system prompt) stay, the oldest
+// tokens after them are dropped and the rest slide down in the KV cache, so
+// generation continues at constant memory without re-decoding anything.
+struct bitnet_ctx_shift_config {
+    bool enabled = true;
+    int n_keep = 4;
+};
+
+static bitnet_ctx_shift_config g_ctx_shift;
+
+// One concurrent generation of the bitnet_seq_* API. Slot i decodes into
+// seq_id i + 1 (seq 0 belongs to bitnet_generate_*) with its own sampler.
+struct bitnet_slot {
+    bool in_use = false;
+    bitnet_sampler* sampler = nullptr;
+    bitnet_generation gen;
+    size_t n_past = 0;       // leading gen.tokens already in the KV cache
+    int i_batch = -1;        // batch row holding this slot's logits, or -1
+    std::string output;      // text produced since the last take_output
+    std::string taken;       // buffer returned by bitnet_seq_take_output
+};
+
+static std::vector<bitnet_slot> g_slots;
+
+// KV cells held by the running slots (seq 0 holds g_kv_tokens.size() more)
+static int bitnet_slot_cells() {
+    size_t n_cells = 0;
+    for (const bitnet_slot& slot : g_slots) {
+        if (slot.in_use) {
+            n_cells += slot.n_past;
+        }
+    }
+    return static_cast<int>(n_cells);
+}
+
+// Context available to seq 0: the cells the running slots hold are not
+// its to shift or fill
+static int bitnet_seq0_n_ctx() {
+    return static_cast<int>(llama_n_ctx(g_init_result.context)) - bitnet_slot_cells();
+}
+
+static int bitnet_ctx_shift_n_keep(int n_ctx) {
+    return std::min(g_ctx_shift.n_keep, n_ctx / 2);
+}
+
+// Make room in seq 0 for n_needed more tokens, shifting the context if it is
+// full (cells held by running slots count as taken). Discards half of the window after the kept tokens (more if n_needed
+// calls for it). Returns false if the tokens cannot fit.
+static bool bitnet_ctx_shift(int n_needed) {
+    llama_context* ctx = g_init_result.context;
+    const int n_ctx = bitnet_seq0_n_ctx();
+    const int n_past = static_cast<int>(g_kv_tokens.size());
+    if (n_past + n_needed <= n_ctx) {
+        return true;
+    }
+    if (!g_ctx_shift.enabled) {
+        BITNET_LOG_INFO("[bitnet_ctx_shift] Context full (" << n_ctx << " tokens), stopping");
+        return false;
+    }
+
+    const int64_t t_start_us = ggml_time_us();
+    const int n_keep = bitnet_ctx_shift_n_keep(n_ctx);
+    const int n_left = n_past - n_keep;
+    const int n_discard = std::max(n_left / 2, n_past + n_needed - n_ctx);
+    if (n_discard > n_left) {
+        BITNET_LOG_ERROR("[bitnet_ctx_shift] Cannot fit " << n_needed << " tokens after " << n_keep << " kept tokens");
+        return false;
+    }
+
+    llama_kv_cache_seq_rm(ctx, 0, n_keep, n_keep + n_discard);
+    llama_kv_cache_seq_add(ctx, 0, n_keep + n_discard, n_past, -n_discard);
+    g_kv_tokens.erase(g_kv_tokens.begin() + n_keep, g_kv_tokens.begin() + n_keep + n_discard);
+
+    // The generation history mirrors the KV cache position for position
+    g_gen.tokens.erase(g_gen.tokens.begin() + n_keep, g_gen.tokens.begin() + n_keep + n_discard);
+    if (g_gen.n_prompt > static_cast<size_t>(n_keep)) {
+        g_gen.n_prompt -= std::min(g_gen.n_prompt - n_keep, static_cast<size_t>(n_discard));
+    }
+    bitnet_draft_shift(n_keep, n_discard);
+
+    g_stats.n_ctx_shifts++;
+    bitnet_trace_push(BITNET_TRACE_SHIFT, n_discard, t_start_us, ggml_time_us());
+    BITNET_LOG_INFO("[bitnet_ctx_shift] Context full: kept " << n_keep << ", discarded " << n_discard
+                    << ", " << (n_past - n_discard) << " tokens remain");
+    return true;
+}
+
+// Fit a prompt that does not leave room for generation in the context: keep
+// its first n_keep tokens and a recent tail. If the KV cache holds the kept
+// tokens followed by a stretch of this prompt (a conversation that has
+// already been shifted), cut exactly the part in between so that stretch is
+// reused; otherwise keep the last half of the window.
+static bool bitnet_ctx_fit_prompt(std::vector<llama_token>& tokens) {
+    const int n_ctx = bitnet_seq0_n_ctx();
+    const int n_tokens = static_cast<int>(tokens.size());
+    if (n_tokens < n_ctx) {
+        return true;
+    }
+    if (!g_ctx_shift.enabled) {
+        BITNET_LOG_ERROR("Prompt of " << n_tokens << " tokens does not fit the context (" << n_ctx << ")");
+        return false;
+    }
+    if (n_ctx < 2) {
+        BITNET_LOG_ERROR("No context left for the prompt: running sequences hold " << bitnet_slot_cells() << " cells");
+        return false;
+    }
+
+    const int n_keep = bitnet_ctx_shift_n_keep(n_ctx);
+    const int n_cached = static_cast<int>(g_kv_tokens.size());
+    int n_start = n_tokens - (n_ctx - n_keep) / 2;
+
+    if (n_cached > n_keep && std::equal(g_kv_tokens.begin(), g_kv_tokens.begin() + n_keep, tokens.begin())) {
+        int best_len = 0;
+        for (int j = n_keep; j < n_tokens; ++j) {
+            int len = 0;
+            while (n_keep + len < n_cached && j + len < n_tokens && g_kv_tokens[n_keep + len] == tokens[j + len]) {
+                len++;
+            }
+            if (len > best_len) {
+                best_len = len;
+                n_start = j;
+            }
+        }
+        if (best_len == 0 || n_keep + (n_tokens - n_start) >= n_ctx) {
+            n_start = n_tokens - (n_ctx - n_keep) / 2;
+        }
+    }
+
+    BITNET_LOG_WARN("⚠️ Prompt of " << n_tokens << " tokens exceeds the context; dropping tokens "
+                    << n_keep << ".." << (n_start - 1));
+    tokens.erase(tokens.begin() + n_keep, tokens.begin() + n_start);
+    return true;
+}
+
+// Tokenize a prompt with BOS handling, dropping a stray token 0 that some
+// BitNet exports produce mid-prompt
+static bool bitnet_tokenize_prompt(const char* input_text, std::vector<llama_token>& input_tokens) {
+    const int64_t t_start_us = ggml_time_us();
+    const int max_tokens = 2048;
+    input_tokens.resize(max_tokens);
+    
+    // Get BOS token for proper tokenization
+    const llama_token bos_token = llama_token_bos(g_init_result.model);
+    const bool add_bos = (bos_token != LLAMA_TOKEN_NULL);
+    
+    int n_tokens = llama_tokenize(g_init_result.model, input_text, strlen(input_text), 
+                                  input_tokens.data(), max_tokens, add_bos, true);
+    if (n_tokens < 0) {
+        // Longer than the first guess; -n_tokens is the exact count
+        input_tokens.resize(-n_tokens);
+        n_tokens = llama_tokenize(g_init_result.model, input_text, strlen(input_text),
+                                  input_tokens.data(), -n_tokens, add_bos, true);
+    }
+    if (n_tokens < 0) {
+        BITNET_LOG_ERROR("Failed to tokenize input");
+        return false;
+    }
+    input_tokens.resize(n_tokens);
+    BITNET_LOG_INFO("[bitnet_tokenize_prompt] Input tokens: " << input_tokens.size()
+                    << (add_bos ? " (includes BOS)" : "") << " BOS token: " << bos_token);
+    
+#if BITNET_LOG_LEVEL >= BITNET_LOG_LEVEL_DEBUG
+    BITNET_LOG_DEBUG("All tokens after tokenization:");
+    for (int i = 0; i < n_tokens; ++i) {
+        size_t debug_n_piece = 0;
+        const char* debug_piece = bitnet_vocab_piece(input_tokens[i], &debug_n_piece);
+        BITNET_LOG_DEBUG("  Token " << i << ": " << input_tokens[i] << " = '"
+                         << std::string(debug_piece, debug_n_piece) << "'");
+    }
+#endif
+    
+    // Token 0 past the BOS position is usually an EOS/invalid id that leads to NaN
+    for (int i = 1; i < n_tokens; ++i) {
+        if (input_tokens[i] == 0) {
+            BITNET_LOG_WARN("⚠️ WARNING: Token ID 0 detected at position " << i << " (not BOS position), removing it");
+            input_tokens.erase(input_tokens.begin() + i);
+            break;
+        }
+    }
+    
+    bitnet_trace_push(BITNET_TRACE_TOKENIZE, static_cast<int32_t>(input_tokens.size()), t_start_us, ggml_time_us());
+    return true;
+}
+
+// Stop conditions for a freshly sampled token: end-of-generation tokens plus
+// the repetition guards BitNet models need to avoid degenerate loops (not
+// applied to grammar-constrained generations)
+static bool bitnet_should_stop(bitnet_generation& gen, llama_token new_token) {
+    const llama_model* model = g_init_result.model;
+    
+    // Debug: Check if we're getting valid token IDs
+    if (new_token < 0 || new_token >= llama_n_vocab(model)) {
+        BITNET_LOG_INFO("[bitnet_generate] Invalid token ID, stopping");
+        return true;
+    }
+    
+    // Check for various stop conditions with improved EOG handling
+    if (new_token == llama_token_eos(model) || new_token == llama_token_eot(model)) {
+        BITNET_LOG_INFO("[bitnet_generate] Stop token generated (EOS/EOT), stopping");
+        return true;
+    }
+    
+    // Better EOG detection - manually check known EOG tokens for BitNet models
+    if (new_token == 128001 || new_token == 128009) { // <|end_of_text|> or <|eot_id|>
+        BITNET_LOG_INFO("[bitnet_generate] Manual EOG token detected (" << new_token << "), stopping");
+        return true;
+    }
+    
+    // Check for End-of-Generation using llama.cpp function
+    if (llama_token_is_eog(model, new_token)) {
+        BITNET_LOG_INFO("[bitnet_generate] End-of-generation token detected, stopping");
+        return true;
+    }
+    
+    // Constrained output ends when its grammar allows nothing but end-of-text.
+    // Repeats are often valid there ("[0, 0, 0]", "]]", indentation), and
+    // cutting them short would hand back malformed output.
+    if (gen.grammar != 0) {
+        return false;
+    }
+    
+    // Special handling for problematic token 31 (@)
+    if (new_token == 31) {
+        BITNET_LOG_DEBUG("[bitnet_generate] Warning: Generated token 31 ('@'), checking context...");
+        // If we already generated this token, try to get alternatives by resampling
+        if (gen.last_token == 31) {
+            gen.consecutive_repeats++;
+            if (gen.consecutive_repeats >= 2) { // Lower threshold for '@' token
+                BITNET_LOG_INFO("[bitnet_generate] Too many '@' tokens, stopping early");
+                return true;
+            }
+        }
+    } else {
+        // Reset consecutive repeats for non-@ tokens
+        gen.consecutive_repeats = 0;
+    }
+    
+    // Enhanced anti-repetition logic for BitNet models
+    if (new_token == gen.last_token) {
+        gen.consecutive_repeats++;
+        if (gen.consecutive_repeats >= 2) { // Stricter repetition control
+            BITNET_LOG_INFO("[bitnet_generate] Consecutive repeats detected, stopping to prevent loops");
+            return true;
+        }
+    } else {
+        gen.consecutive_repeats = 0;
+    }
+    
+    // Additional check for alternating patterns (like "mass cluster mass cluster")
+    const std::vector<llama_token>& output_tokens = gen.tokens;
+    if (output_tokens.size() >= 4) {
+        bool is_alternating = true;
+        const size_t start_idx = output_tokens.size() - 4;
+        for (size_t check_idx = start_idx; check_idx < output_tokens.size() - 2; ++check_idx) {
+            if (output_tokens[check_idx] != output_tokens[check_idx + 2]) {
+                is_alternating = false;
+                break;
+            }
+        }
+        if (is_alternating) {
+            BITNET_LOG_INFO("[bitnet_generate] Alternating pattern detected, stopping to prevent loops");
+            return true;
+        }
+    }
+    
+    return false;
+}
+
+static llama_token bitnet_argmax(const float* logits, int n_vocab) {
+    return static_cast<llama_token>(std::max_element(logits, logits + n_vocab) - logits);
+}
+
+// Prompt lookup: find the most recent earlier occurrence of the history's
+// last n tokens (longest n first) and propose up to n_max tokens that
+// followed it. Returns the number of drafted tokens.
+static int bitnet_lookup_draft(const std::vector<llama_token>& tokens, int n_max, std::vector<llama_token>& draft) {
+    draft.clear();
+    const int n_tokens = static_cast<int>(tokens.size());
+    for (int n = std::min(g_lookup.ngram_max, n_tokens - 1); n >= g_lookup.ngram_min; --n) {
+        const llama_token* suffix = tokens.data() + n_tokens - n;
+        for (int j = n_tokens - n - 1; j >= 0; --j) {
+            if (std::equal(suffix, suffix + n, tokens.data() + j)) {
+                const int n_follow = std::min(n_max, n_tokens - (j + n));
+                draft.assign(tokens.begin() + j + n, tokens.begin() + j + n + n_follow);
+                return n_follow;
+            }
+        }
+    }
+    return 0;
+}
+
+// Greedy step with prompt-lookup speculation. The greedy token and the
+// drafted continuation are decoded as one batch with logits on every row;
+// row i holds the greedy prediction for the token after row i, so drafts are
+// accepted while they match it and the KV cells of the rest are dropped.
+// Emits the same tokens as decoding one greedy token per step.
+static bool bitnet_lookup_step() {
+    llama_context* ctx = g_init_result.context;
+    const int n_vocab = llama_n_vocab(g_init_result.model);
+    
+    const int64_t t_sample_us = ggml_time_us();
+    const llama_token first = g_gen.next_token != LLAMA_TOKEN_NULL
+        ? g_gen.next_token : bitnet_argmax(llama_get_logits_ith(ctx, g_gen.i_logits), n_vocab);
+    g_gen.next_token = LLAMA_TOKEN_NULL;
+    bitnet_trace_push(BITNET_TRACE_SAMPLE, first, t_sample_us, ggml_time_us());
+    
+    if (bitnet_should_stop(g_gen, first)) {
+        return false;
+    }
+    bitnet_generation_accept(g_gen, first);
+    
+    // Room left in the token budget, the context and the batch
+    const int n_room = std::min({g_lookup.n_draft,
+                                 g_gen.max_new_tokens - g_gen.n_generated,
+                                 bitnet_seq0_n_ctx() - static_cast<int>(g_gen.tokens.size()),
+                                 static_cast<int>(llama_n_batch(ctx)) - 1});
+    const int n_draft = n_room > 0 ? bitnet_lookup_draft(g_gen.tokens, n_room, g_draft) : 0;
+    
+    const llama_pos pos0 = static_cast<llama_pos>(g_gen.tokens.size() - 1);
+    llama_batch& batch = g_batch;
+    batch.n_tokens = 0;
+    for (int i = 0; i <= n_draft; ++i) {
+        const int row = batch.n_tokens++;
+        batch.token[row] = i == 0 ? first : g_draft[i - 1];
+        batch.pos[row] = pos0 + i;
+        batch.n_seq_id[row] = 1;
+        batch.seq_id[row][0] = 0;
+        batch.logits[row] = true;
+    }
+    
+    const int64_t t_decode_us = ggml_time_us();
+    if (llama_decode(ctx, batch)) {
+        BITNET_LOG_ERROR("Failed to decode generated token");
+        bitnet_kv_reset();
+        return false;
+    }
+    const int64_t t_decoded_us = ggml_time_us();
+    bitnet_trace_push(BITNET_TRACE_DECODE, batch.n_tokens, t_decode_us, t_decoded_us);
+    bitnet_profile_count_tokens(batch.n_tokens);
+    
+    int n_accepted = 0;
+    for (; n_accepted < n_draft; ++n_accepted) {
+        const llama_token predicted = bitnet_argmax(llama_get_logits_ith(ctx, n_accepted), n_vocab);
+        if (predicted != g_draft[n_accepted]) {
+            break;
+        }
+        if (bitnet_should_stop(g_gen, predicted)) {
+            g_gen.stopped = true;
+            break;
+        }
+        bitnet_generation_accept(g_gen, predicted);
+    }
+    if (n_accepted < n_draft) {
+        llama_kv_cache_seq_rm(ctx, 0, pos0 + 1 + n_accepted, -1);
+    }
+    g_gen.i_logits = n_accepted;
+    
+    g_kv_tokens.push_back(first);
+    g_kv_tokens.insert(g_kv_tokens.end(), g_draft.begin(), g_draft.begin() + n_accepted);
+    g_stats.decode_ms += (t_decoded_us - t_decode_us) / 1000.0;
+    g_stats.n_decode_tokens += 1 + n_accepted;
+    g_stats.n_decode_calls++;
+    g_stats.n_draft_tokens += n_draft;
+    g_stats.n_draft_accepted += n_accepted;
+    
+    g_gen.piece.clear();
+    bitnet_append_piece(g_gen, first, g_gen.piece);
+    for (int i = 0; i < n_accepted; ++i) {
+        bitnet_append_piece(g_gen, g_draft[i], g_gen.piece);
+    }
+    BITNET_LOG_DEBUG("[bitnet_generate] Tokens " << g_gen.n_generated - n_accepted << ".." << g_gen.n_generated
+              << ": '" << g_gen.piece << "' (" << n_accepted << "/" << n_draft << " drafted accepted)");
+    
+    return true;
+}
+
+static float bitnet_dist_prob(const llama_token_data* dist, size_t n, llama_token token) {
+    for (size_t i = 0; i < n; ++i) {
+        if (dist[i].id == token) {
+            return dist[i].p;
+        }
+    }
+    return 0.0f;
+}
+
+// Next token from the target sampler: the replacement drawn by a rejected
+// draft round if there is one, otherwise a sample from row g_gen.i_logits
+static llama_token bitnet_sample_next() {
+    const llama_token token = g_gen.next_token != LLAMA_TOKEN_NULL
+        ? g_gen.next_token : bitnet_sampler_sample(g_sampler, g_init_result.context, g_gen.i_logits);
+    g_gen.next_token = LLAMA_TOKEN_NULL;
+    return token;
+}
+
+// Speculative step with the draft model. The first token comes from the
+// target as usual; the draft then proposes a continuation and the target
+// scores the first token and all proposals in one batch. Proposal x, drawn
+// with draft probability q(x), is accepted with probability min(1, p(x)/q(x))
+// under the target distribution p (after penalties, top-k/p, min-p and
+// temperature). At the first rejection a replacement is drawn from
+// max(0, p - q), renormalized, and opens the next round; if everything is
+// accepted the next round samples from the row after the last proposal.
+// The emitted tokens are distributed exactly as with plain sampling.
+static bool bitnet_draft_step() {
+    llama_context* ctx = g_init_result.context;
+    
+    const int64_t t_sample_us = ggml_time_us();
+    const llama_token first = bitnet_sample_next();
+    bitnet_trace_push(BITNET_TRACE_SAMPLE, first, t_sample_us, ggml_time_us());
+    
+    if (bitnet_should_stop(g_gen, first)) {
+        return false;
+    }
+    bitnet_generation_accept(g_gen, first);
+    bitnet_sampler_accept(g_sampler, first);
+    
+    const int n_room = std::min({bitnet_draft_length(g_spec_n_draft_max),
+                                 g_gen.max_new_tokens - g_gen.n_generated,
+                                 bitnet_seq0_n_ctx() - static_cast<int>(g_gen.tokens.size()),
+                                 static_cast<int>(llama_n_batch(ctx)) - 1});
+    const int64_t t_draft_us = ggml_time_us();
+    const int n_draft = n_room > 0 ? bitnet_draft_propose(g_gen.tokens, n_room, g_draft) : 0;
+    
+    const llama_pos pos0 = static_cast<llama_pos>(g_gen.tokens.size() - 1);
+    llama_batch& batch = g_batch;
+    batch.n_tokens = 0;
+    for (int i = 0; i <= n_draft; ++i) {
+        const int row = batch.n_tokens++;
+        batch.token[row] = i == 0 ? first : g_draft[i - 1];
+        batch.pos[row] = pos0 + i;
+        batch.n_seq_id[row] = 1;
+        batch.seq_id[row][0] = 0;
+        batch.logits[row] = true;
+    }
+    
+    const int64_t t_decode_us = ggml_time_us();
+    if (llama_decode(ctx, batch)) {
+        BITNET_LOG_ERROR("Failed to decode generated token");
+        bitnet_kv_reset();
+        return false;
+    }
+    const int64_t t_decoded_us = ggml_time_us();
+    bitnet_trace_push(BITNET_TRACE_DECODE, batch.n_tokens, t_decode_us, t_decoded_us);
+    bitnet_profile_count_tokens(batch.n_tokens);
+    
+    int n_accepted = 0;
+    for (; n_accepted < n_draft; ++n_accepted) {
+        const llama_token token = g_draft[n_accepted];
+        size_t n_p = 0;
+        const llama_token_data* p = bitnet_sampler_dist(g_sampler, llama_get_logits_ith(ctx, n_accepted), &n_p);
+        const std::vector<llama_token_data>& q = bitnet_draft_dist(n_accepted);
+        const float p_x = bitnet_dist_prob(p, n_p, token);
+        const float q_x = bitnet_dist_prob(q.data(), q.size(), token);
+        
+        if (bitnet_sampler_uniform(g_sampler) * q_x > p_x) {
+            float total = 0.0f;
+            g_spec_weights.clear();
+            for (size_t j = 0; j < n_p; ++j) {
+                const float w = std::max(0.0f, p[j].p - bitnet_dist_prob(q.data(), q.size(), p[j].id));
+                g_spec_weights.push_back(w);
+                total += w;
+            }
+            // p == q up to rounding: the residual is empty, draw from p itself
+            if (total <= 0.0f) {
+                for (size_t j = 0; j < n_p; ++j) {
+                    g_spec_weights[j] = p[j].p;
+                }
+            }
+            g_gen.next_token = p[bitnet_sampler_draw(g_sampler, g_spec_weights.data(), n_p)].id;
+            break;
+        }
+        if (bitnet_should_stop(g_gen, token)) {
+            g_gen.stopped = true;
+            break;
+        }
+        bitnet_generation_accept(g_gen, token);
+        bitnet_sampler_accept(g_sampler, token);
+    }
+    if (n_accepted < n_draft) {
+        llama_kv_cache_seq_rm(ctx, 0, pos0 + 1 + n_accepted, -1);
+    }
+    g_gen.i_logits = n_accepted;
+    
+    g_kv_tokens.push_back(first);
+    g_kv_tokens.insert(g_kv_tokens.end(), g_draft.begin(), g_draft.begin() + n_accepted);
+    g_stats.decode_ms += (t_decoded_us - t_decode_us) / 1000.0;
+    g_stats.n_decode_tokens += 1 + n_accepted;
+    g_stats.n_decode_calls++;
+    g_stats.n_draft_tokens += n_draft;
+    g_stats.n_draft_accepted += n_accepted;
+    bitnet_draft_update(n_draft, n_accepted, (t_decode_us - t_draft_us) / 1000.0, (t_decoded_us - t_decode_us) / 1000.0);
+    
+    g_gen.piece.clear();
+    bitnet_append_piece(g_gen, first, g_gen.piece);
+    for (int i = 0; i < n_accepted; ++i) {
+        bitnet_append_piece(g_gen, g_draft[i], g_gen.piece);
+    }
+    BITNET_LOG_DEBUG("[bitnet_generate] Tokens " << g_gen.n_generated - n_accepted << ".." << g_gen.n_generated
+              << ": '" << g_gen.piece << "' (" << n_accepted << "/" << n_draft << " drafted accepted)");
+    
+    return true;
+}
+
+// Sample, accept and decode the next token(s) of the current generation,
+// leaving their text in g_gen.piece. Returns false once generation should stop.
+static bool bitnet_generate_step() {
+    if (g_gen.stopped || g_gen.n_generated >= g_gen.max_new_tokens) {
+        return false;
+    }
+    if (!bitnet_ctx_shift(1)) {
+        return false;
+    }
+    // Drafted tokens are not checked against the grammar, so constrained
+    // generations always take the plain path
+    if (g_gen.grammar == 0 && g_lookup.n_draft >= 0) {
+        return bitnet_lookup_step();
+    }
+    if (g_gen.grammar == 0 && g_spec_n_draft_max > 0 && bitnet_draft_loaded() && bitnet_sampler_is_fused(g_sampler)) {
+        return bitnet_draft_step();
+    }
+    
+    const int64_t t_sample_us = ggml_time_us();
+    if (g_gen.grammar != 0) {
+        bitnet_sampler_set_allowed(g_sampler, bitnet_grammar_allowed(g_gen.grammar, g_gen.grammar_state));
+    }
+    const llama_token new_token = bitnet_sample_next();
+    bitnet_sampler_set_allowed(g_sampler, nullptr);
+    bitnet_trace_push(BITNET_TRACE_SAMPLE, new_token, t_sample_us, ggml_time_us());
+    
+    if (bitnet_should_stop(g_gen, new_token)) {
+        return false;
+    }
+    if (g_gen.grammar != 0) {
+        g_gen.grammar_state = bitnet_grammar_next(g_gen.grammar, g_gen.grammar_state, new_token);
+        if (g_gen.grammar_state < 0) {
+            BITNET_LOG_ERROR("[bitnet_generate] Token " << new_token << " rejected by the grammar, stopping");
+            return false;
+        }
+    }
+    
+    bitnet_generation_accept(g_gen, new_token);
+    
+    // Accept the token into the sampler's penalty history
+    bitnet_sampler_accept(g_sampler, new_token);
+    
+    // Decode the new token for next iteration - real neural net forward pass
+    llama_batch& single_batch = g_batch;
+    single_batch.token[0] = new_token;
+    single_batch.pos[0] = g_gen.tokens.size() - 1;  // Position in sequence
+    single_batch.n_seq_id[0] = 1;
+    single_batch.seq_id[0][0] = 0;  // Same sequence ID
+    single_batch.logits[0] = true;  // We need logits for next prediction
+    single_batch.n_tokens = 1;
+    
+    const int64_t t_decode_us = ggml_time_us();
+    if (llama_decode(g_init_result.context, single_batch)) {
+        BITNET_LOG_ERROR("Failed to decode generated token");
+        bitnet_kv_reset();
+        return false;
+    }
+    const int64_t t_decoded_us = ggml_time_us();
+    bitnet_trace_push(BITNET_TRACE_DECODE, new_token, t_decode_us, t_decoded_us);
+    bitnet_profile_count_tokens(1);
+    g_kv_tokens.push_back(new_token);
+    g_gen.i_logits = -1;
+    g_stats.decode_ms += (t_decoded_us - t_decode_us) / 1000.0;
+    g_stats.n_decode_tokens++;
+    g_stats.n_decode_calls++;
+    
+    g_gen.piece.clear();
+    bitnet_append_piece(g_gen, new_token, g_gen.piece);
+    BITNET_LOG_DEBUG("[bitnet_generate] Token " << g_gen.n_generated << ": '" 
+              << g_gen.piece << "' (id=" << new_token << ")");
+    
+    return true;
+}
+
+static void bitnet_slots_free() {
+    for (bitnet_slot& slot : g_slots) {
+        if (slot.sampler) {
+            bitnet_sampler_free(slot.sampler);
+        }
+    }
+    g_slots.clear();
+}
+
+static void bitnet_batch_free() {
+    if (g_batch.token) {
+        llama_batch_free(g_batch);
+        g_batch = {};
+    }
+}
+
+// Undo a model load that failed part way. The pager (and its read-ahead
+// thread) holds pointers into the model, so it goes before the model does.
+static int bitnet_load_fail() {
+    bitnet_pager_free();
+    bitnet_cache_drop_source();
+    if (g_init_result.context) {
+        llama_free(g_init_result.context);
+        g_init_result.context = nullptr;
+    }
+    if (g_init_result.model) {
+        llama_free_model(g_init_result.model);
+        g_init_result.model = nullptr;
+    }
+    return 0;
+}
+
+// Sample the next token of a slot from batch row slot.i_batch and append its
+// text to the slot's output. Marks the slot done on a stop condition.
+static void bitnet_slot_sample(bitnet_slot& slot) {
+    bitnet_generation& gen = slot.gen;
+    
+    const int64_t t_sample_us = ggml_time_us();
+    const llama_token new_token = bitnet_sampler_sample(slot.sampler, g_init_result.context, slot.i_batch);
+    bitnet_trace_push(BITNET_TRACE_SAMPLE, new_token, t_sample_us, ggml_time_us());
+    slot.i_batch = -1;
+    
+    if (bitnet_should_stop(gen, new_token)) {
+        gen.done = true;
+    } else {
+        bitnet_generation_accept(gen, new_token);
+        bitnet_sampler_accept(slot.sampler, new_token);
+        bitnet_append_piece(gen, new_token, slot.output);
+        
+        // The final token never needs to be decoded
+        if (gen.n_generated >= gen.max_new_tokens) {
+            gen.done = true;
+        }
+    }
+    
+    // Nothing will complete a trailing partial sequence now; emit it as is
+    if (gen.done) {
+        slot.output += gen.pending;
+        gen.pending.clear();
+    }
+}
+
 extern "C" {
     // Initialize the BitNet-enhanced llama.cpp engine
     __attribute__((visibility("default"))) EMSCRIPTEN_KEEPALIVE void bitnet_init() {
         if (g_initialized) return;
         
-        std::cout << "[bitnet_init] Initializing BitNet-enhanced llama.cpp" << std::endl;
+        BITNET_LOG_INFO("[bitnet_init] Initializing BitNet-enhanced llama.cpp");
         fflush(stdout);
         
         // Initialize BitNet extensions with WASM safety checks
@@ -67,58 +1001,58 @@ extern "C" {
         llama_numa_init(GGML_NUMA_STRATEGY_DISABLED);
         
         g_initialized = true;
-        std::cout << "[bitnet_init] Initialization complete" << std::endl;
+        BITNET_LOG_INFO("[bitnet_init] Initialization complete");
     }
     
-    // Load model using real llama.cpp with BitNet support
-    __attribute__((visibility("default"))) EMSCRIPTEN_KEEPALIVE int bitnet_load_model(const uint8_t* data, size_t size) {
+    void bitnet_free_model();
+    
+    // Load model using real llama.cpp with BitNet support, directly from a path.
+    // The loader reads straight from the file into the tensor buffers, so the
+    // heap holds one copy of the weights. The file itself stays until the
+    // caller removes it, so a MEMFS file and the loaded model coexist: memory
+    // peaks at about twice the model size. A model already loaded is freed first, with everything built against it (slots,
+    // draft model, grammars, pager).
+    __attribute__((visibility("default"))) EMSCRIPTEN_KEEPALIVE int bitnet_load_model_from_file(const char* path) {
         if (!g_initialized) {
             bitnet_init();
         }
         
-        std::cout << "[bitnet_load_model] Loading model (" << size << " bytes)" << std::endl;
+        if (g_init_result.model || g_init_result.context) {
+            BITNET_LOG_INFO("[bitnet_load_model_from_file] Freeing the loaded model first");
+            bitnet_free_model();
+        }
+        
+        BITNET_LOG_INFO("[bitnet_load_model_from_file] Loading model from " << path);
         
         try {
-            // Write data to temporary file (in WASM, this will be in memory filesystem)
-            const char* temp_path = "/tmp/model.gguf";
-            std::ofstream file(temp_path, std::ios::binary);
-            if (!file) {
-                std::cerr << "Failed to create temporary model file" << std::endl;
-                return 0;
-            }
-            
-            // WASM-specific file writing optimizations
-            std::cout << "Writing model to WASM memory filesystem..." << std::endl;
-            
-            // Write in chunks to avoid memory issues in WASM
-            const size_t chunk_size = 1024 * 1024; // 1MB chunks
-            size_t written = 0;
-            while (written < size) {
-                size_t current_chunk = std::min(chunk_size, size - written);
-                file.write(reinterpret_cast<const char*>(data + written), current_chunk);
-                written += current_chunk;
-                
-                if ((written % (10 * 1024 * 1024)) == 0) { // Progress every 10MB
-                    std::cout << "Written " << (written / 1024 / 1024) << " MB / " 
-                              << (size / 1024 / 1024) << " MB" << std::endl;
-                }
+            // A cache file of the current version stands in for its source:
+            // same hash, and its tensors were validated when it was written
+            BitNetModel tensor_info;
+            const bool have_tensor_info = parse_gguf_header_file(path, tensor_info);
+            const uint64_t cache_source_hash = have_tensor_info ? bitnet_cache_source_hash(tensor_info) : 0;
+            g_model_from_cache = cache_source_hash != 0;
+            const uint64_t file_hash = g_pending_model_hash;
+            g_pending_model_hash = 0;
+            g_model_hash = g_model_from_cache ? cache_source_hash
+                                              : file_hash != 0 ? file_hash : bitnet_fingerprint_file(path);
+            if (g_model_from_cache) {
+                BITNET_LOG_INFO("[bitnet_load_model_from_file] Preprocessed cache of model "
+                                << std::hex << cache_source_hash << std::dec << "; skipping tensor validation");
             }
             
-            file.close();
-            std::cout << "Model file written successfully to WASM filesystem" << std::endl;
-            
             // Set up model parameters using common_params with WASM memory safety
             common_params params;
-            params.model = temp_path;
+            params.model = path;
             params.n_ctx = 512;    // Reasonable context size for BitNet
             params.n_batch = 512;  // Reasonable batch size
-            params.cpuparams.n_threads = 1; // Single thread for WASM
-            params.cpuparams_batch.n_threads = 1; // Single thread for batch processing
+            params.cpuparams.n_threads = bitnet_resolve_n_threads(g_load_config.n_threads);
+            params.cpuparams_batch.n_threads = params.cpuparams.n_threads;
             params.n_gpu_layers = 0; // No GPU in WASM
             params.use_mmap = false; // Don't use mmap in WASM
             params.use_mlock = false;
             params.flash_attn = false; // Disable flash attention for WASM
-            params.cont_batching = false; // Disable continuous batching to avoid threading
+            params.cont_batching = g_load_config.n_parallel > 0; // Only the bitnet_seq_* API mixes sequences
+            params.n_parallel = g_load_config.n_parallel + 1;     // seq 0 plus one per slot
             
             // Use BitNet sampling parameters with stronger repetition control
             params.sparams.temp = 0.8f;  // Original BitNet default temperature
@@ -152,16 +1086,24 @@ extern "C" {
             
             // Override pre-tokenizer configuration dynamically for BitNet models
             // This addresses the "GENERATION QUALITY WILL BE DEGRADED!" warning
-            std::cout << "Applying BitNet model compatibility fixes..." << std::endl;
+            BITNET_LOG_INFO("Applying BitNet model compatibility fixes...");
             
             // Try to limit memory usage for WASM safety
-            std::cout << "Applying WASM memory safety limits..." << std::endl;
+            BITNET_LOG_INFO("Applying WASM memory safety limits...");
             
             // Enhanced WASM alignment and memory safety for i2_s quantization
             model_params.use_mmap = false;      // Disable memory mapping
             model_params.use_mlock = false;     // Disable memory locking
-            model_params.check_tensors = true;  // Keep tensor validation for safety
-            
+            // Keep tensor validation for safety, except for cache files (done
+            // already) and when paging: it reads every weight, which would
+            // fault the whole mapped file in
+            model_params.check_tensors = g_load_config.paging_slots == 0 && !g_model_from_cache;
+
+#ifndef __EMSCRIPTEN__
+            // Native builds can map the file: weights are paged in, never copied
+            model_params.use_mmap = true;
+#endif
+
             // We can't directly override the pre-tokenizer in model params here,
             // but we'll handle it after model loading through vocab manipulation
             
@@ -169,15 +1111,15 @@ extern "C" {
             model_params.vocab_only = false;
             
             // Debug model parameters with alignment info
-            std::cout << "Model params: use_mmap=" << model_params.use_mmap 
+            BITNET_LOG_INFO("Model params: use_mmap=" << model_params.use_mmap 
                       << ", use_mlock=" << model_params.use_mlock 
                       << ", n_gpu_layers=" << model_params.n_gpu_layers 
-                      << ", check_tensors=" << model_params.check_tensors << std::endl;
+                      << ", check_tensors=" << model_params.check_tensors);
             
-            g_init_result.model = llama_load_model_from_file(temp_path, model_params);
+            g_init_result.model = llama_load_model_from_file(path, model_params);
             
             if (!g_init_result.model) {
-                std::cerr << "Failed to load model from file" << std::endl;
+                BITNET_LOG_ERROR("Failed to load model from file");
                 return 0;
             }
             
@@ -187,20 +1129,33 @@ extern "C" {
             const int n_layer = llama_n_layer(g_init_result.model);
             
             if (vocab_size <= 0 || n_embd <= 0 || n_layer <= 0) {
-                std::cerr << "Model appears to be corrupted: vocab=" << vocab_size 
-                          << ", embd=" << n_embd << ", layers=" << n_layer << std::endl;
-                llama_free_model(g_init_result.model);
-                g_init_result.model = nullptr;
-                return 0;
+                BITNET_LOG_ERROR("Model appears to be corrupted: vocab=" << vocab_size 
+                          << ", embd=" << n_embd << ", layers=" << n_layer);
+                return bitnet_load_fail();
+            }
+            
+            BITNET_LOG_INFO("Model loaded successfully!");
+            BITNET_LOG_INFO("Model vocab size: " << llama_n_vocab(g_init_result.model));
+            
+            if (g_load_config.paging_slots > 0) {
+                if (have_tensor_info) {
+                    bitnet_pager_init(g_init_result.model, path, tensor_info, g_load_config.paging_slots);
+                } else {
+                    BITNET_LOG_WARN("⚠️ Could not read tensor infos; loading without weight paging");
+                }
             }
             
-            std::cout << "Model loaded successfully!" << std::endl;
-            std::cout << "Model vocab size: " << llama_n_vocab(g_init_result.model) << std::endl;
+            // Keep what a cache of this model needs from the source file; the
+            // cache itself is written by bitnet_write_model_cache, after a
+            // streamed load has deleted its staging copy
+            if (!g_model_from_cache && !g_load_config.cache_path.empty()) {
+                bitnet_cache_keep_source(path);
+            }
             
-            std::cout << "✓ About to start context creation with wllama retry strategy..." << std::endl;
+            BITNET_LOG_INFO("✓ About to plan and create the context...");
             
             // Fix tokenizer configuration issues for BitNet models
-            std::cout << "Applying BitNet model fixes..." << std::endl;
+            BITNET_LOG_INFO("Applying BitNet model fixes...");
             
             // The model expects a BPE pre-tokenizer but doesn't specify it correctly
             // This is a known issue with some BitNet model exports
@@ -212,10 +1167,10 @@ extern "C" {
             const llama_token eot_token = llama_token_eot(g_init_result.model);
             const llama_token nl_token = llama_token_nl(g_init_result.model);
             
-            std::cout << "Special tokens - BOS: " << bos_token << 
+            BITNET_LOG_INFO("Special tokens - BOS: " << bos_token << 
                         ", EOS: " << eos_token << 
                         ", EOT: " << eot_token << 
-                        ", NL: " << nl_token << std::endl;
+                        ", NL: " << nl_token);
             
             // Get tokenizer type from model
             enum llama_vocab_type vocab_type = llama_vocab_type(g_init_result.model);
@@ -228,103 +1183,97 @@ extern "C" {
                 case LLAMA_VOCAB_TYPE_RWKV: vocab_name = "RWKV"; break;
                 default: vocab_name = "Unknown"; break;
             }
-            std::cout << "Vocab type: " << vocab_name << std::endl;
+            BITNET_LOG_INFO("Vocab type: " << vocab_name);
             
             // Check if model has a pre-tokenizer
             if (llama_vocab_type(g_init_result.model) == LLAMA_VOCAB_TYPE_BPE) {
-                std::cout << "BPE tokenizer detected (typical for modern models)" << std::endl;
+                BITNET_LOG_INFO("BPE tokenizer detected (typical for modern models)");
                 
                 // WASM-specific fix: Override pre-tokenizer configuration dynamically
                 // This addresses the "missing pre-tokenizer type" warning that degrades quality
-                std::cout << "Applying WASM-compatible pre-tokenizer configuration..." << std::endl;
+                BITNET_LOG_INFO("Applying WASM-compatible pre-tokenizer configuration...");
                 
                 // Note: We cannot directly modify the model's vocab after loading through public API
                 // The pre-tokenizer type is set during model loading in llm_load_vocab()
                 // For proper fix, the model needs to be re-exported with correct tokenizer.pre field
                 // This is a limitation of the current GGUF format
                 
-                std::cout << "⚠️ Pre-tokenizer may need manual override in model export process" << std::endl;
-                std::cout << "   Consider setting tokenizer.pre = 'llama3' or 'gpt2' during model conversion" << std::endl;
+                BITNET_LOG_WARN("⚠️ Pre-tokenizer may need manual override in model export process");
+                BITNET_LOG_INFO("   Consider setting tokenizer.pre = 'llama3' or 'gpt2' during model conversion");
             }
             
             // Create context manually with safer parameters for WASM
             llama_context_params ctx_params = common_context_params_to_llama(params);
             
             // Override potentially problematic settings for WASM memory constraints
-            ctx_params.n_ctx = 512;           // Reasonable context for BitNet models
             ctx_params.n_batch = 512;         // Match typical batch size
             ctx_params.n_ubatch = 512;        // Match batch size
-            ctx_params.flash_attn = false;    // Definitely no flash attention
-            ctx_params.type_k = GGML_TYPE_F16; // Keep F16 for BitNet compatibility
-            ctx_params.type_v = GGML_TYPE_F16; // Keep F16 for BitNet compatibility
+            ctx_params.type_k = g_load_config.type_k;
+            ctx_params.type_v = g_load_config.type_v;
+            // llama.cpp only supports a quantized V cache on the flash attention path
+            ctx_params.flash_attn = ggml_is_quantized(ctx_params.type_v);
             ctx_params.logits_all = false;    // Only compute logits when needed
             ctx_params.embeddings = false;    // Don't compute embeddings
             ctx_params.offload_kqv = false;   // No GPU offloading in WASM
+            ctx_params.n_seq_max = g_load_config.n_parallel + 1; // seq 0 plus one per slot
+            ctx_params.cb_eval = bitnet_pager_eval;             // paging and profiling, both opt-in
+            ctx_params.cb_eval_user_data = nullptr;
             // ctx_params.no_kv_offload = true;  // Parameter not available in this version
             
             // WASM-specific memory optimizations
             // ctx_params.mul_mat_q = false;     // Parameter not available in this version
             ctx_params.rope_scaling_type = LLAMA_ROPE_SCALING_TYPE_NONE; // Disable RoPE scaling
             
+            // Size the context from the memory budget up front rather than by
+            // trying ever smaller contexts until one allocates
+            const uint64_t budget = g_load_config.memory_budget > 0 ? g_load_config.memory_budget
+                                                                    : bitnet_memory_default_budget();
+            uint32_t n_ctx_max = g_load_config.n_ctx_max;
+            if (n_ctx_max == 0) {
+                n_ctx_max = llama_n_ctx_train(g_init_result.model) > 0 ? llama_n_ctx_train(g_init_result.model) : 4096;
+            }
+            if (!bitnet_memory_plan_ctx(g_init_result.model, ctx_params, budget, n_ctx_max, g_memory_plan)) {
+                return bitnet_load_fail();
+            }
+            ctx_params.n_ctx = g_memory_plan.n_ctx;
+            
             // Debug context parameters with WASM memory info
-            std::cout << "Context params: n_ctx=" << ctx_params.n_ctx 
+            BITNET_LOG_INFO("Context params: n_ctx=" << ctx_params.n_ctx 
                       << ", n_batch=" << ctx_params.n_batch 
                       << ", n_ubatch=" << ctx_params.n_ubatch 
                       << ", flash_attn=" << ctx_params.flash_attn
-                      << ", type_k=" << ctx_params.type_k
-                      << ", type_v=" << ctx_params.type_v 
-                      << ", logits_all=" << ctx_params.logits_all << std::endl;
-            
-            // Use wllama's proven approach: llama_init_from_model with 1024-step retry
-            std::cout << "Attempting context creation using wllama's proven retry strategy..." << std::endl;
-            
-            g_init_result.context = nullptr;
-            int retry_n_ctx = 4096; // Start with much larger size since retry strategy should work
-            
-            // Implement wllama's exact retry strategy - reduce by 1024 each time
-            for (; retry_n_ctx > 0; retry_n_ctx -= 1024) {
-                ctx_params.n_ctx = retry_n_ctx;
-                
-                std::cout << "Attempting context creation with n_ctx=" << ctx_params.n_ctx << std::endl;
-                
-                // Use llama_new_context_with_model like BitNet fork expects (not llama_init_from_model)
+                      << ", type_k=" << ggml_type_name(ctx_params.type_k)
+                      << ", type_v=" << ggml_type_name(ctx_params.type_v)
+                      << ", logits_all=" << ctx_params.logits_all);
+            
+            // Use llama_new_context_with_model like BitNet fork expects (not llama_init_from_model)
+            g_init_result.context = llama_new_context_with_model(g_init_result.model, ctx_params);
+            
+            // The plan is an estimate; if the allocator still comes up short,
+            // give up a quarter of the context at a time rather than failing
+            while (!g_init_result.context && ctx_params.n_ctx > 512) {
+                ctx_params.n_ctx = std::max(512u, ctx_params.n_ctx * 3 / 4 / 256 * 256);
+                BITNET_LOG_WARN("⚠️ Context creation failed at the planned size; retrying with n_ctx=" << ctx_params.n_ctx);
                 g_init_result.context = llama_new_context_with_model(g_init_result.model, ctx_params);
-                
-                if (g_init_result.context != nullptr) {
-                    std::cout << "✅ Success! Context created with n_ctx=" << ctx_params.n_ctx << std::endl;
-                    break; // Success
-                }
-                
-                std::cout << "Context creation failed with n_ctx=" << ctx_params.n_ctx 
-                         << ", retrying with n_ctx=" << (retry_n_ctx - 1024) << std::endl;
-                
-                if (retry_n_ctx <= 1024) {
-                    // Final attempt with minimal context
-                    ctx_params.n_ctx = 512;
-                    std::cout << "Final attempt with minimal n_ctx=512" << std::endl;
-                    g_init_result.context = llama_new_context_with_model(g_init_result.model, ctx_params);
-                    break;
-                }
             }
             
             if (!g_init_result.context) {
-                std::cerr << "❌ All retry attempts failed. Model too large for WASM memory constraints." << std::endl;
-                std::cerr << "SOLUTION: Use a BitNet-optimized model or increase WASM memory limits." << std::endl;
-                llama_free_model(g_init_result.model);
-                g_init_result.model = nullptr;
-                return 0;
+                BITNET_LOG_ERROR("❌ Context creation failed. Model too large for WASM memory constraints.");
+                BITNET_LOG_ERROR("SOLUTION: Use a BitNet-optimized model, a quantized KV cache or a larger memory budget.");
+                return bitnet_load_fail();
             }
+            g_memory_plan.n_ctx = llama_n_ctx(g_init_result.context);
             
             // Test context by getting some initial state and doing a simple test
             const int ctx_size = llama_n_ctx(g_init_result.context);
-            std::cout << "Context created successfully with size: " << ctx_size << std::endl;
+            BITNET_LOG_INFO("Context created successfully with size: " << ctx_size);
             
             // Test the model with a simple single-token computation to check for immediate issues
-            std::cout << "Testing model computation with a simple token..." << std::endl;
+            BITNET_LOG_INFO("Testing model computation with a simple token...");
             
             // First, let's check if BitNet operations are causing the issue
             // Try disabling BitNet temporarily to see if the base model works
-            std::cout << "Checking BitNet vs base GGML computation..." << std::endl;
+            BITNET_LOG_INFO("Checking BitNet vs base GGML computation...");
             
             // Try a simple BOS token computation
             llama_kv_cache_clear(g_init_result.context);
@@ -337,427 +1286,1149 @@ extern "C" {
             test_batch.logits[0] = true;
             test_batch.n_tokens = 1;
             
-            std::cout << "Attempting decode with BOS token " << bos_token << "..." << std::endl;
+            BITNET_LOG_INFO("Attempting decode with BOS token " << bos_token << "...");
             
             if (llama_decode(g_init_result.context, test_batch)) {
-                std::cerr << "CRITICAL: Failed basic model test with BOS token!" << std::endl;
-                std::cerr << "This suggests an issue with the model file or WASM computation." << std::endl;
+                BITNET_LOG_ERROR("CRITICAL: Failed basic model test with BOS token!");
+                BITNET_LOG_ERROR("This suggests an issue with the model file or WASM computation.");
                 llama_batch_free(test_batch);
                 
                 // Try a different approach - maybe the issue is with BitNet specifically
                 // Let's see if we can load the model without BitNet features
-                std::cerr << "Model decode failed. This could be due to:" << std::endl;
-                std::cerr << "1. BitNet i2_s quantization incompatible with WASM" << std::endl;
-                std::cerr << "2. Model file corruption" << std::endl;
-                std::cerr << "3. Missing/broken BitNet kernel operations" << std::endl;
+                BITNET_LOG_ERROR("Model decode failed. This could be due to:");
+                BITNET_LOG_ERROR("1. BitNet i2_s quantization incompatible with WASM");
+                BITNET_LOG_ERROR("2. Model file corruption");
+                BITNET_LOG_ERROR("3. Missing/broken BitNet kernel operations");
                 
-                llama_free(g_init_result.context);
-                llama_free_model(g_init_result.model);
-                g_init_result.context = nullptr;
-                g_init_result.model = nullptr;
-                return 0;
+                return bitnet_load_fail();
             }
             
             // Check if we get valid logits from this simple test
             float* test_logits = llama_get_logits(g_init_result.context);
             bool test_has_nan = false;
-            std::cout << "Checking logits for NaN/Inf values (WASM numerical precision check)..." << std::endl;
+            BITNET_LOG_INFO("Checking logits for NaN/Inf values (WASM numerical precision check)...");
             
             // WASM-specific numerical precision diagnostics
             bool wasm_precision_issues = false;
             for (int i = 0; i < 10; ++i) {
-                std::cout << "Logit[" << i << "] = " << test_logits[i] << std::endl;
+                BITNET_LOG_DEBUG("Logit[" << i << "] = " << test_logits[i]);
                 
                 // Check for WASM-specific numerical issues
                 if (std::isnan(test_logits[i]) || std::isinf(test_logits[i])) {
                     test_has_nan = true;
-                    std::cerr << "CRITICAL: NaN/Inf detected in WASM at logit " << i 
-                              << " = " << test_logits[i] << std::endl;
+                    BITNET_LOG_ERROR("CRITICAL: NaN/Inf detected in WASM at logit " << i 
+                              << " = " << test_logits[i]);
                     wasm_precision_issues = true;
                 }
                 
                 // Check for extremely small values that might underflow in WASM
                 if (std::abs(test_logits[i]) < 1e-15) {
-                    std::cout << "⚠️ Very small logit value detected (potential WASM underflow): " 
-                              << test_logits[i] << std::endl;
+                    BITNET_LOG_WARN("⚠️ Very small logit value detected (potential WASM underflow): " 
+                              << test_logits[i]);
                 }
                 
                 // Check for suspiciously large values
                 if (std::abs(test_logits[i]) > 100.0f) {
-                    std::cout << "⚠️ Large logit value detected: " << test_logits[i] << std::endl;
+                    BITNET_LOG_WARN("⚠️ Large logit value detected: " << test_logits[i]);
                 }
             }
             
             if (wasm_precision_issues) {
-                std::cerr << "WASM NUMERICAL PRECISION ISSUES DETECTED:" << std::endl;
-                std::cerr << "1. BitNet i2_s (2-bit ternary) quantization may have WASM compatibility issues" << std::endl;
-                std::cerr << "2. Double precision floating point operations differ between WASM and native" << std::endl;
-                std::cerr << "3. BitNet lookup table operations may produce different results in WASM" << std::endl;
-                std::cerr << "POTENTIAL SOLUTIONS:" << std::endl;
-                std::cerr << "a) Use a different quantization format (e.g., q4_0, q8_0)" << std::endl;
-                std::cerr << "b) Re-export model with WASM-compatible quantization" << std::endl;
-                std::cerr << "c) Force single-precision operations in BitNet kernels" << std::endl;
+                BITNET_LOG_ERROR("WASM NUMERICAL PRECISION ISSUES DETECTED:");
+                BITNET_LOG_ERROR("1. BitNet i2_s (2-bit ternary) quantization may have WASM compatibility issues");
+                BITNET_LOG_ERROR("2. Double precision floating point operations differ between WASM and native");
+                BITNET_LOG_ERROR("3. BitNet lookup table operations may produce different results in WASM");
+                BITNET_LOG_ERROR("POTENTIAL SOLUTIONS:");
+                BITNET_LOG_ERROR("a) Use a different quantization format (e.g., q4_0, q8_0)");
+                BITNET_LOG_ERROR("b) Re-export model with WASM-compatible quantization");
+                BITNET_LOG_ERROR("c) Force single-precision operations in BitNet kernels");
                 
                 // Don't fail completely - continue for diagnostics
-                std::cerr << "CONTINUING despite numerical issues for further diagnostics..." << std::endl;
+                BITNET_LOG_ERROR("CONTINUING despite numerical issues for further diagnostics...");
             }
             
             llama_batch_free(test_batch);
             
             if (test_has_nan) {
-                std::cerr << "CRITICAL: Model produces NaN logits!" << std::endl;
-                std::cerr << "POSSIBLE SOLUTIONS:" << std::endl;
-                std::cerr << "1. Use a different model format (not i2_s quantized)" << std::endl;
-                std::cerr << "2. Check BitNet kernel implementation for WASM compatibility" << std::endl;
-                std::cerr << "3. Verify model file integrity" << std::endl;
+                BITNET_LOG_ERROR("CRITICAL: Model produces NaN logits!");
+                BITNET_LOG_ERROR("POSSIBLE SOLUTIONS:");
+                BITNET_LOG_ERROR("1. Use a different model format (not i2_s quantized)");
+                BITNET_LOG_ERROR("2. Check BitNet kernel implementation for WASM compatibility");
+                BITNET_LOG_ERROR("3. Verify model file integrity");
                 
                 // Don't fail completely - let's continue and see if we can work around it
-                std::cerr << "CONTINUING despite NaN logits to gather more diagnostic info..." << std::endl;
+                BITNET_LOG_ERROR("CONTINUING despite NaN logits to gather more diagnostic info...");
             }
             
-            std::cout << "✓ Basic model test passed - logits are valid" << std::endl;
+            BITNET_LOG_INFO("✓ Basic model test passed - logits are valid");
+            
+            // Start generation from an empty cache rather than the test token
+            bitnet_kv_reset();
             
-            // Create sampler using the common sampler - this uses real neural net sampling
-            g_sampler = common_sampler_init(g_init_result.model, params.sparams);
+            // Fused sampler matching the common_sampler chain for these params
+            g_sampler_params = params.sparams;
+            g_sampler = bitnet_sampler_init(g_init_result.model, params.sparams);
             
             if (!g_sampler) {
-                std::cerr << "Failed to create sampler" << std::endl;
-                llama_free(g_init_result.context);
-                llama_free_model(g_init_result.model);
-                g_init_result.context = nullptr;
-                g_init_result.model = nullptr;
+                BITNET_LOG_ERROR("Failed to create sampler");
+                return bitnet_load_fail();
+            }
+            
+            // Per-context buffers are sized once here so the decode loop never
+            // allocates: the shared batch, the token histories (one slot per
+            // context position) and the piece scratch
+            const size_t n_ctx = llama_n_ctx(g_init_result.context);
+            bitnet_batch_free();
+            g_batch = llama_batch_init(llama_n_batch(g_init_result.context), 0, 1);
+            g_kv_tokens.reserve(n_ctx);
+            g_gen.tokens.reserve(n_ctx);
+            g_gen.piece.reserve(256);
+            g_gen.pending.reserve(8);
+            g_draft.reserve(llama_n_batch(g_init_result.context));
+            g_spec_weights.reserve(std::max(1, params.sparams.top_k));
+            
+            if (!bitnet_vocab_build(g_init_result.model)) {
+                BITNET_LOG_WARN("⚠️ Failed to build the vocabulary piece table");
+            }
+            
+            // Parallel slots get their own samplers up front so starting a
+            // sequence never allocates one
+            bitnet_slots_free();
+            if (g_load_config.n_parallel > 0) {
+                g_slots.resize(g_load_config.n_parallel);
+                for (bitnet_slot& slot : g_slots) {
+                    slot.sampler = bitnet_sampler_init(g_init_result.model, params.sparams);
+                    slot.gen.tokens.reserve(n_ctx);
+                    slot.gen.pending.reserve(8);
+                    slot.output.reserve(4096);
+                    slot.taken.reserve(4096);
+                }
+            }
+            
+            BITNET_LOG_INFO("[bitnet_load_model] Model loaded successfully using real llama.cpp");
+            BITNET_LOG_INFO("  - Vocab size: " << llama_n_vocab(g_init_result.model));
+            BITNET_LOG_INFO("  - Context size: " << llama_n_ctx(g_init_result.context));
+            BITNET_LOG_INFO("  - Embedding size: " << llama_n_embd(g_init_result.model));
+            BITNET_LOG_INFO("  - Threads: " << params.cpuparams.n_threads);
+            
+            return 1;
+            
+        } catch (const std::exception& e) {
+            BITNET_LOG_ERROR("[bitnet_load_model_from_file] Exception: " << e.what());
+            return bitnet_load_fail();
+        }
+    }
+    
+    // Load model from a buffer in the WASM heap. Kept for callers that already
+    // copied the model into the heap: the bytes are spilled to MEMFS and loaded
+    // from there, and the MEMFS copy is dropped as soon as loading finishes.
+    // While llama.cpp loads, the caller's buffer, the MEMFS file and the tensor
+    // buffers all exist, so memory peaks at three times the model size (four
+    // if the caller still holds the download). Prefer the streamed load
+    // (bitnet_load_begin/feed/end) or FS.writeFile with canOwn followed by
+    // bitnet_load_model_from_file, which peak at about twice the model size.
+    __attribute__((visibility("default"))) EMSCRIPTEN_KEEPALIVE int bitnet_load_model(const uint8_t* data, size_t size) {
+        if (!g_initialized) {
+            bitnet_init();
+        }
+        
+        BITNET_LOG_INFO("[bitnet_load_model] Loading model (" << size << " bytes)");
+        
+        // Write data to temporary file (in WASM, this will be in memory filesystem)
+        const char* temp_path = "/tmp/model.gguf";
+        {
+            std::ofstream file(temp_path, std::ios::binary);
+            if (!file) {
+                BITNET_LOG_ERROR("Failed to create temporary model file");
                 return 0;
             }
             
-            std::cout << "[bitnet_load_model] Model loaded successfully using real llama.cpp" << std::endl;
-            std::cout << "  - Vocab size: " << llama_n_vocab(g_init_result.model) << std::endl;
-            std::cout << "  - Context size: " << llama_n_ctx(g_init_result.context) << std::endl;
-            std::cout << "  - Embedding size: " << llama_n_embd(g_init_result.model) << std::endl;
+            // Write in chunks to avoid memory issues in WASM
+            const size_t chunk_size = 1024 * 1024; // 1MB chunks
+            size_t written = 0;
+            while (written < size) {
+                size_t current_chunk = std::min(chunk_size, size - written);
+                file.write(reinterpret_cast<const char*>(data + written), current_chunk);
+                written += current_chunk;
+            }
+            
+            if (!file) {
+                BITNET_LOG_ERROR("Failed to write temporary model file");
+                std::remove(temp_path);
+                return 0;
+            }
+        }
+        
+        bitnet_file_hasher hasher;
+        hasher.update(data, size);
+        g_pending_model_hash = hasher.digest();
+        const int result = bitnet_load_model_from_file(temp_path);
+        
+        // Tensors now live in llama.cpp buffers; the file copy is dead weight
+        std::remove(temp_path);
+        
+        return result;
+    }
+    
+    // Start a streamed model load. expected_size may be 0 if unknown; when
+    // given, the MEMFS file is sized once up front so it never reallocates.
+    // Known limitation: that file and the loaded model coexist while
+    // bitnet_load_end runs, so budget for twice the model size.
+    __attribute__((visibility("default"))) EMSCRIPTEN_KEEPALIVE int bitnet_load_begin(size_t expected_size) {
+        if (!g_initialized) {
+            bitnet_init();
+        }
+        
+        bitnet_load_stream_reset(true);
+        g_model = BitNetModel();
+        
+        g_load_stream.file = std::fopen(BITNET_STREAM_PATH, "w+b");
+        if (!g_load_stream.file) {
+            BITNET_LOG_ERROR("[bitnet_load_begin] Failed to create " << BITNET_STREAM_PATH);
+            return 0;
+        }
+        
+        if (expected_size > 0 && ftruncate(fileno(g_load_stream.file), static_cast<off_t>(expected_size)) != 0) {
+            BITNET_LOG_ERROR("[bitnet_load_begin] Failed to reserve " << expected_size << " bytes");
+            bitnet_load_stream_reset(true);
+            return 0;
+        }
+        g_load_stream.expected = expected_size;
+        
+        BITNET_LOG_INFO("[bitnet_load_begin] Streaming model load started (" << expected_size << " bytes expected)");
+        return 1;
+    }
+    
+    // Append the next chunk of the model file. The GGUF header is parsed as soon
+    // as enough bytes have arrived, so a bad file fails on the first chunks.
+    __attribute__((visibility("default"))) EMSCRIPTEN_KEEPALIVE int bitnet_load_feed(const uint8_t* data, size_t len) {
+        if (!g_load_stream.file) {
+            BITNET_LOG_ERROR("[bitnet_load_feed] No streamed load in progress");
+            return 0;
+        }
+        
+        try {
+            if (std::fwrite(data, 1, len, g_load_stream.file) != len) {
+                BITNET_LOG_ERROR("[bitnet_load_feed] Write failed at offset " << g_load_stream.received);
+                bitnet_load_stream_reset(true);
+                return 0;
+            }
+            g_load_stream.received += len;
+            g_load_stream.hasher.update(data, len);
+            
+            if (!g_load_stream.header_ready) {
+                g_load_stream.header.insert(g_load_stream.header.end(), data, data + len);
+                
+                const int status = bitnet_load_stream_parse(false);
+                if (status < 0 || (status == 0 && g_load_stream.header.size() > BITNET_MAX_HEADER_BYTES)) {
+                    BITNET_LOG_ERROR("[bitnet_load_feed] Not a valid GGUF model");
+                    bitnet_load_stream_reset(true);
+                    return 0;
+                }
+            }
             
             return 1;
+        } catch (const std::exception& e) {
+            BITNET_LOG_ERROR("[bitnet_load_feed] Exception: " << e.what());
+            bitnet_load_stream_reset(true);
+            return 0;
+        }
+    }
+    
+    // 1 once the GGUF header has been parsed; model metadata is valid from then on
+    __attribute__((visibility("default"))) EMSCRIPTEN_KEEPALIVE int bitnet_load_header_ready() {
+        return g_load_stream.header_ready ? 1 : 0;
+    }
+    
+    // Finish a streamed load: build the model from the received file, then
+    // drop the file so only the tensor buffers remain resident
+    __attribute__((visibility("default"))) EMSCRIPTEN_KEEPALIVE int bitnet_load_end() {
+        if (!g_load_stream.file) {
+            BITNET_LOG_ERROR("[bitnet_load_end] No streamed load in progress");
+            return 0;
+        }
+        
+        try {
+            if (!g_load_stream.header_ready && bitnet_load_stream_parse(true) != 1) {
+                BITNET_LOG_ERROR("[bitnet_load_end] Stream ended before the GGUF header was complete");
+                bitnet_load_stream_reset(true);
+                return 0;
+            }
             
+            if (g_load_stream.expected > 0 && g_load_stream.received != g_load_stream.expected) {
+                BITNET_LOG_ERROR("[bitnet_load_end] Truncated stream: received " << g_load_stream.received
+                          << " of " << g_load_stream.expected << " bytes");
+                bitnet_load_stream_reset(true);
+                return 0;
+            }
+            
+            fclose(g_load_stream.file);
+            g_load_stream.file = nullptr;
+            
+            g_pending_model_hash = g_load_stream.hasher.digest();
+            const int result = bitnet_load_model_from_file(BITNET_STREAM_PATH);
+            bitnet_load_stream_reset(true);
+            return result;
         } catch (const std::exception& e) {
-            std::cerr << "[bitnet_load_model] Exception: " << e.what() << std::endl;
+            BITNET_LOG_ERROR("[bitnet_load_end] Exception: " << e.what());
+            bitnet_load_stream_reset(true);
+            return 0;
+        }
+    }
+    
+    // Abandon a streamed load (e.g. the download was cancelled)
+    __attribute__((visibility("default"))) EMSCRIPTEN_KEEPALIVE void bitnet_load_abort() {
+        bitnet_load_stream_reset(true);
+    }
+    
+    // Simplified load model function that takes memory pointers using ccall
+    __attribute__((visibility("default"))) EMSCRIPTEN_KEEPALIVE int bitnet_load_model_from_memory(uintptr_t data_ptr, size_t size) {
+        return bitnet_load_model(reinterpret_cast<const uint8_t*>(data_ptr), size);
+    }
+    
+    // Start a step-wise generation: tokenize and prefill the prompt, then call
+    // bitnet_generate_next() once per token. Returns the number of prompt tokens,
+    // or 0 on failure. max_new_tokens <= 0 selects the default (32). grammar
+    // constrains the output to a compiled grammar (a handle from
+    // bitnet_grammar_compile*, 0 = unconstrained); generation then ends once
+    // the grammar allows nothing but end-of-text.
+    __attribute__((visibility("default"))) EMSCRIPTEN_KEEPALIVE int bitnet_generate_begin_grammar(const char* input_text, int max_new_tokens, int grammar) {
+        bitnet_generation_reset(g_gen);
+        
+        if (!g_init_result.model || !g_init_result.context || !g_sampler) {
+            BITNET_LOG_ERROR("[bitnet_generate_begin] Model not loaded");
+            return 0;
+        }
+        if (grammar != 0 && !bitnet_grammar_valid(grammar)) {
+            BITNET_LOG_ERROR("[bitnet_generate_begin] Unknown grammar handle " << grammar);
             return 0;
         }
+        
+        BITNET_LOG_DEBUG("[bitnet_generate_begin] Running inference on: \"" << input_text << "\"");
+        
+        try {
+            // Tokenize straight into the generation's history buffer
+            std::vector<llama_token>& input_tokens = g_gen.tokens;
+            if (!bitnet_tokenize_prompt(input_text, input_tokens) || !bitnet_ctx_fit_prompt(input_tokens)) {
+                return 0;
+            }
+            
+            g_stats = bitnet_perf_stats();
+            if (!g_sampler_restored) {
+                bitnet_sampler_reset(g_sampler);
+            }
+            g_sampler_restored = false;
+            bitnet_draft_reset();
+            
+            // Keep the longest prefix the KV cache already holds (shared system
+            // prompt, earlier chat turns) and drop only the diverging tail. At
+            // least one token is always re-decoded to get fresh logits.
+            size_t n_reuse = 0;
+            while (n_reuse < g_kv_tokens.size() && n_reuse < input_tokens.size() &&
+                   g_kv_tokens[n_reuse] == input_tokens[n_reuse]) {
+                n_reuse++;
+            }
+            if (n_reuse == input_tokens.size() && n_reuse > 0) {
+                n_reuse--;
+            }
+            
+            if (llama_kv_cache_seq_rm(g_init_result.context, 0, static_cast<llama_pos>(n_reuse), -1)) {
+                g_kv_tokens.resize(n_reuse);
+            } else {
+                bitnet_kv_reset();
+                n_reuse = 0;
+            }
+            
+            // Decode the prompt in n_ubatch-sized batches so the matmuls run as
+            // GEMM over the whole chunk; only the last position needs logits
+            BITNET_LOG_INFO("[bitnet_generate_begin] Prefilling " << (input_tokens.size() - n_reuse) << " prompt tokens ("
+                      << n_reuse << " reused from KV cache)...");
+            
+            if (!bitnet_prefill(input_tokens.data() + n_reuse, static_cast<int>(input_tokens.size() - n_reuse),
+                                static_cast<int>(n_reuse))) {
+                return 0;
+            }
+            g_stats.n_prompt_reused = static_cast<int>(n_reuse);
+            
+            // Check the logits for NaN/Inf
+            const float* prompt_logits = llama_get_logits(g_init_result.context);
+            for (int j = 0; j < 3; ++j) {
+                if (std::isnan(prompt_logits[j]) || std::isinf(prompt_logits[j])) {
+                    BITNET_LOG_WARN("⚠️ NaN/Inf detected after prompt prefill at logit " << j 
+                              << " = " << prompt_logits[j]);
+                    break;
+                }
+            }
+            
+            BITNET_LOG_INFO("[bitnet_generate_begin] Prefill: " << g_stats.n_prompt_tokens << " tokens in "
+                      << g_stats.prefill_ms << " ms (" << bitnet_stats_prefill_tps() << " tok/s)");
+            
+#if BITNET_LOG_LEVEL >= BITNET_LOG_LEVEL_DEBUG
+            // Debug: Print a few top logits to understand what the model is predicting
+            const int vocab_size = llama_n_vocab(g_init_result.model);
+            BITNET_LOG_DEBUG("[bitnet_generate_begin] Sample logits after input processing:");
+            
+            // Find top 10 tokens by logit value for debugging; only those are ordered
+            std::vector<std::pair<float, llama_token>> logit_pairs(vocab_size);
+            for (int i = 0; i < vocab_size; ++i) {
+                logit_pairs[i] = {prompt_logits[i], i};
+            }
+            const int n_top = std::min(10, vocab_size);
+            std::partial_sort(logit_pairs.begin(), logit_pairs.begin() + n_top, logit_pairs.end(),
+                              std::greater<std::pair<float, llama_token>>());
+            
+            for (int i = 0; i < n_top; ++i) {
+                llama_token token_id = logit_pairs[i].second;
+                float logit_val = logit_pairs[i].first;
+                size_t n_piece = 0;
+                const char* piece = bitnet_vocab_piece(token_id, &n_piece);
+                BITNET_LOG_DEBUG("  Top " << (i+1) << ": token=" << token_id 
+                         << " logit=" << logit_val << " text='" << std::string(piece, n_piece) << "'");
+            }
+#endif
+            
+            g_gen.n_prompt = g_gen.tokens.size();
+            g_gen.max_new_tokens = max_new_tokens > 0 ? max_new_tokens : BITNET_DEFAULT_MAX_NEW_TOKENS;
+            g_gen.grammar = grammar;
+            g_gen.grammar_state = bitnet_grammar_initial_state(grammar);
+            g_gen.done = false;
+            
+            BITNET_LOG_INFO("[bitnet_generate_begin] Starting generation (max " << g_gen.max_new_tokens << " tokens)...");
+            
+            return static_cast<int>(g_gen.n_prompt);
+            
+        } catch (const std::exception& e) {
+            BITNET_LOG_ERROR("[bitnet_generate_begin] Exception: " << e.what());
+            return 0;
+        }
+    }
+    
+    __attribute__((visibility("default"))) EMSCRIPTEN_KEEPALIVE int bitnet_generate_begin(const char* input_text, int max_new_tokens) {
+        return bitnet_generate_begin_grammar(input_text, max_new_tokens, 0);
+    }
+    
+    // Produce the next token of the generation started by bitnet_generate_begin.
+    // Returns its text (valid until the next call), or NULL once generation has
+    // finished. With lookup decoding one call can emit several tokens. Text is cut on UTF-8 boundaries: a token that ends mid-sequence
+    // returns only the complete part (possibly an empty string) and the rest
+    // arrives with a later token. Callers should keep calling until NULL.
+    __attribute__((visibility("default"))) EMSCRIPTEN_KEEPALIVE const char* bitnet_generate_next() {
+        if (g_gen.done) {
+            return nullptr;
+        }
+        if (bitnet_cancel_requested()) {
+            BITNET_LOG_INFO("[bitnet_generate_next] Cancelled after " << g_gen.n_generated << " new tokens");
+            g_gen.done = true;
+            return nullptr;
+        }
+        
+        try {
+            if (!bitnet_generate_step()) {
+                g_gen.done = true;
+                BITNET_LOG_INFO("[bitnet_generate_next] Generated " << g_gen.n_generated << " new tokens");
+                // Flush a partial sequence no later token will complete
+                if (g_gen.pending.empty()) {
+                    return nullptr;
+                }
+                g_gen.piece.swap(g_gen.pending);
+                g_gen.pending.clear();
+            }
+        } catch (const std::exception& e) {
+            BITNET_LOG_ERROR("[bitnet_generate_next] Exception: " << e.what());
+            g_gen.done = true;
+            return nullptr;
+        }
+        
+        return g_gen.piece.c_str();
+    }
+    
+    // Stop the running generation: prefill ends after its current chunk, and
+    // bitnet_generate_next returns NULL from its next call. The request stays
+    // in force, failing later generations too, until bitnet_cancel_clear.
+    __attribute__((visibility("default"))) EMSCRIPTEN_KEEPALIVE void bitnet_cancel() {
+        g_cancel.store(-1, std::memory_order_relaxed);
+    }
+    
+    // Withdraw a cancel request. Call it before starting a request that may
+    // be cancelled, not after: a cancel issued in between would be lost.
+    __attribute__((visibility("default"))) EMSCRIPTEN_KEEPALIVE void bitnet_cancel_clear() {
+        g_cancel.store(0, std::memory_order_relaxed);
+    }
+    
+    // Withdraw any cancel request and tag the flag with request_id (> 0), the
+    // request about to start. A host sharing the heap then cancels it with
+    // Atomics.compareExchange(flag, 0, request_id, -1), which does nothing
+    // once a later request has been armed.
+    __attribute__((visibility("default"))) EMSCRIPTEN_KEEPALIVE void bitnet_cancel_arm(int32_t request_id) {
+        g_cancel.store(std::max<int32_t>(0, request_id), std::memory_order_relaxed);
+    }
+    
+    // Heap address of the int32 cancel flag, for hosts that share the heap
+    // with the thread running inference (see bitnet_cancel_arm)
+    __attribute__((visibility("default"))) EMSCRIPTEN_KEEPALIVE uintptr_t bitnet_cancel_flag_ptr() {
+        return reinterpret_cast<uintptr_t>(&g_cancel);
+    }
+    
+    __attribute__((visibility("default"))) EMSCRIPTEN_KEEPALIVE int bitnet_generate_is_done() {
+        return g_gen.done ? 1 : 0;
+    }
+    
+    // Id of the most recently generated token (or -1), for piece table lookups
+    __attribute__((visibility("default"))) EMSCRIPTEN_KEEPALIVE int bitnet_generate_last_token() {
+        return g_gen.n_generated > 0 ? g_gen.last_token : LLAMA_TOKEN_NULL;
     }
     
-    // Simplified load model function that takes memory pointers using ccall
-    __attribute__((visibility("default"))) EMSCRIPTEN_KEEPALIVE int bitnet_load_model_from_memory(uintptr_t data_ptr, size_t size) {
-        return bitnet_load_model(reinterpret_cast<const uint8_t*>(data_ptr), size);
+    // Forget the cached prompt prefix so the next call starts from an empty KV cache
+    __attribute__((visibility("default"))) EMSCRIPTEN_KEEPALIVE void bitnet_kv_cache_clear() {
+        bitnet_kv_reset();
     }
     
     // Run inference using the real llama.cpp pipeline with BitNet
     __attribute__((visibility("default"))) EMSCRIPTEN_KEEPALIVE int bitnet_inference_run(const char* input_text, char* output_buffer, int max_output_len) {
-        if (!g_init_result.model || !g_init_result.context || !g_sampler) {
-            std::cerr << "[bitnet_inference_run] Model not loaded" << std::endl;
+        if (!bitnet_generate_begin(input_text, BITNET_DEFAULT_MAX_NEW_TOKENS)) {
             return 0;
         }
         
-        std::cout << "[bitnet_inference_run] Running inference on: \"" << input_text << "\"" << std::endl;
+        // Pieces are appended straight into the caller's buffer
+        int copy_len = 0;
+        while (const char* piece = bitnet_generate_next()) {
+            const int n = std::min(static_cast<int>(g_gen.piece.size()), max_output_len - 1 - copy_len);
+            std::memcpy(output_buffer + copy_len, piece, n);
+            copy_len += n;
+        }
+        
+        if (g_gen.n_generated == 0) {
+            BITNET_LOG_INFO("[bitnet_inference_run] No new tokens generated");
+            static const char no_output[] = "[No output generated]";
+            copy_len = std::min(static_cast<int>(sizeof(no_output) - 1), max_output_len - 1);
+            std::memcpy(output_buffer, no_output, copy_len);
+        }
+        output_buffer[copy_len] = '\0';
+        
+        BITNET_LOG_DEBUG("[bitnet_inference_run] Complete output: \"" << output_buffer << "\"");
         
+        return copy_len;
+    }
+    
+    // Simplified inference function that returns the generated text
+    __attribute__((visibility("default"))) EMSCRIPTEN_KEEPALIVE const char* bitnet_run_inference_simple(const char* input_text, int max_tokens) {
+        static std::string result;
+        result.clear();
+        
+        if (!bitnet_generate_begin(input_text, max_tokens)) {
+            return "";
+        }
+        while (const char* piece = bitnet_generate_next()) {
+            result += piece;
+        }
+        return result.c_str();
+    }
+    
+    // Number of concurrent sequences the bitnet_seq_* API serves. Takes effect
+    // on the next model load; 0 (the default) disables the API.
+    __attribute__((visibility("default"))) EMSCRIPTEN_KEEPALIVE void bitnet_set_n_parallel(int n_parallel) {
+        g_load_config.n_parallel = std::max(0, n_parallel);
+    }
+
+    // KV cache types as ggml_type ids: 1 (F16, the default), 8 (Q8_0) or
+    // 2 (Q4_0). Q8_0 halves the cache and Q4_0 cuts it to under a third, so
+    // the same memory budget plans a proportionally longer context. A
+    // quantized V cache runs attention on the flash attention path. Takes
+    // effect on the next model load; returns 0 for an unsupported type.
+    __attribute__((visibility("default"))) EMSCRIPTEN_KEEPALIVE int bitnet_set_kv_cache_type(int type_k, int type_v) {
+        auto supported = [](int type) {
+            return type == GGML_TYPE_F16 || type == GGML_TYPE_Q8_0 || type == GGML_TYPE_Q4_0;
+        };
+        if (!supported(type_k) || !supported(type_v)) {
+            BITNET_LOG_ERROR("[bitnet_set_kv_cache_type] Unsupported KV cache type " << type_k << "/" << type_v);
+            return 0;
+        }
+        g_load_config.type_k = static_cast<ggml_type>(type_k);
+        g_load_config.type_v = static_cast<ggml_type>(type_v);
+        return 1;
+    }
+
+    // Memory the model and its context may use in total, in MiB (0 = the wasm
+    // heap limit, unlimited natively), and the largest context to plan for
+    // (0 = the model's training context). The next load picks the largest
+    // n_ctx whose weights, KV cache and compute buffers fit the budget.
+    __attribute__((visibility("default"))) EMSCRIPTEN_KEEPALIVE void bitnet_set_memory_budget(int budget_mb, int n_ctx_max) {
+        g_load_config.memory_budget = static_cast<uint64_t>(std::max(0, budget_mb)) << 20;
+        g_load_config.n_ctx_max = static_cast<uint32_t>(std::max(0, n_ctx_max));
+    }
+
+    // Page per-layer weights through a pool of n_slots layers (at least 2)
+    // instead of keeping the whole model resident; 0 turns paging off. Applies
+    // from the next load, and only in native builds, where the model file is
+    // mapped rather than copied into the heap. Returns 1 if paging is available.
+    __attribute__((visibility("default"))) EMSCRIPTEN_KEEPALIVE int bitnet_set_paging(int n_slots) {
+        g_load_config.paging_slots = std::max(0, n_slots);
+#ifdef __EMSCRIPTEN__
+        return 0;
+#else
+        return 1;
+#endif
+    }
+    
+    // Paging pool and traffic since the model was loaded, as JSON
+    __attribute__((visibility("default"))) EMSCRIPTEN_KEEPALIVE const char* bitnet_get_paging_stats() {
+        static std::string stats_json;
+        const bitnet_pager_stats& stats = bitnet_pager_get_stats();
+        char buf[512];
+        snprintf(buf, sizeof(buf),
+                 "{\"active\":%s,\"layers\":%d,\"slots\":%d,\"slot_bytes\":%llu,\"resident_bytes\":%llu,"
+                 "\"loads\":%llu,\"prefetch_hits\":%llu,\"bytes_read\":%llu,\"wait_ms\":%.3f}",
+                 bitnet_pager_active() ? "true" : "false", stats.n_layers, stats.n_slots,
+                 static_cast<unsigned long long>(stats.slot_bytes),
+                 static_cast<unsigned long long>(stats.resident_bytes),
+                 static_cast<unsigned long long>(stats.loads),
+                 static_cast<unsigned long long>(stats.prefetch_hits),
+                 static_cast<unsigned long long>(stats.bytes_read), stats.wait_ms);
+        stats_json = buf;
+        return stats_json.c_str();
+    }
+
+    // How the current context was sized, as JSON (byte counts)
+    __attribute__((visibility("default"))) EMSCRIPTEN_KEEPALIVE const char* bitnet_get_memory_plan() {
+        static std::string plan_json;
+        char buf[512];
+        snprintf(buf, sizeof(buf),
+                 "{\"n_ctx\":%u,\"type_k\":\"%s\",\"type_v\":\"%s\",\"budget_bytes\":%llu,\"weight_bytes\":%llu,"
+                 "\"kv_bytes\":%llu,\"compute_bytes\":%llu,\"reserve_bytes\":%llu}",
+                 g_memory_plan.n_ctx, ggml_type_name(g_memory_plan.type_k), ggml_type_name(g_memory_plan.type_v),
+                 static_cast<unsigned long long>(g_memory_plan.budget_bytes),
+                 static_cast<unsigned long long>(g_memory_plan.weight_bytes),
+                 static_cast<unsigned long long>(g_memory_plan.kv_bytes),
+                 static_cast<unsigned long long>(g_memory_plan.compute_bytes),
+                 static_cast<unsigned long long>(g_memory_plan.reserve_bytes));
+        plan_json = buf;
+        return plan_json.c_str();
+    }
+
+    // Decoding mode of bitnet_generate_*: n_draft < 0 samples with the
+    // configured sampler (default), 0 decodes greedily one token per step,
+    // and n_draft > 0 decodes greedily while drafting up to n_draft tokens by
+    // prompt lookup (suffixes of up to ngram_size tokens, default 3) and
+    // verifying them in one batch. Greedy output is the same with and without
+    // drafting. Takes effect at the next step.
+    __attribute__((visibility("default"))) EMSCRIPTEN_KEEPALIVE void bitnet_set_lookup_decoding(int n_draft, int ngram_size) {
+        g_lookup.n_draft = std::max(-1, n_draft);
+        g_lookup.ngram_max = ngram_size > 0 ? ngram_size : 3;
+    }
+    
+    // Sliding-window context for bitnet_generate_*: with enabled != 0 (the
+    // default) a full context keeps its first n_keep tokens, drops the oldest
+    // half of the rest and carries on; a prompt too long for the context is
+    // cut the same way. Set n_keep to the system prompt's token count to pin
+    // it. With enabled == 0 generation stops when the context is full.
+    __attribute__((visibility("default"))) EMSCRIPTEN_KEEPALIVE void bitnet_set_context_shift(int enabled, int n_keep) {
+        g_ctx_shift.enabled = enabled != 0;
+        g_ctx_shift.n_keep = std::max(0, n_keep);
+    }
+    
+    // Load a small draft model that shares the target's vocabulary, for
+    // speculative decoding. Load the target first; freeing or reloading the
+    // target drops the draft. Returns 1 on success.
+    __attribute__((visibility("default"))) EMSCRIPTEN_KEEPALIVE int bitnet_draft_load_from_file(const char* path) {
+        if (!g_init_result.model || !g_init_result.context) {
+            BITNET_LOG_ERROR("[bitnet_draft_load_from_file] Load the target model first");
+            return 0;
+        }
         try {
-            // Tokenize input using real llama.cpp with proper BOS handling
-            const int max_tokens = 2048;
-            std::vector<llama_token> input_tokens(max_tokens);
-            
-            // Get BOS token for proper tokenization
-            const llama_token bos_token = llama_token_bos(g_init_result.model);
-            const bool add_bos = (bos_token != LLAMA_TOKEN_NULL);
-            
-            const int n_tokens = llama_tokenize(g_init_result.model, input_text, strlen(input_text), 
-                                              input_tokens.data(), max_tokens, add_bos, true);
-            if (n_tokens < 0) {
-                std::cerr << "Failed to tokenize input" << std::endl;
+            return bitnet_draft_load(path, g_init_result.model, g_init_result.context, g_sampler_params,
+                                     llama_n_threads(g_init_result.context)) ? 1 : 0;
+        } catch (const std::exception& e) {
+            BITNET_LOG_ERROR("[bitnet_draft_load_from_file] Exception: " << e.what());
+            bitnet_draft_free();
+            return 0;
+        }
+    }
+    
+    __attribute__((visibility("default"))) EMSCRIPTEN_KEEPALIVE int bitnet_draft_load_from_memory(uintptr_t data_ptr, size_t size) {
+        const char* temp_path = "/tmp/draft.gguf";
+        {
+            std::ofstream file(temp_path, std::ios::binary);
+            file.write(reinterpret_cast<const char*>(data_ptr), size);
+            if (!file) {
+                BITNET_LOG_ERROR("[bitnet_draft_load_from_memory] Failed to write temporary draft model file");
                 return 0;
             }
-            input_tokens.resize(n_tokens);
-            std::cout << "[bitnet_inference_run] Input tokens: " << input_tokens.size();
-            if (add_bos) std::cout << " (includes BOS)";
-            std::cout << " BOS token: " << bos_token << std::endl;
-            
-            // Debug: Print all tokens immediately after tokenization
-            std::cout << "All tokens after tokenization:" << std::endl;
-            for (int i = 0; i < n_tokens; ++i) {
-                std::vector<char> debug_piece(256);
-                const int debug_n_piece = llama_token_to_piece(g_init_result.model, input_tokens[i], 
-                                                             debug_piece.data(), debug_piece.size(), 0, true);
-                std::string debug_text(debug_piece.data(), debug_n_piece > 0 ? debug_n_piece : 0);
-                std::cout << "  Token " << i << ": " << input_tokens[i] << " = '" << debug_text << "'" << std::endl;
-                
-                // Check for problematic tokens immediately
-                if (input_tokens[i] == 0 && i > 0) {  // Token 0 is often problematic if not BOS
-                    std::cerr << "⚠️ WARNING: Token ID 0 detected at position " << i << " (not BOS position)" << std::endl;
-                    std::cerr << "This might be an EOS token or invalid token that could cause NaN." << std::endl;
-                    
-                    // Remove the problematic token
-                    std::cerr << "Removing problematic token and continuing..." << std::endl;
-                    input_tokens.erase(input_tokens.begin() + i);
-                    std::cout << "New token count: " << input_tokens.size() << std::endl;
-                    break;
-                }
+        }
+        const int ok = bitnet_draft_load_from_file(temp_path);
+        std::remove(temp_path);
+        return ok;
+    }
+    
+    __attribute__((visibility("default"))) EMSCRIPTEN_KEEPALIVE void bitnet_draft_unload() {
+        bitnet_draft_free();
+    }
+    
+    // Speculative decoding with the loaded draft model: up to n_draft_max
+    // proposals per target pass (the actual length adapts to the acceptance
+    // rate), 0 to disable. Sampling stays exact. Lookup decoding, when
+    // enabled, takes precedence.
+    __attribute__((visibility("default"))) EMSCRIPTEN_KEEPALIVE void bitnet_set_draft_decoding(int n_draft_max) {
+        g_spec_n_draft_max = std::max(0, n_draft_max);
+    }
+
+    // Embed n_texts strings (an array of n_texts UTF-8 string pointers) in as
+    // few batches as possible. pooling is 1 (mean) or 3 (last token). Writes
+    // n_texts rows of bitnet_get_embedding_dim() L2-normalized floats to out.
+    // The first call creates a separate embedding context; the generation KV
+    // cache is not touched. Returns the number of texts embedded, -1 on error.
+    __attribute__((visibility("default"))) EMSCRIPTEN_KEEPALIVE int bitnet_embed(const char* const* texts, int n_texts, int pooling, float* out) {
+        if (!g_init_result.model || !g_init_result.context) {
+            BITNET_LOG_ERROR("[bitnet_embed] Model not loaded");
+            return -1;
+        }
+        if (pooling != LLAMA_POOLING_TYPE_MEAN && pooling != LLAMA_POOLING_TYPE_LAST) {
+            BITNET_LOG_ERROR("[bitnet_embed] Unsupported pooling type " << pooling);
+            return -1;
+        }
+        try {
+            if (!bitnet_embed_init(g_init_result.model, static_cast<enum llama_pooling_type>(pooling),
+                                   llama_n_batch(g_init_result.context), llama_n_threads(g_init_result.context))) {
+                return -1;
             }
-            
-            // Clear the KV cache and reset sampler
-            llama_kv_cache_clear(g_init_result.context);
-            common_sampler_reset(g_sampler);
-            
-            // For WASM, use a more conservative approach: process tokens one by one from the start
-            std::cout << "[bitnet_inference_run] Processing input tokens one by one for WASM safety..." << std::endl;
-            
-            for (size_t i = 0; i < input_tokens.size(); ++i) {
-                llama_batch single_batch = llama_batch_init(1, 0, 1);
-                single_batch.token[0] = input_tokens[i];
-                single_batch.pos[0] = i;
-                single_batch.n_seq_id[0] = 1;
-                single_batch.seq_id[0][0] = 0;
-                single_batch.logits[0] = (i == input_tokens.size() - 1); // Only need logits for last token
-                single_batch.n_tokens = 1;
-                
-                std::cout << "  Processing token " << (i+1) << "/" << input_tokens.size() 
-                          << " (id=" << input_tokens[i] << ")" << std::endl;
-                
-                // Get token text for debugging
-                std::vector<char> token_piece(256);
-                const int token_n_piece = llama_token_to_piece(g_init_result.model, input_tokens[i], 
-                                                             token_piece.data(), token_piece.size(), 0, true);
-                std::string token_text(token_piece.data(), token_n_piece > 0 ? token_n_piece : 0);
-                std::cout << "    Token text: '" << token_text << "'" << std::endl;
-                
-                if (llama_decode(g_init_result.context, single_batch)) {
-                    std::cerr << "Failed to decode input token " << i << " (id=" << input_tokens[i] << ")" << std::endl;
-                    llama_batch_free(single_batch);
-                    return 0;
-                }
-                
-                llama_batch_free(single_batch);
-                
-                // Check for NaN after EVERY token to catch exactly when it happens
-                float* current_logits = llama_get_logits(g_init_result.context);
-                bool has_logits = (i == input_tokens.size() - 1); // Only last token should have logits computed
-                
-                if (has_logits) {
-                    // Check the logits for NaN/Inf
-                    for (int j = 0; j < 3; ++j) {
-                        if (std::isnan(current_logits[j]) || std::isinf(current_logits[j])) {
-                            std::cerr << "⚠️ NaN/Inf detected after token " << i 
-                                      << " (id=" << input_tokens[i] << ", text='" << token_text 
-                                      << "') at logit " << j << " = " << current_logits[j] << std::endl;
-                            
-                            // Show the sequence that led to this
-                            std::cerr << "Token sequence up to this point:" << std::endl;
-                            for (size_t k = 0; k <= i; ++k) {
-                                std::vector<char> seq_piece(256);
-                                const int seq_n_piece = llama_token_to_piece(g_init_result.model, input_tokens[k], 
-                                                                            seq_piece.data(), seq_piece.size(), 0, true);
-                                std::string seq_text(seq_piece.data(), seq_n_piece > 0 ? seq_n_piece : 0);
-                                std::cerr << "  " << k << ": " << input_tokens[k] << " = '" << seq_text << "'" << std::endl;
-                            }
-                            
-                            // Try recovery by using only the tokens up to this point
-                            std::cerr << "Attempting to continue with partial input..." << std::endl;
-                            input_tokens.resize(i); // Truncate to exclude problematic tokens
-                            goto exit_token_loop; // Break out of the loop
-                        }
-                    }
-                    std::cout << "    ✓ Logits valid after token " << (i+1) << std::endl;
-                } else {
-                    std::cout << "    ✓ Token " << (i+1) << " processed (no logits computed)" << std::endl;
-                }
+            return bitnet_embed_texts(texts, n_texts, out);
+        } catch (const std::exception& e) {
+            BITNET_LOG_ERROR("[bitnet_embed] Exception: " << e.what());
+            return -1;
+        }
+    }
+
+    // Release the embedding context (recreated by the next bitnet_embed)
+    __attribute__((visibility("default"))) EMSCRIPTEN_KEEPALIVE void bitnet_embed_unload() {
+        bitnet_embed_free();
+    }
+    
+    // Compile a GBNF grammar (start rule "root") for bitnet_generate_begin_grammar.
+    // Returns a handle > 0, or 0 if it does not parse. Compile once and pass the
+    // handle to every request that needs it: allowed-token masks are cached per
+    // grammar state and shared by those requests. Handles die with the model.
+    __attribute__((visibility("default"))) EMSCRIPTEN_KEEPALIVE int bitnet_grammar_compile(const char* gbnf) {
+        if (!g_init_result.model) {
+            BITNET_LOG_ERROR("[bitnet_grammar_compile] Model not loaded");
+            return 0;
+        }
+        try {
+            return bitnet_grammar_create(g_init_result.model, gbnf, "root");
+        } catch (const std::exception& e) {
+            BITNET_LOG_ERROR("[bitnet_grammar_compile] Exception: " << e.what());
+            return 0;
+        }
+    }
+    
+    // Compile a JSON schema into a grammar handle (0 if the schema is invalid
+    // or uses features json_schema_to_grammar does not support)
+    __attribute__((visibility("default"))) EMSCRIPTEN_KEEPALIVE int bitnet_grammar_compile_json_schema(const char* schema) {
+        if (!g_init_result.model) {
+            BITNET_LOG_ERROR("[bitnet_grammar_compile_json_schema] Model not loaded");
+            return 0;
+        }
+        try {
+            return bitnet_grammar_create_from_schema(g_init_result.model, schema);
+        } catch (const std::exception& e) {
+            BITNET_LOG_ERROR("[bitnet_grammar_compile_json_schema] Exception: " << e.what());
+            return 0;
+        }
+    }
+    
+    __attribute__((visibility("default"))) EMSCRIPTEN_KEEPALIVE void bitnet_grammar_free(int grammar) {
+        if (g_gen.grammar == grammar && !g_gen.done) {
+            BITNET_LOG_WARN("⚠️ [bitnet_grammar_free] Grammar " << grammar << " is in use; generation continues unconstrained");
+            g_gen.grammar = 0;
+        }
+        bitnet_grammar_destroy(grammar);
+    }
+    
+    // Number of ggml compute threads (0 = one per core). Applies to the
+    // current context immediately and is kept for later loads. Always 1 in
+    // the single-threaded build; returns the count actually in effect.
+    __attribute__((visibility("default"))) EMSCRIPTEN_KEEPALIVE int bitnet_set_n_threads(int n_threads) {
+        g_load_config.n_threads = std::max(0, n_threads);
+        const int n_resolved = bitnet_resolve_n_threads(g_load_config.n_threads);
+        if (g_init_result.context) {
+            llama_set_n_threads(g_init_result.context, n_resolved, n_resolved);
+        }
+        return n_resolved;
+    }
+    
+    __attribute__((visibility("default"))) EMSCRIPTEN_KEEPALIVE int bitnet_get_n_threads() {
+        if (g_init_result.context) {
+            return llama_n_threads(g_init_result.context);
+        }
+        return bitnet_resolve_n_threads(g_load_config.n_threads);
+    }
+    
+    // Queue a prompt on a free slot. Returns the slot id, or -1 if every slot is
+    // busy or the prompt cannot be tokenized or does not fit the context.
+    // max_new_tokens is lowered so prompt and output fit. Nothing is decoded
+    // until the next bitnet_batch_step().
+    __attribute__((visibility("default"))) EMSCRIPTEN_KEEPALIVE int bitnet_seq_start(const char* input_text, int max_new_tokens) {
+        if (!g_init_result.context) {
+            BITNET_LOG_ERROR("[bitnet_seq_start] Model not loaded");
+            return -1;
+        }
+        
+        for (size_t i = 0; i < g_slots.size(); ++i) {
+            bitnet_slot& slot = g_slots[i];
+            if (slot.in_use) {
+                continue;
             }
             
-            exit_token_loop:
-            
-            std::cout << "[bitnet_inference_run] ✓ All input tokens processed successfully" << std::endl;
-            
-            // Generate tokens using real neural net inference
-            std::vector<llama_token> output_tokens = input_tokens;
-            const int max_new_tokens = 32; // Generate up to 32 new tokens for better output
-            
-            // Get stop tokens
-            const llama_token eos_token = llama_token_eos(g_init_result.model);
-            const llama_token eot_token = llama_token_eot(g_init_result.model);
-            const llama_token nl_token = llama_token_nl(g_init_result.model);
-            
-            std::cout << "[bitnet_inference_run] Starting generation (max " << max_new_tokens << " tokens)..." << std::endl;
-            
-            // Debug: Print a few top logits to understand what the model is predicting
-            float* logits = llama_get_logits(g_init_result.context);
-            const int vocab_size = llama_n_vocab(g_init_result.model);
-            std::cout << "[bitnet_inference_run] Sample logits after input processing:" << std::endl;
-            
-            // Find top 10 tokens by logit value for debugging
-            std::vector<std::pair<float, llama_token>> logit_pairs;
-            for (int i = 0; i < std::min(vocab_size, 1000); ++i) { // Check first 1000 tokens
-                logit_pairs.push_back({logits[i], i});
+            // Reuse the slot's buffers: they were reserved when the slots were made
+            bitnet_generation& gen = slot.gen;
+            bitnet_generation_reset(gen);
+            if (!bitnet_tokenize_prompt(input_text, gen.tokens) || gen.tokens.empty()) {
+                bitnet_generation_reset(gen);
+                return -1;
             }
-            std::sort(logit_pairs.rbegin(), logit_pairs.rend()); // Sort descending by logit
-            
-            for (int i = 0; i < std::min(10, (int)logit_pairs.size()); ++i) {
-                llama_token token_id = logit_pairs[i].second;
-                float logit_val = logit_pairs[i].first;
-                std::vector<char> piece(256);
-                const int n_piece = llama_token_to_piece(g_init_result.model, token_id, piece.data(), piece.size(), 0, true);
-                std::string token_str(piece.data(), n_piece > 0 ? n_piece : 0);
-                std::cout << "  Top " << (i+1) << ": token=" << token_id 
-                         << " logit=" << logit_val << " text='" << token_str << "'" << std::endl;
+            gen.n_prompt = gen.tokens.size();
+            gen.max_new_tokens = max_new_tokens > 0 ? max_new_tokens : BITNET_DEFAULT_MAX_NEW_TOKENS;
+            gen.done = false;
+            
+            // A slot never shifts its context, so prompt and output must both fit
+            const size_t n_ctx = llama_n_ctx(g_init_result.context);
+            if (gen.n_prompt >= n_ctx) {
+                BITNET_LOG_ERROR("[bitnet_seq_start] Prompt of " << gen.n_prompt << " tokens does not fit the context of " << n_ctx);
+                bitnet_generation_reset(gen);
+                return -1;
+            }
+            if (gen.n_prompt + gen.max_new_tokens > n_ctx) {
+                gen.max_new_tokens = static_cast<int>(n_ctx - gen.n_prompt);
+                BITNET_LOG_WARN("⚠️ [bitnet_seq_start] Slot " << i << " limited to " << gen.max_new_tokens << " new tokens by the context");
             }
             
-            int consecutive_repeats = 0;
-            llama_token last_token = LLAMA_TOKEN_NULL;
+            llama_kv_cache_seq_rm(g_init_result.context, static_cast<llama_seq_id>(i + 1), -1, -1);
+            bitnet_sampler_reset(slot.sampler);
+            slot.n_past = 0;
+            slot.i_batch = -1;
+            slot.output.clear();
+            slot.in_use = true;
             
-            for (int i = 0; i < max_new_tokens; ++i) {
-                // Sample next token using real common sampler (neural net-based sampling)
-                const llama_token new_token = common_sampler_sample(g_sampler, g_init_result.context, -1);
-                
-                // Log more details about the sampling
-                std::cout << "[bitnet_inference_run] Sampled token ID: " << new_token << std::endl;
-                
-                // Debug: Check if we're getting valid token IDs
-                if (new_token < 0 || new_token >= llama_n_vocab(g_init_result.model)) {
-                    std::cout << "[bitnet_inference_run] Invalid token ID, stopping" << std::endl;
-                    break;
-                }
-                
-                // Check for various stop conditions with improved EOG handling
-                if (new_token == eos_token || new_token == eot_token) {
-                    std::cout << "[bitnet_inference_run] Stop token generated (EOS/EOT), stopping" << std::endl;
-                    break;
-                }
-                
-                // Better EOG detection - manually check known EOG tokens for BitNet models
-                if (new_token == 128001 || new_token == 128009) { // <|end_of_text|> or <|eot_id|>
-                    std::cout << "[bitnet_inference_run] Manual EOG token detected (" << new_token << "), stopping" << std::endl;
-                    break;
-                }
-                
-                // Check for End-of-Generation using llama.cpp function
-                if (llama_token_is_eog(g_init_result.model, new_token)) {
-                    std::cout << "[bitnet_inference_run] End-of-generation token detected, stopping" << std::endl;
-                    break;
-                }
-                
-                // Special handling for problematic token 31 (@)
-                if (new_token == 31) {
-                    std::cout << "[bitnet_inference_run] Warning: Generated token 31 ('@'), checking context..." << std::endl;
-                    // If we already generated this token, try to get alternatives by resampling
-                    if (last_token == 31) {
-                        consecutive_repeats++;
-                        if (consecutive_repeats >= 2) { // Lower threshold for '@' token
-                            std::cout << "[bitnet_inference_run] Too many '@' tokens, stopping early" << std::endl;
-                            break;
-                        }
-                    }
-                } else {
-                    // Reset consecutive repeats for non-@ tokens
-                    consecutive_repeats = 0;
-                }
-                
-                // Enhanced anti-repetition logic for BitNet models
-                if (new_token == last_token) {
-                    consecutive_repeats++;
-                    if (consecutive_repeats >= 2) { // Stricter repetition control
-                        std::cout << "[bitnet_inference_run] Consecutive repeats detected, stopping to prevent loops" << std::endl;
-                        break;
-                    }
-                } else {
-                    consecutive_repeats = 0;
+            BITNET_LOG_INFO("[bitnet_seq_start] Slot " << i << ": " << slot.gen.n_prompt << " prompt tokens");
+            return static_cast<int>(i);
+        }
+        
+        BITNET_LOG_ERROR("[bitnet_seq_start] All " << g_slots.size() << " slots are busy");
+        return -1;
+    }
+    
+    // Advance every running sequence with a single llama_decode. Sequences that
+    // are generating contribute their last sampled token; the remaining batch
+    // capacity is filled with pending prompt tokens, so a long prompt is
+    // prefilled over several steps without stalling the others. The slots
+    // share the context's KV cells: a generating sequence that finds none free
+    // ends there, and prompt tokens wait for cells to be released. Returns
+    // the number of sequences still running, or -1 if the decode failed (the
+    // sequences in the failed batch are marked done).
+    __attribute__((visibility("default"))) EMSCRIPTEN_KEEPALIVE int bitnet_batch_step() {
+        if (!g_init_result.context || g_slots.empty()) {
+            return 0;
+        }
+        
+        llama_context* ctx = g_init_result.context;
+        const int n_cells_free = static_cast<int>(llama_n_ctx(ctx)) - static_cast<int>(g_kv_tokens.size()) - bitnet_slot_cells();
+        const int n_batch_max = std::min(static_cast<int>(llama_n_batch(ctx)), n_cells_free);
+        llama_batch& batch = g_batch;
+        batch.n_tokens = 0;
+        
+        auto add_pending = [&](size_t i) {
+            bitnet_slot& slot = g_slots[i];
+            const std::vector<llama_token>& tokens = slot.gen.tokens;
+            while (slot.n_past < tokens.size() && batch.n_tokens < n_batch_max) {
+                const int row = batch.n_tokens++;
+                batch.token[row] = tokens[slot.n_past];
+                batch.pos[row] = static_cast<llama_pos>(slot.n_past);
+                batch.n_seq_id[row] = 1;
+                batch.seq_id[row][0] = static_cast<llama_seq_id>(i + 1);
+                batch.logits[row] = (slot.n_past + 1 == tokens.size());
+                if (batch.logits[row]) {
+                    slot.i_batch = row;
                 }
-                
-                // Additional check for alternating patterns (like "mass cluster mass cluster")
-                if (output_tokens.size() >= 4) {
-                    bool is_alternating = true;
-                    const size_t start_idx = output_tokens.size() - 4;
-                    for (size_t check_idx = start_idx; check_idx < output_tokens.size() - 2; ++check_idx) {
-                        if (output_tokens[check_idx] != output_tokens[check_idx + 2]) {
-                            is_alternating = false;
-                            break;
-                        }
-                    }
-                    if (is_alternating) {
-                        std::cout << "[bitnet_inference_run] Alternating pattern detected, stopping to prevent loops" << std::endl;
-                        break;
-                    }
+                slot.n_past++;
+            }
+        };
+        
+        // Generating sequences first: one token each keeps their latency flat
+        for (size_t i = 0; i < g_slots.size(); ++i) {
+            bitnet_slot& slot = g_slots[i];
+            if (slot.in_use && !slot.gen.done && slot.n_past >= slot.gen.n_prompt) {
+                if (batch.n_tokens >= n_cells_free) {
+                    BITNET_LOG_WARN("⚠️ [bitnet_batch_step] Slot " << i << " ended: no free KV cells");
+                    slot.gen.done = true;
+                    slot.output += slot.gen.pending;
+                    slot.gen.pending.clear();
+                    continue;
                 }
-                
-                last_token = new_token;
-                
-                output_tokens.push_back(new_token);
-                
-                // Accept the token for future predictions using real common sampler
-                common_sampler_accept(g_sampler, new_token, true);
-                
-                // Decode the new token for next iteration - real neural net forward pass
-                llama_batch single_batch = llama_batch_init(1, 0, 1);
-                single_batch.token[0] = new_token;
-                single_batch.pos[0] = output_tokens.size() - 1;  // Position in sequence
-                single_batch.n_seq_id[0] = 1;
-                single_batch.seq_id[0][0] = 0;  // Same sequence ID
-                single_batch.logits[0] = true;  // We need logits for next prediction
-                single_batch.n_tokens = 1;
-                
-                if (llama_decode(g_init_result.context, single_batch)) {
-                    std::cerr << "Failed to decode generated token" << std::endl;
-                    llama_batch_free(single_batch);
-                    break;
+                add_pending(i);
+            }
+        }
+        int n_waiting = 0;
+        for (size_t i = 0; i < g_slots.size(); ++i) {
+            const bitnet_slot& slot = g_slots[i];
+            if (slot.in_use && !slot.gen.done && slot.n_past < slot.gen.n_prompt) {
+                add_pending(i);
+                n_waiting += slot.n_past < slot.gen.n_prompt;
+            }
+        }
+        
+        // Prompts that can never get cells, since nothing else will release any
+        if (batch.n_tokens == 0 && n_waiting > 0) {
+            for (size_t i = 0; i < g_slots.size(); ++i) {
+                bitnet_slot& slot = g_slots[i];
+                if (slot.in_use && !slot.gen.done) {
+                    BITNET_LOG_WARN("⚠️ [bitnet_batch_step] Slot " << i << " ended: no free KV cells for its prompt");
+                    slot.gen.done = true;
                 }
-                
-                llama_batch_free(single_batch);
-                
-                // Log the generated token with more detail
-                std::vector<char> piece(256);
-                const int n_piece = llama_token_to_piece(g_init_result.model, new_token, piece.data(), piece.size(), 0, true);
-                std::string token_str(piece.data(), n_piece > 0 ? n_piece : 0);
-                std::cout << "[bitnet_inference_run] Token " << (i + 1) << ": '" 
-                          << token_str << "' (id=" << new_token << ")" << std::endl;
             }
-            
-            // Convert only the NEW tokens to text (exclude input tokens)
-            std::string output_text;
-            const size_t new_token_start = input_tokens.size();
-            
-            if (output_tokens.size() > new_token_start) {
-                std::cout << "[bitnet_inference_run] Converting " << (output_tokens.size() - new_token_start) 
-                          << " new tokens to text..." << std::endl;
-                
-                for (size_t idx = new_token_start; idx < output_tokens.size(); ++idx) {
-                    const llama_token token = output_tokens[idx];
-                    std::vector<char> piece(256);
-                    const int n_piece = llama_token_to_piece(g_init_result.model, token, piece.data(), piece.size(), 0, true);
-                    if (n_piece > 0) {
-                        output_text.append(piece.data(), n_piece);
-                    }
+        }
+        
+        if (batch.n_tokens > 0) {
+            const int64_t t_decode_us = ggml_time_us();
+            if (llama_decode(ctx, batch)) {
+                BITNET_LOG_ERROR("[bitnet_batch_step] Failed to decode batch of " << batch.n_tokens << " tokens");
+                for (int row = 0; row < batch.n_tokens; ++row) {
+                    bitnet_slot& slot = g_slots[batch.seq_id[row][0] - 1];
+                    slot.gen.done = true;
+                    slot.i_batch = -1;
                 }
-            } else {
-                std::cout << "[bitnet_inference_run] No new tokens generated" << std::endl;
-                output_text = "[No output generated]";
+                return -1;
             }
-            
-            // Copy to output buffer
-            int copy_len = std::min(static_cast<int>(output_text.length()), max_output_len - 1);
-            std::memcpy(output_buffer, output_text.c_str(), copy_len);
-            output_buffer[copy_len] = '\0';
-            
-            std::cout << "[bitnet_inference_run] Complete output: \"" << output_text << "\"" << std::endl;
-            std::cout << "[bitnet_inference_run] Generated " << (output_tokens.size() - input_tokens.size()) << " new tokens using real neural net" << std::endl;
-            
-            return copy_len;
-            
+            const int64_t t_decoded_us = ggml_time_us();
+            bitnet_trace_push(BITNET_TRACE_DECODE, batch.n_tokens, t_decode_us, t_decoded_us);
+            bitnet_profile_count_tokens(batch.n_tokens);
+            g_stats.decode_ms += (t_decoded_us - t_decode_us) / 1000.0;
+            g_stats.n_decode_tokens += batch.n_tokens;
+            g_stats.n_decode_calls++;
+        }
+        
+        int n_running = 0;
+        for (bitnet_slot& slot : g_slots) {
+            if (!slot.in_use || slot.gen.done) {
+                continue;
+            }
+            if (slot.i_batch >= 0) {
+                bitnet_slot_sample(slot);
+            }
+            if (!slot.gen.done) {
+                n_running++;
+            }
+        }
+        return n_running;
+    }
+    
+    // Text a slot has produced since the previous call (valid until the next
+    // call for the same slot). Always ends on a UTF-8 boundary.
+    __attribute__((visibility("default"))) EMSCRIPTEN_KEEPALIVE const char* bitnet_seq_take_output(int slot_id) {
+        if (slot_id < 0 || slot_id >= static_cast<int>(g_slots.size())) {
+            return "";
+        }
+        bitnet_slot& slot = g_slots[slot_id];
+        slot.taken.swap(slot.output);
+        slot.output.clear();
+        return slot.taken.c_str();
+    }
+    
+    __attribute__((visibility("default"))) EMSCRIPTEN_KEEPALIVE int bitnet_seq_is_done(int slot_id) {
+        if (slot_id < 0 || slot_id >= static_cast<int>(g_slots.size())) {
+            return 1;
+        }
+        return g_slots[slot_id].gen.done ? 1 : 0;
+    }
+    
+    // Free a slot and its KV cells. Finished slots must be released before
+    // they can be reused; running ones are cancelled.
+    __attribute__((visibility("default"))) EMSCRIPTEN_KEEPALIVE void bitnet_seq_release(int slot_id) {
+        if (slot_id < 0 || slot_id >= static_cast<int>(g_slots.size())) {
+            return;
+        }
+        bitnet_slot& slot = g_slots[slot_id];
+        if (g_init_result.context) {
+            llama_kv_cache_seq_rm(g_init_result.context, static_cast<llama_seq_id>(slot_id + 1), -1, -1);
+        }
+        bitnet_generation_reset(slot.gen);
+        slot.n_past = 0;
+        slot.i_batch = -1;
+        slot.output.clear();
+        slot.taken.clear();
+        slot.in_use = false;
+    }
+    
+    // Let later loads from an ordinary GGUF be exported as a preprocessed
+    // cache file at path (NULL or "" to stop): the load keeps the source
+    // metadata, and bitnet_write_model_cache writes the file. Loading that
+    // file instead skips tensor validation; store it keyed by
+    // bitnet_get_model_hash(), which a load from the cache reports unchanged.
+    __attribute__((visibility("default"))) EMSCRIPTEN_KEEPALIVE void bitnet_set_cache_export(const char* path) {
+        g_load_config.cache_path = path ? path : "";
+    }
+    
+    // Write the cache file of the model just loaded to the export path.
+    // Call it after the load has returned, when a streamed load's staging
+    // file is gone: memory then peaks at the model plus the cache file, as
+    // during the load. Returns 1 on success, 0 if there is nothing to write.
+    __attribute__((visibility("default"))) EMSCRIPTEN_KEEPALIVE int bitnet_write_model_cache() {
+        if (!g_init_result.model || !bitnet_cache_has_source() || g_load_config.cache_path.empty()) {
+            return 0;
+        }
+        try {
+            return bitnet_cache_write(g_init_result.model, g_model_hash, g_load_config.cache_path.c_str()) ? 1 : 0;
         } catch (const std::exception& e) {
-            std::cerr << "[bitnet_inference_run] Exception: " << e.what() << std::endl;
+            BITNET_LOG_ERROR("[bitnet_write_model_cache] Exception: " << e.what());
+            bitnet_cache_drop_source();
             return 0;
         }
     }
     
-    // Simplified inference function that returns JSON result
-    __attribute__((visibility("default"))) EMSCRIPTEN_KEEPALIVE const char* bitnet_run_inference_simple(const char* input_text, int max_tokens) {
-        static char result_buffer[8192];
-        int output_len = bitnet_inference_run(input_text, result_buffer, sizeof(result_buffer) - 1);
-        if (output_len > 0) {
-            result_buffer[output_len] = '\0';
-            return result_buffer;
+    // 1 if the current model was loaded from a preprocessed cache file
+    __attribute__((visibility("default"))) EMSCRIPTEN_KEEPALIVE int bitnet_model_is_cached() {
+        return g_model_from_cache ? 1 : 0;
+    }
+    
+    // Hex fingerprint of the loaded model file, as stored in session snapshots
+    __attribute__((visibility("default"))) EMSCRIPTEN_KEEPALIVE const char* bitnet_get_model_hash() {
+        static char hash_hex[17];
+        snprintf(hash_hex, sizeof(hash_hex), "%016llx", static_cast<unsigned long long>(g_model_hash));
+        return hash_hex;
+    }
+    
+    // Serialize the KV cache for seq 0, its token history, the sampler's
+    // recent-token history and its RNG state into `out`. Returns the snapshot size; nothing is
+    // written when `out` is NULL or `capacity` is too small, so call once with
+    // NULL to size the buffer. Returns 0 if no model is loaded.
+    __attribute__((visibility("default"))) EMSCRIPTEN_KEEPALIVE size_t bitnet_session_save(uint8_t* out, size_t capacity) {
+        if (!g_init_result.context || !g_sampler) {
+            return 0;
+        }
+        
+        // Only generated tokens were accepted into the sampler since its reset
+        std::vector<llama_token> sampler_tokens;
+        if (g_gen.tokens.size() > g_gen.n_prompt) {
+            sampler_tokens.assign(g_gen.tokens.begin() + g_gen.n_prompt, g_gen.tokens.end());
+        }
+        
+        bitnet_session_header header = {};
+        std::memcpy(header.magic, BITNET_SESSION_MAGIC, sizeof(header.magic));
+        header.version = BITNET_SESSION_VERSION;
+        header.model_hash = g_model_hash;
+        header.n_ctx = llama_n_ctx(g_init_result.context);
+        header.n_tokens = static_cast<uint32_t>(g_kv_tokens.size());
+        header.n_sampler_tokens = static_cast<uint32_t>(sampler_tokens.size());
+        const std::string rng = bitnet_sampler_get_rng(g_sampler);
+        header.rng_size = static_cast<uint32_t>(rng.size());
+        header.state_size = llama_state_seq_get_size(g_init_result.context, 0);
+        
+        const size_t total = sizeof(header) +
+                             (g_kv_tokens.size() + sampler_tokens.size()) * sizeof(llama_token) +
+                             rng.size() + header.state_size;
+        if (!out || capacity < total) {
+            return total;
+        }
+        
+        uint8_t* p = out;
+        std::memcpy(p, &header, sizeof(header));
+        p += sizeof(header);
+        std::memcpy(p, g_kv_tokens.data(), g_kv_tokens.size() * sizeof(llama_token));
+        p += g_kv_tokens.size() * sizeof(llama_token);
+        std::memcpy(p, sampler_tokens.data(), sampler_tokens.size() * sizeof(llama_token));
+        p += sampler_tokens.size() * sizeof(llama_token);
+        std::memcpy(p, rng.data(), rng.size());
+        p += rng.size();
+        
+        const size_t written = llama_state_seq_get_data(g_init_result.context, p, header.state_size, 0);
+        if (written != header.state_size) {
+            BITNET_LOG_ERROR("[bitnet_session_save] State size changed while saving");
+            return 0;
+        }
+        
+        BITNET_LOG_INFO("[bitnet_session_save] Saved " << g_kv_tokens.size() << " tokens (" << total << " bytes)");
+        return total;
+    }
+    
+    // Restore a snapshot written by bitnet_session_save. Snapshots from another
+    // model file, format version or larger context are rejected. On success the
+    // next bitnet_generate_begin only prefills what follows the restored tokens.
+    __attribute__((visibility("default"))) EMSCRIPTEN_KEEPALIVE int bitnet_session_load(const uint8_t* data, size_t size) {
+        if (!g_init_result.context || !g_sampler) {
+            BITNET_LOG_ERROR("[bitnet_session_load] Model not loaded");
+            return 0;
+        }
+        
+        bitnet_session_header header;
+        if (size < sizeof(header)) {
+            BITNET_LOG_ERROR("[bitnet_session_load] Snapshot too small");
+            return 0;
+        }
+        std::memcpy(&header, data, sizeof(header));
+        
+        if (std::memcmp(header.magic, BITNET_SESSION_MAGIC, sizeof(header.magic)) != 0 ||
+            header.version != BITNET_SESSION_VERSION) {
+            BITNET_LOG_ERROR("[bitnet_session_load] Unsupported snapshot format");
+            return 0;
+        }
+        if (header.model_hash != g_model_hash) {
+            BITNET_LOG_ERROR("[bitnet_session_load] Snapshot was made with a different model");
+            return 0;
+        }
+        if (header.n_tokens > llama_n_ctx(g_init_result.context)) {
+            BITNET_LOG_ERROR("[bitnet_session_load] Snapshot needs n_ctx >= " << header.n_tokens);
+            return 0;
+        }
+        
+        const size_t tokens_bytes = (static_cast<size_t>(header.n_tokens) + header.n_sampler_tokens) * sizeof(llama_token);
+        if (size != sizeof(header) + tokens_bytes + header.rng_size + header.state_size) {
+            BITNET_LOG_ERROR("[bitnet_session_load] Snapshot size mismatch");
+            return 0;
+        }
+        
+        const llama_token* tokens = reinterpret_cast<const llama_token*>(data + sizeof(header));
+        const llama_token* sampler_tokens = tokens + header.n_tokens;
+        const char* rng = reinterpret_cast<const char*>(data + sizeof(header) + tokens_bytes);
+        const uint8_t* state = data + sizeof(header) + tokens_bytes + header.rng_size;
+        
+        bitnet_kv_reset();
+        if (llama_state_seq_set_data(g_init_result.context, state, header.state_size, 0) == 0) {
+            BITNET_LOG_ERROR("[bitnet_session_load] llama.cpp rejected the sequence state");
+            bitnet_kv_reset();
+            return 0;
+        }
+        g_kv_tokens.assign(tokens, tokens + header.n_tokens);
+        
+        bitnet_sampler_reset(g_sampler);
+        for (uint32_t i = 0; i < header.n_sampler_tokens; ++i) {
+            bitnet_sampler_accept(g_sampler, sampler_tokens[i]);
+        }
+        if (!bitnet_sampler_set_rng(g_sampler, std::string(rng, header.rng_size))) {
+            BITNET_LOG_WARN("⚠️ [bitnet_session_load] Sampler RNG state not restored; sampling continues from a fresh seed");
         }
-        return "";
+        g_sampler_restored = true;
+        bitnet_generation_reset(g_gen);
+        
+        BITNET_LOG_INFO("[bitnet_session_load] Restored " << header.n_tokens << " tokens");
+        return 1;
+    }
+    
+    // Timing of the most recent inference call as a JSON object
+    __attribute__((visibility("default"))) EMSCRIPTEN_KEEPALIVE const char* bitnet_get_stats() {
+        static std::string stats_json;
+        char buf[512];
+        snprintf(buf, sizeof(buf),
+                 "{\"prompt_tokens\":%d,\"prompt_tokens_reused\":%d,\"prefill_ms\":%.3f,\"prefill_tokens_per_sec\":%.2f,"
+                 "\"decode_tokens\":%d,\"decode_ms\":%.3f,\"decode_tokens_per_sec\":%.2f,"
+                 "\"decode_calls\":%d,\"tokens_per_decode\":%.3f,"
+                 "\"draft_tokens\":%d,\"draft_accepted\":%d,\"draft_acceptance_rate\":%.3f,"
+                 "\"context_shifts\":%d}",
+                 g_stats.n_prompt_tokens, g_stats.n_prompt_reused, g_stats.prefill_ms, bitnet_stats_prefill_tps(),
+                 g_stats.n_decode_tokens, g_stats.decode_ms, bitnet_stats_decode_tps(),
+                 g_stats.n_decode_calls,
+                 g_stats.n_decode_calls > 0 ? static_cast<double>(g_stats.n_decode_tokens) / g_stats.n_decode_calls : 0.0,
+                 g_stats.n_draft_tokens, g_stats.n_draft_accepted,
+                 g_stats.n_draft_tokens > 0 ? static_cast<double>(g_stats.n_draft_accepted) / g_stats.n_draft_tokens : 0.0,
+                 g_stats.n_ctx_shifts);
+        stats_json = buf;
+        return stats_json.c_str();
     }
     
     // Get model information
@@ -795,13 +2466,24 @@ extern "C" {
     
     // Free model and clean up
     __attribute__((visibility("default"))) EMSCRIPTEN_KEEPALIVE void bitnet_free_model() {
-        std::cout << "[bitnet_free_model] Cleaning up resources" << std::endl;
+        BITNET_LOG_INFO("[bitnet_free_model] Cleaning up resources");
+        
+        bitnet_generation_reset(g_gen);
+        g_kv_tokens.clear();
+        g_memory_plan = bitnet_memory_plan();
+        g_model_from_cache = false;
+        bitnet_cache_drop_source();
+        bitnet_slots_free();
+        bitnet_batch_free();
         
         if (g_sampler) {
-            common_sampler_free(g_sampler);
+            bitnet_sampler_free(g_sampler);
             g_sampler = nullptr;
         }
         
+        bitnet_embed_free();
+        bitnet_grammar_destroy_all();
+        bitnet_pager_free();
         if (g_init_result.context) {
             llama_free(g_init_result.context);
             g_init_result.context = nullptr;
@@ -811,11 +2493,13 @@ extern "C" {
             llama_free_model(g_init_result.model);
             g_init_result.model = nullptr;
         }
+        bitnet_vocab_release();
+        bitnet_draft_free();
         
         // Clear LoRA adapters
         g_init_result.lora_adapters.clear();
         
-        std::cout << "[bitnet_free_model] Resources freed" << std::endl;
+        BITNET_LOG_INFO("[bitnet_free_model] Resources freed");
     }
     
     // Cleanup on exit
@@ -829,6 +2513,59 @@ extern "C" {
         }
     }
     
+    // Check the i2_s dot product against the scalar reference on random
+    // weights and activations, including saturated ones. Returns the number
+    // of mismatching results; any mismatch means the SIMD kernel is wrong.
+    __attribute__((visibility("default"))) EMSCRIPTEN_KEEPALIVE int bitnet_kernel_selftest() {
+        std::mt19937 rng(1234);
+        std::uniform_int_distribution<int> ternary(0, 2);
+        std::uniform_int_distribution<int> act(-128, 127);
+        
+        int n_mismatch = 0;
+        for (int n_blocks : {1, 2, 7, 20, 64}) {
+            const int n = n_blocks * 128;
+            std::vector<uint8_t> x(n / 4, 0);
+            std::vector<int8_t> y(n);
+            
+            for (int round = 0; round < 3; ++round) {
+                for (int j = 0; j < n; ++j) {
+                    const int block = j / 128;
+                    const int k = j % 128;
+                    const int q = round == 2 ? 2 : ternary(rng);
+                    x[block * 32 + k % 32] = static_cast<uint8_t>(
+                        (x[block * 32 + k % 32] & ~(0x03 << (6 - 2 * (k / 32)))) | (q << (6 - 2 * (k / 32))));
+                    y[j] = static_cast<int8_t>(round == 2 ? (j % 2 ? 127 : -128) : act(rng));
+                }
+                
+                float expected = 0.0f;
+                float actual = 0.0f;
+                ggml_vec_dot_i2_i8_s_ref(n, &expected, 0, x.data(), 0, y.data(), 0, 1);
+                ggml_vec_dot_i2_i8_s(n, &actual, 0, x.data(), 0, y.data(), 0, 1);
+                if (std::memcmp(&expected, &actual, sizeof(float)) != 0) {
+                    BITNET_LOG_ERROR("[bitnet_kernel_selftest] n=" << n << ": expected " << expected
+                              << ", got " << actual);
+                    n_mismatch++;
+                }
+            }
+        }
+        
+        BITNET_LOG_INFO("[bitnet_kernel_selftest] " << (n_mismatch == 0 ? "passed" : "FAILED"));
+        return n_mismatch;
+    }
+    
+    // Check the fused sampler against the llama_sampler chain it replaces,
+    // using the loaded model's vocabulary and sampling configuration. Returns
+    // the number of differing picks out of n_steps (default 64), or -1 if no
+    // model is loaded.
+    __attribute__((visibility("default"))) EMSCRIPTEN_KEEPALIVE int bitnet_sampler_selftest(int n_steps) {
+        if (!g_init_result.model) {
+            return -1;
+        }
+        const int n_mismatch = bitnet_sampler_verify(g_init_result.model, g_sampler_params, n_steps > 0 ? n_steps : 64);
+        BITNET_LOG_INFO("[bitnet_sampler_selftest] " << (n_mismatch == 0 ? "passed" : "FAILED"));
+        return n_mismatch;
+    }
+    
     int bitnet_get_ops_count() {
         return bitnet_ops_count;
     }
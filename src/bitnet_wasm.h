@@ -29,6 +29,8 @@ struct BitNetModel {
     std::vector<gguf_kv_pair> metadata;
     std::vector<gguf_tensor_info> tensors;
     std::vector<uint8_t> tensor_data;
+    std::string arch;
+    size_t data_offset = 0;
     bool loaded = false;
     uint32_t vocab_size = 0;
     uint32_t n_embd = 0;
@@ -39,6 +41,29 @@ struct BitNetModel {
 
 extern BitNetModel g_model;
 bool parse_gguf_file(const uint8_t* file_data, size_t file_size, BitNetModel& model);
+// Returns 1 once header, metadata and tensor infos are complete, 0 if more
+// bytes are needed, -1 if the data is not a valid GGUF file
+int parse_gguf_header(const uint8_t* data, size_t size, BitNetModel& model);
+// parse_gguf_header over a file on disk, reading only the header bytes
+bool parse_gguf_header_file(const char* path, BitNetModel& model);
+// Unsigned metadata value (uint32 or uint64), def if absent or of another type
+uint64_t bitnet_gguf_get_uint(const BitNetModel& model, const char* key, uint64_t def);
+// Hash of every byte of a model file, fed in chunks of any size as the file
+// is read or downloaded; the digest depends only on the bytes, not on how
+// they were split
+struct bitnet_file_hasher {
+    uint64_t lanes[4];
+    uint64_t total = 0;
+    uint8_t carry[32];
+    size_t n_carry = 0;
+
+    bitnet_file_hasher();
+    void update(const uint8_t* data, size_t len);
+    uint64_t digest() const;
+};
+// bitnet_file_hasher over a whole file on disk; 0 on error
+uint64_t bitnet_fingerprint_file(const char* path);
+
 std::vector<int32_t> bitnet_inference(const std::vector<int32_t>& input_tokens, int max_tokens = 32);
 std::vector<int32_t> tokenize(const std::string& text);
 std::string detokenize(const std::vector<int32_t>& tokens);
@@ -0,0 +1,467 @@
+// BitNet worker runtime: runs the WASM module off the main thread, in a
+// browser Worker ({ type: 'module' }) or a Node worker_thread, and serves
+// the message protocol of bitnet_client.js.
+//
+// Host -> worker (every request but cancel carries a unique id):
+//   { id, type: 'init', moduleUrl? }
+//   { id, type: 'load', url? | path? | bytes?, options? }  bytes: transferred ArrayBuffer
+//   { id, type: 'generate', prompt, maxTokens?, grammar? } grammar: { gbnf } | { schema }
+//   { id, type: 'stats' }
+//   { id, type: 'unload' }
+//   { type: 'cancel', id }
+// Worker -> host:
+//   { id, type: 'started' }
+//   { id, type: 'progress', received, expected }
+//   { id, type: 'tokens', bytes, count }                   bytes: transferred ArrayBuffer of UTF-8
+//   { id, type: 'done', result }
+//   { id, type: 'error', message }
+//
+// Requests run one at a time in arrival order. cancel is handled as soon as
+// it arrives: a queued request is dropped, a running generation stops at its
+// next token. With a shared heap (the pthread build) the 'init' result also
+// carries the C cancel flag, armed with the running request's id, so the
+// host can stop even a prefill directly.
+
+import { openModelCache } from './bitnet_model_cache.js';
+
+const isNode = typeof process !== 'undefined' && !!process.versions?.node;
+
+// Size of the reusable heap buffer that streamed chunks pass through
+const STREAM_CHUNK_SIZE = 4 * 1024 * 1024;
+
+// Where bitnet_write_model_cache puts the preprocessed cache file in MEMFS
+const MODEL_CACHE_FILE = '/tmp/model-cache.gguf';
+
+// Generation yields to the message loop (and flushes tokens) this often
+const YIELD_INTERVAL_MS = 16;
+
+let port = null;
+let wasmModule = null;
+let running = null;                 // id of the request being handled
+const queued = new Set();           // ids received and not yet answered
+const cancelled = new Set();        // ... of which the host cancelled these
+
+function post(message, transfer = []) {
+    port.postMessage(message, transfer);
+}
+
+function yieldToMessages() {
+    return new Promise(resolve => setTimeout(resolve, 0));
+}
+
+function requireModule() {
+    if (!wasmModule) {
+        throw new Error('Worker not initialized');
+    }
+    return wasmModule;
+}
+
+async function handleInit(message) {
+    if (!wasmModule) {
+        const { default: ModuleFactory } = await import(message.moduleUrl || '../bitnet.mjs');
+        wasmModule = await ModuleFactory();
+        wasmModule._bitnet_init();
+    }
+    // A shared heap lets the host write the cancel flag without a round trip
+    const heap = wasmModule.HEAPU8.buffer;
+    const shared = typeof SharedArrayBuffer !== 'undefined' && heap instanceof SharedArrayBuffer;
+    return {
+        threads: wasmModule._bitnet_get_n_threads(),
+        cancelFlag: shared ? { buffer: heap, byteOffset: Number(wasmModule._bitnet_cancel_flag_ptr()) } : null,
+    };
+}
+
+// Feed a response body into the streaming loader as it arrives, so the GGUF
+// header is parsed early and JS never holds more than one chunk. The file
+// staged in MEMFS is still a full copy until bitnet_load_end returns (see
+// bitnet_load_begin)
+async function streamModelIntoWasm(id, response) {
+    // Content-Length is the encoded size, so only trust it for identity encoding
+    const expected = response.headers.get('Content-Encoding')
+        ? 0
+        : Number(response.headers.get('Content-Length')) || 0;
+    if (!wasmModule._bitnet_load_begin(expected)) {
+        throw new Error('Failed to start streamed model load');
+    }
+
+    const reader = response.body.getReader();
+    const stagingPtr = wasmModule._malloc(STREAM_CHUNK_SIZE);
+    if (!stagingPtr) {
+        wasmModule._bitnet_load_abort();
+        throw new Error('Failed to allocate streaming buffer');
+    }
+
+    let received = 0;
+    try {
+        for (;;) {
+            const { done, value } = await reader.read();
+            if (done) break;
+            if (cancelled.has(id)) {
+                throw new Error('Load cancelled');
+            }
+
+            for (let offset = 0; offset < value.length; offset += STREAM_CHUNK_SIZE) {
+                const part = value.subarray(offset, offset + STREAM_CHUNK_SIZE);
+                wasmModule.HEAPU8.set(part, stagingPtr);
+                if (!wasmModule._bitnet_load_feed(stagingPtr, part.length)) {
+                    throw new Error('Model stream rejected (invalid GGUF data)');
+                }
+            }
+
+            received += value.length;
+            post({ id, type: 'progress', received, expected });
+        }
+    } catch (error) {
+        reader.cancel().catch(() => {});
+        wasmModule._bitnet_load_abort();
+        throw error;
+    } finally {
+        wasmModule._free(stagingPtr);
+    }
+
+    return wasmModule._bitnet_load_end();
+}
+
+// Hand transferred model bytes to MEMFS without copying them into the WASM
+// heap (canOwn adopts the ArrayBuffer as-is), then load straight from the file
+function loadModelFromBytes(bytes) {
+    const modelFile = '/tmp/model.gguf';
+    wasmModule.FS.writeFile(modelFile, new Uint8Array(bytes), { canOwn: true });
+    const result = wasmModule.ccall('bitnet_load_model_from_file', 'number', ['string'], [modelFile]);
+    wasmModule.FS.unlink(modelFile);
+    return result;
+}
+
+// A local file under Node, read as a stream like a download
+async function openModelFile(path) {
+    const fs = await import('node:fs');
+    const { Readable } = await import('node:stream');
+    const { size } = await fs.promises.stat(path);
+    return new Response(Readable.toWeb(fs.createReadStream(path)), {
+        headers: { 'Content-Length': String(size) },
+    });
+}
+
+// What identifies the current version of a model source: size and mtime of
+// a local file, or the ETag, Last-Modified and Content-Length of a URL
+function urlSource(headers) {
+    return {
+        etag: headers.get('ETag'),
+        lastModified: headers.get('Last-Modified'),
+        length: headers.get('Content-Length'),
+    };
+}
+
+async function fileSource(path) {
+    const fs = await import('node:fs');
+    const { size, mtimeMs } = await fs.promises.stat(path);
+    return { size, mtimeMs };
+}
+
+// Open the model source for a cold load: { response, source }
+async function openModelSource(message) {
+    if (message.path && isNode) {
+        return { response: await openModelFile(message.path), source: await fileSource(message.path) };
+    }
+    const response = await fetch(message.url || message.path);
+    if (!response.ok) {
+        throw new Error(`Failed to fetch model: ${response.status} ${response.statusText}`);
+    }
+    return { response, source: urlSource(response.headers) };
+}
+
+// Whether a cache entry was built from the source as it is now. Size alone
+// does not prove it; a URL whose server reports no validator never matches.
+// A source that cannot be reached at all (offline) keeps its cache usable.
+async function cacheIsCurrent(message, cached) {
+    let current;
+    try {
+        if (message.path && isNode) {
+            current = await fileSource(message.path);
+        } else {
+            const head = await fetch(message.url || message.path, { method: 'HEAD' });
+            if (!head.ok) return false;
+            current = urlSource(head.headers);
+        }
+    } catch {
+        return true;
+    }
+    const stored = cached.source || {};
+    const keys = Object.keys(current).filter(k => current[k] != null && stored[k] != null);
+    return keys.some(k => k !== 'size' && k !== 'length') && keys.every(k => current[k] === stored[k]);
+}
+
+// Read a MEMFS file as a stream of STREAM_CHUNK_SIZE pieces, so handing it
+// on never needs a second whole copy in JS
+function readFileStream(path) {
+    const FS = wasmModule.FS;
+    const stream = FS.open(path, 'r');
+    return new ReadableStream({
+        pull(controller) {
+            const chunk = new Uint8Array(STREAM_CHUNK_SIZE);
+            const n = FS.read(stream, chunk, 0, chunk.length);
+            if (n > 0) {
+                controller.enqueue(n < chunk.length ? chunk.subarray(0, n) : chunk);
+            } else {
+                FS.close(stream);
+                controller.close();
+            }
+        },
+        cancel() {
+            FS.close(stream);
+        },
+    });
+}
+
+// Write the cache file of the model just loaded (its streamed source is gone
+// by now) and move it out of MEMFS into the persistent store. Failing to
+// cache never fails the load.
+async function storeModelCache(cache, key, source) {
+    try {
+        if (!wasmModule._bitnet_write_model_cache()) {
+            throw new Error('bitnet_write_model_cache failed');
+        }
+        const { size } = wasmModule.FS.stat(MODEL_CACHE_FILE);
+        await cache.put(key, readFileStream(MODEL_CACHE_FILE), {
+            hash: wasmModule.UTF8ToString(wasmModule._bitnet_get_model_hash()),
+            size,
+            source,
+        });
+    } catch (error) {
+        console.warn('Could not store the preprocessed model cache:', error);
+    } finally {
+        try { wasmModule.FS.unlink(MODEL_CACHE_FILE); } catch {}
+    }
+}
+
+function applyLoadOptions(options) {
+    if (options.threads !== undefined) wasmModule._bitnet_set_n_threads(options.threads);
+    if (options.memoryMb !== undefined || options.nCtx !== undefined) {
+        wasmModule._bitnet_set_memory_budget(options.memoryMb || 0, options.nCtx || 0);
+    }
+    if (options.kvType !== undefined) wasmModule._bitnet_set_kv_cache_type(options.kvType, options.kvType);
+}
+
+async function handleLoad(message) {
+    const { id, options = {} } = message;
+    requireModule();
+    // Switching models: free the old one before the new one is staged, so
+    // the two are never resident together
+    if (wasmModule._bitnet_is_model_loaded()) {
+        wasmModule._bitnet_free_model();
+    }
+    applyLoadOptions(options);
+
+    let result;
+    let cachedLoad = false;
+    if (message.bytes) {
+        result = loadModelFromBytes(message.bytes);
+    } else {
+        const key = message.url || message.path;
+        if (!key) {
+            throw new Error('load needs url, path or bytes');
+        }
+
+        // A preprocessed cache from an earlier run loads without validation,
+        // so it is used only while its source is unchanged, and only if it
+        // reports the model hash it was stored with
+        const cache = options.cache === false ? null : await openModelCache(options.cacheDir ? { dir: options.cacheDir } : {});
+        let cached = cache && await cache.get(key);
+        if (cached && !(await cacheIsCurrent(message, cached))) {
+            cached = null;
+        }
+        if (cached) {
+            result = await streamModelIntoWasm(id, cached.response);
+            cachedLoad = result === 1 &&
+                wasmModule.UTF8ToString(wasmModule._bitnet_get_model_hash()) === cached.hash;
+            if (result === 1 && !cachedLoad) {
+                wasmModule._bitnet_free_model();
+            }
+        }
+
+        if (!cachedLoad) {
+            // Stale or unusable cache entry: drop it and load the source
+            if (cache) {
+                await cache.delete(key).catch(() => {});
+            }
+            const { response, source } = await openModelSource(message);
+            if (cache) {
+                wasmModule.ccall('bitnet_set_cache_export', null, ['string'], [MODEL_CACHE_FILE]);
+            }
+            try {
+                result = await streamModelIntoWasm(id, response);
+                if (result === 1 && cache) {
+                    await storeModelCache(cache, key, source);
+                }
+            } finally {
+                wasmModule.ccall('bitnet_set_cache_export', null, ['string'], ['']);
+            }
+        }
+    }
+
+    if (result !== 1) {
+        throw new Error('BitNet failed to load model');
+    }
+    return {
+        vocabSize: wasmModule._bitnet_get_vocab_size(),
+        nEmbd: wasmModule._bitnet_get_embedding_dim(),
+        nLayer: wasmModule._bitnet_get_num_layers(),
+        hash: wasmModule.UTF8ToString(wasmModule._bitnet_get_model_hash()),
+        cached: cachedLoad,
+    };
+}
+
+function compileGrammar(grammar) {
+    const handle = grammar.schema !== undefined
+        ? wasmModule.ccall('bitnet_grammar_compile_json_schema', 'number', ['string'],
+                           [typeof grammar.schema === 'string' ? grammar.schema : JSON.stringify(grammar.schema)])
+        : wasmModule.ccall('bitnet_grammar_compile', 'number', ['string'], [grammar.gbnf]);
+    if (!handle) {
+        throw new Error('Failed to compile grammar');
+    }
+    return handle;
+}
+
+// Concatenate the pending pieces into one buffer and transfer it
+function flushTokens(id, pieces, count) {
+    if (pieces.length === 0) return;
+    let size = 0;
+    for (const piece of pieces) size += piece.length;
+    const bytes = new Uint8Array(size);
+    let offset = 0;
+    for (const piece of pieces) {
+        bytes.set(piece, offset);
+        offset += piece.length;
+    }
+    pieces.length = 0;
+    post({ id, type: 'tokens', bytes: bytes.buffer, count }, [bytes.buffer]);
+}
+
+async function handleGenerate(message) {
+    const { id } = message;
+    requireModule();
+    if (!wasmModule._bitnet_is_model_loaded()) {
+        throw new Error('Model not loaded');
+    }
+
+    const grammar = message.grammar ? compileGrammar(message.grammar) : 0;
+    try {
+        const started = wasmModule.ccall('bitnet_generate_begin_grammar', 'number',
+                                         ['string', 'number', 'number'],
+                                         [message.prompt, message.maxTokens || 0, grammar]);
+        if (!started) {
+            if (cancelled.has(id)) {
+                return { tokens: 0, cancelled: true };
+            }
+            throw new Error('Failed to start generation');
+        }
+
+        // Pieces are copied out of the heap once, batched, and transferred
+        const pieces = [];
+        let count = 0;
+        let pendingCount = 0;
+        let lastYield = performance.now();
+        for (;;) {
+            const piecePtr = wasmModule._bitnet_generate_next();
+            if (!piecePtr) break;
+
+            let end = piecePtr;
+            while (wasmModule.HEAPU8[end] !== 0) end++;
+            if (end > piecePtr) {
+                pieces.push(wasmModule.HEAPU8.slice(piecePtr, end));
+            }
+            count++;
+            pendingCount++;
+
+            // Let cancel messages in between tokens, without paying a
+            // message-loop round trip for every token
+            if (performance.now() - lastYield >= YIELD_INTERVAL_MS) {
+                flushTokens(id, pieces, pendingCount);
+                pendingCount = 0;
+                await yieldToMessages();
+                lastYield = performance.now();
+            }
+        }
+        flushTokens(id, pieces, pendingCount);
+
+        return { tokens: count, cancelled: cancelled.has(id) };
+    } finally {
+        if (grammar) {
+            wasmModule._bitnet_grammar_free(grammar);
+        }
+    }
+}
+
+function handleStats() {
+    requireModule();
+    return {
+        generation: JSON.parse(wasmModule.UTF8ToString(wasmModule._bitnet_get_stats())),
+        memory: JSON.parse(wasmModule.UTF8ToString(wasmModule._bitnet_get_memory_plan())),
+        modelLoaded: wasmModule._bitnet_is_model_loaded() === 1,
+        cached: wasmModule._bitnet_model_is_cached() === 1,
+    };
+}
+
+function handleUnload() {
+    requireModule()._bitnet_free_model();
+    return true;
+}
+
+const handlers = {
+    init: handleInit,
+    load: handleLoad,
+    generate: handleGenerate,
+    stats: handleStats,
+    unload: handleUnload,
+};
+
+let queue = Promise.resolve();
+
+function onMessage(message) {
+    if (message.type === 'cancel') {
+        // Requests that already finished have nothing to cancel
+        if (!queued.has(message.id)) return;
+        cancelled.add(message.id);
+        if (running === message.id && wasmModule) {
+            wasmModule._bitnet_cancel();
+        }
+        return;
+    }
+
+    const handler = handlers[message.type];
+    queued.add(message.id);
+    queue = queue.then(async () => {
+        const { id } = message;
+        if (cancelled.delete(id)) {
+            queued.delete(id);
+            post({ id, type: 'error', message: 'Cancelled', cancelled: true });
+            return;
+        }
+        running = id;
+        // Before 'started': from then on the host may cancel this id through
+        // the shared flag, and that must stick
+        if (wasmModule) wasmModule._bitnet_cancel_arm(id);
+        post({ id, type: 'started' });
+        try {
+            if (!handler) {
+                throw new Error(`Unknown request type ${message.type}`);
+            }
+            post({ id, type: 'done', result: await handler(message) });
+        } catch (error) {
+            post({ id, type: 'error', message: error.message || String(error), cancelled: cancelled.has(id) });
+        } finally {
+            running = null;
+            queued.delete(id);
+            cancelled.delete(id);
+        }
+    });
+}
+
+if (isNode && typeof self === 'undefined') {
+    const { parentPort } = await import('node:worker_threads');
+    port = parentPort;
+    port.on('message', onMessage);
+} else {
+    port = self;
+    self.onmessage = event => onMessage(event.data);
+}
@@ -0,0 +1,7 @@
+// Upstream BitNet MAD kernels for the WASM build. ggml_vec_dot_i2_i8_s is
+// provided by ggml-bitnet-mad-wasm.cpp, so the upstream definition is renamed
+// out of the way; everything else (quantize_i2_s, ...) is used as is.
+
+#define ggml_vec_dot_i2_i8_s ggml_vec_dot_i2_i8_s_upstream
+#include "../3rdparty/BitNet/src/ggml-bitnet-mad.cpp"
+#undef ggml_vec_dot_i2_i8_s
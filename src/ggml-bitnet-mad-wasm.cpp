@@ -0,0 +1,101 @@
+// i2_s x i8 dot product for WebAssembly
+//
+// Replaces ggml_vec_dot_i2_i8_s from 3rdparty/BitNet/src/ggml-bitnet-mad.cpp,
+// which only has AVX2 and NEON bodies and leaves the result unset elsewhere.
+// The upstream file is compiled through ggml-bitnet-mad-upstream.cpp with its
+// copy of the symbol renamed, so quantize_i2_s and friends still come from it.
+// Native builds keep the upstream kernel and only use the scalar reference
+// here (bitnet_kernel_selftest).
+//
+// i2_s layout: blocks of 128 weights packed into 32 bytes. Weight j of a block
+// lives in byte j % 32 at bit offset 6 - 2 * (j / 32) and holds q in {0, 1, 2}
+// for {-1, 0, +1}. Like the upstream kernels this returns sum(q * y); the
+// caller removes the +1 bias using the activation sums and applies the scales.
+
+#include <cstddef>
+#include <cstdint>
+
+#if defined(__wasm_simd128__)
+#include <wasm_simd128.h>
+#endif
+
+#define QK_I2_S 128
+
+extern "C" {
+
+void ggml_vec_dot_i2_i8_s_ref(int n, float * s, size_t bs, const void * vx, size_t bx, const void * vy, size_t by, int nrc);
+void ggml_vec_dot_i2_i8_s(int n, float * s, size_t bs, const void * vx, size_t bx, const void * vy, size_t by, int nrc);
+
+// Scalar reference, also the fallback when SIMD128 is disabled
+void ggml_vec_dot_i2_i8_s_ref(int n, float * s, size_t bs, const void * vx, size_t bx, const void * vy, size_t by, int nrc) {
+    (void) bs; (void) bx; (void) by; (void) nrc;
+
+    const uint8_t * x = static_cast<const uint8_t *>(vx);
+    const int8_t  * y = static_cast<const int8_t *>(vy);
+    const int nb = n / QK_I2_S;
+
+    int32_t sumi = 0;
+    for (int i = 0; i < nb; ++i) {
+        const uint8_t * xb = x + i * 32;
+        const int8_t  * yb = y + i * QK_I2_S;
+        for (int g = 0; g < 4; ++g) {
+            const int shift = 6 - 2 * g;
+            for (int k = 0; k < 32; ++k) {
+                sumi += ((xb[k] >> shift) & 0x03) * yb[g * 32 + k];
+            }
+        }
+    }
+    *s = static_cast<float>(sumi);
+}
+
+#if defined(__EMSCRIPTEN__) && defined(__wasm_simd128__)
+
+// Per block: unpack the four 2-bit planes with shift + mask, multiply by the
+// activations with widening i8 -> i16 products, and sum the 16 products per
+// lane in i16 (|sum| <= 16 * 2 * 128, no overflow). The block total is then
+// widened to i32 once, so the hot loop stays in 16-bit lanes.
+void ggml_vec_dot_i2_i8_s(int n, float * s, size_t bs, const void * vx, size_t bx, const void * vy, size_t by, int nrc) {
+    (void) bs; (void) bx; (void) by; (void) nrc;
+
+    const uint8_t * x = static_cast<const uint8_t *>(vx);
+    const int8_t  * y = static_cast<const int8_t *>(vy);
+    const int nb = n / QK_I2_S;
+
+    const v128_t mask = wasm_i8x16_splat(0x03);
+    v128_t acc = wasm_i32x4_splat(0);
+
+    for (int i = 0; i < nb; ++i) {
+        const v128_t x0 = wasm_v128_load(x + i * 32);
+        const v128_t x1 = wasm_v128_load(x + i * 32 + 16);
+        const int8_t * yb = y + i * QK_I2_S;
+
+        v128_t acc16 = wasm_i16x8_splat(0);
+        for (int g = 0; g < 4; ++g) {
+            const uint32_t shift = 6 - 2 * g;
+            const v128_t q0 = wasm_v128_and(wasm_u8x16_shr(x0, shift), mask);
+            const v128_t q1 = wasm_v128_and(wasm_u8x16_shr(x1, shift), mask);
+            const v128_t y0 = wasm_v128_load(yb + g * 32);
+            const v128_t y1 = wasm_v128_load(yb + g * 32 + 16);
+
+            acc16 = wasm_i16x8_add(acc16, wasm_i16x8_extmul_low_i8x16(q0, y0));
+            acc16 = wasm_i16x8_add(acc16, wasm_i16x8_extmul_high_i8x16(q0, y0));
+            acc16 = wasm_i16x8_add(acc16, wasm_i16x8_extmul_low_i8x16(q1, y1));
+            acc16 = wasm_i16x8_add(acc16, wasm_i16x8_extmul_high_i8x16(q1, y1));
+        }
+        acc = wasm_i32x4_add(acc, wasm_i32x4_extadd_pairwise_i16x8(acc16));
+    }
+
+    const int32_t sumi = wasm_i32x4_extract_lane(acc, 0) + wasm_i32x4_extract_lane(acc, 1) +
+                         wasm_i32x4_extract_lane(acc, 2) + wasm_i32x4_extract_lane(acc, 3);
+    *s = static_cast<float>(sumi);
+}
+
+#elif defined(__EMSCRIPTEN__)
+
+void ggml_vec_dot_i2_i8_s(int n, float * s, size_t bs, const void * vx, size_t bx, const void * vy, size_t by, int nrc) {
+    ggml_vec_dot_i2_i8_s_ref(n, s, bs, vx, bx, vy, by, nrc);
+}
+
+#endif
+
+}
@@ -0,0 +1,22 @@
+// Validates the i2_s dot product kernel against its scalar reference.
+// Needs no model; run after building with SIMD (the default) or BITNET_SIMD=0.
+
+async function kernelSelftest() {
+    console.log('🚀 i2_s kernel self-test starting...');
+
+    const BitNetModule = require('../bitnet.js');
+    const bitnet = await BitNetModule();
+    console.log('✅ Module loaded');
+
+    const mismatches = bitnet._bitnet_kernel_selftest();
+    if (mismatches !== 0) {
+        console.log(`❌ ${mismatches} results differ from the scalar reference`);
+        process.exit(1);
+    }
+    console.log('✅ SIMD kernel matches the scalar reference bit for bit');
+}
+
+kernelSelftest().catch(error => {
+    console.error('❌ Self-test failed:', error);
+    process.exit(1);
+});
@@ -0,0 +1,63 @@
+// Drives the worker runtime (src/bitnet_worker.js) through its client from a
+// Node worker_thread: load, a streamed generation, a cancelled generation and
+// stats. The main thread must stay responsive throughout.
+const fs = require('fs');
+const path = require('path');
+
+async function workerTest() {
+    console.log('🚀 Worker runtime test starting...');
+
+    const modelPath = path.resolve(process.argv[2] || 'models/BitNet-b1.58-2B-4T/ggml-model-i2_s.gguf');
+    if (!fs.existsSync(modelPath)) {
+        console.log('❌ BitNet model file not found:', modelPath);
+        return;
+    }
+
+    const { BitNetClient } = await import('../src/bitnet_client.js');
+    const bitnet = await BitNetClient.create();
+    console.log(`✅ Worker initialized (${bitnet.threads} thread(s))`);
+
+    // Count main-thread ticks while the worker computes
+    let ticks = 0;
+    const ticker = setInterval(() => ticks++, 10);
+
+    try {
+        const info = await bitnet.load({ path: modelPath }, { cache: false });
+        console.log(`✅ Model loaded: vocab=${info.vocabSize}, embd=${info.nEmbd}, layers=${info.nLayer}`);
+
+        let streamed = 0;
+        const full = await bitnet.generate('The capital of France is', {
+            maxTokens: 16,
+            onToken: () => streamed++,
+        });
+        console.log(`✅ Generated ${full.tokens} tokens in ${streamed} batches: "${full.text}"`);
+        if (full.cancelled || full.tokens === 0) {
+            throw new Error('generation produced no tokens');
+        }
+
+        const request = bitnet.generate('Once upon a time', {
+            maxTokens: 512,
+            onToken: () => request.cancel(),
+        });
+        const partial = await request;
+        if (!partial.cancelled || partial.tokens >= 512) {
+            throw new Error('cancel did not stop the generation');
+        }
+        console.log(`✅ Cancelled after ${partial.tokens} tokens`);
+
+        const stats = await bitnet.stats();
+        console.log(`✅ Stats: decode ${stats.generation.decode_tokens_per_sec.toFixed(1)} tok/s, n_ctx ${stats.memory.n_ctx}`);
+        console.log(`✅ Main thread ran ${ticks} timer ticks meanwhile`);
+        if (ticks === 0) {
+            throw new Error('main thread was blocked');
+        }
+    } finally {
+        clearInterval(ticker);
+        await bitnet.terminate();
+    }
+}
+
+workerTest().catch(error => {
+    console.error('❌ Worker test failed:', error);
+    process.exit(1);
+});